@@ -36,16 +36,53 @@ This file is not required as a random intialization can be generated by the algo
 - Each line is a datapoint (in the same order as the dataset file)
 - Each line has only one column that is a number between 1 and K (number of desired clusters) corresponding to the clusters in with the point should initialy be clustered in.
 
+####### DATA DRIVEN INITIALISATION #######
+kmeans draws K k-means++ seeds among the expression profiles (Hamming distance) and gives each point the label of its nearest seed, grow keeps these labels on the points
+agreeing with half of their neighbours and grows the clusters from them over the neighbouring graph. Both keep the best of 3 draws and only depend on seed=.
+
+####### WARM START #######
+With warm=folder/outputFileName as initialisation, the thetas and betas of a previous run are read from its .theta and .clust files (and its labels and posteriors from .csv and .posteriors.npy when present),
+the densities and posteriors being computed from them instead of 10 random restarts. The number of genes must match the data file, K is the number of rows of the .theta file and fixed keeps the beta given.
+
 ####### PARAMETERS INPUT ########
 The parameters for the algorithm are as follow [parameter name] indicates the parameter is mandatory {parameter name} indicates it's optional [param 1 | param2] indicates a choice
-./EM [path to data_file] [path neighbouring file] ["rand" | path to initialisation file] [initial value for beta] [number of clusters K] [result folder] [outputFileName] [number of clusters changed from one iteration to the next to assume convergence] {"fixed" (if present, beta will be fixed to initial value instead of being estimated)}
+./EM [path to data_file] [path neighbouring file] ["rand" | "kmeans" | "grow" | path to initialisation file | warm=folder/outputFileName] [initial value for beta] [number of clusters K] [result folder] [outputFileName] [number of clusters changed from one iteration to the next to assume convergence] {"fixed" (if present, beta will be fixed to initial value instead of being estimated)} {seed=N} {partition=path to coordinates file} {sparse=m} {tolerance=x} {radius=r | knn=k} {threads=n} {npy} {snapshots=n} {betas=schedule} {segments=n} {estep=meanfield|icm|gibbs} {profile=file}
+
+####### BETA PATH #######
+betas=0:2:0.25 (or a list betas=0,0.5,1) fits every beta of the schedule with fixed betas, each fit starting from the one converged at the previous beta,
+writing outputFileName.betaB.* and the likelihood versus beta table outputFileName.path. segments=n cuts the schedule in n independent segments run side by side.
+
+####### E STEP ENGINES #######
+estep=icm or estep=gibbs replaces the mean field E step by 3 sweeps of ICM or Gibbs sampling over a colouring of the graph, keeping one label per point.
+Gibbs draws only depend on seed=, the sweep and the point, and rarely stop changing labels so tolerance=x is the better convergence test.
+
+####### GRAPH FROM COORDINATES #######
+With radius=r (or knn=k) the neighbouring file argument is a x,y,z coordinates file (data/3D_coordinates.csv) and the graph is built from it on threads=n threads.
+`./EM graph coordinates.csv graph.nei radius=r` writes the graph as a neighbouring file, radius=3.05 gives back data/neighbouring_graph.nei.
+
+####### BATCH RUNS #######
+`./EM batch graph.nei manifest.txt report.tsv {jobs=n} {threads=n} {memory=MB}` fits every line of the manifest (the usual parameters without the neighbouring file) sharing the graph and the datasets,
+jobs=n runs at a time within the memory budget, each one logging to outputFileName.log, report.tsv giving the iterations, likelihood and wall time of each run.
+
+####### DISTRIBUTED RUNS #######
+`make mpi` builds the program with MPI, `mpirun -np P ./EM ...` then splits the neighbouring graph in P blocks, each process iterating on its own points.
+The blocks are cut along the coordinates given with partition=data/3D_coordinates.csv, or grown over the neighbouring graph otherwise.
+Processes exchange the posteriors and labels of the points on the block boundaries at each sweep, results match the serial ones within the mean field tolerance.
+
+####### SINGLE PRECISION #######
+`make single` builds EM_single, storing posteriors and cell densities in float, `make precision` compares it against the double precision build (see ./EM compare folderA/nameA folderB/nameB).
+
+####### REGRESSION CHECK #######
+`make regression` runs fixed seed fits on synthetic expression over the data/ graph (./EM synthetic) and on synthetic point clouds, each run appending the wall time and peak memory
+of its phases to a profile (profile=file), and `./EM regress` checks labels, likelihood, thetas and phase times (relative to a calibration loop timed by each run) against the golden runs of regression/ (`make regression-golden` updates them).
 
 ####### OUTPUT FILES #######
 The algorithm produces 4 files when convergence is reached
 - outputFileName.csv contains the clustering results in the same format as the initialization file
 - outputFileName.thetas contains a table with the final values of the theta parameters
 - outputFileName.clust contains a table with the final value of beta and the number of points for each cluster
-- outputFileName.summary contains information about the run, namely the numbers of clusters, the final log likelihood value and the number of iterations needed to reach convergence
+- outputFileName.summary contains information about the run, namely the numbers of clusters, the final log likelihood value, the number of iterations needed to reach convergence, the initialisation and the seconds it took
+With npy, labels, N x K posteriors, thetas and betas are also written as .npy arrays, and every n iterations with snapshots=n (by a background thread).
 ****************************************************************************************************/
 
 #include "EM.h"
@@ -57,12 +94,19 @@ The algorithm produces 4 files when convergence is reached
 /*Parses one line, places numbers un int vector*/
 int parse_vect(char * line, int * res) {
 	int i=0;
-	char delims[] = "\t";
-	char *result = NULL;
-	result = strtok( line, delims );
-	while( result != NULL) {
-		res[i] = atoi(result);
-		result = strtok( NULL, delims );
+
+	/*tab separated fields, scanned without strtok so that datasets can be loaded by several threads*/
+	while(*line != '\0') {
+		while(*line == '\t') {
+			line++;
+		}
+		if(*line == '\0') {
+			break;
+		}
+		res[i] = atoi(line);
+		while(*line != '\t' && *line != '\0') {
+			line++;
+		}
 		i++;
 	}
 	return i;
@@ -76,48 +120,186 @@ void load_data(FILE * data /*I*/,dataSet * myData/*I\O*/) {
 	/*declarations*/
 	int i=0;
 	char line[LG_LIG_MAX];
-	int length;
+	int length=0;
 
-	myData->obs = (dataPoint *)malloc(sizeof(dataPoint)*LG_LIG_MAX);
+	myData->obs = (dataPoint *)emMalloc(sizeof(dataPoint)*LG_LIG_MAX);
 
 	/*instructions*/
-	while(fgets(line,LG_LIG_MAX+1,data) != NULL) {	
-		(myData->obs)[i].expVect = (int *)malloc(sizeof(int)*LG_GENES_MAX);
+	while(fgets(line,sizeof(line),data) != NULL) {	
+		(myData->obs)[i].expVect = (int *)emMalloc(sizeof(int)*LG_GENES_MAX);
 		if ((myData->obs)[i].expVect == NULL) {
 			printf("Out of memory data\n");
 			exit(-1);
 		}
 		length = parse_vect(line,(myData->obs)[i].expVect);			
+		/*trimmed to the vector read, a batch run keeping several datasets*/
+		(myData->obs)[i].expVect = (int *)emRealloc((myData->obs)[i].expVect,sizeof(int)*(length+1));
 		i++;
 	}
+	myData->obs = (dataPoint *)emRealloc(myData->obs,sizeof(dataPoint)*(i+1));
+	if (myData->obs == NULL) {
+		printf("Out of memory data\n");
+		exit(-1);
+	}
 
 	/*creating return variable*/
 	myData->length = length;
 	myData->num = i;
+	myData->numOwned = i;
+	myData->numGlobal = i;
+	myData->globalId = NULL;
+	myData->halo = NULL;
+	packExpression(myData);
+	dedupProfiles(myData);
 
 }
 
-/*Parses neighbouring files, first number is number of neighbours then indexes*/
-int parse_nei(char * line, int * res) {
-	int i=0;
-	char delims[] = "\t";
-	char *result = NULL;
-	int length;
+/*Releases a serial dataset, its neighbours only if ownNeighbours is set (they point in a shared graph otherwise)*/
+void freeDataset(dataSet * myData/*I\O*/,int ownNeighbours/*I*/) {
+	int i;
+
+	for(i=0;i<myData->num;i++) {
+		free(myData->obs[i].expVect);
+		free(myData->obs[i].bits);
+		if(ownNeighbours) {
+			free(myData->obs[i].nei);
+		}
+	}
+	free(myData->obs);
+	free(myData->profile);
+	free(myData->profileCell);
+	free(myData->profileCount);
+	myData->obs = NULL;
+	myData->num = 0;
+}
 
+/*Packs the expression vectors (without the cell ID) in words of bits, bit j-1 of the vector is gene j*/
+void packExpression(dataSet * myData/*I\O*/) {
+	int i,j;
 
-	result = strtok( line, delims );
-	while( result != NULL) {
-		if(i == 0) {
-			length = atoi(result);
+	myData->numWords = (myData->length-1+BITS_PER_WORD-1)/BITS_PER_WORD;
+	for(i=0;i<myData->num;i++) {
+		myData->obs[i].bits = NULL;
+		if(myData->obs[i].expVect == NULL) {
+			continue;
+		}
+		myData->obs[i].bits = (unsigned long *)emCalloc(myData->numWords+1,sizeof(unsigned long));
+		if (myData->obs[i].bits == NULL) {
+			printf("Out of memory data\n");
+			exit(-1);
+		}
+		for(j=1;j<myData->length;j++) {
+			if(myData->obs[i].expVect[j] == 1) {
+				myData->obs[i].bits[(j-1)/BITS_PER_WORD] |= 1UL<<((j-1)%BITS_PER_WORD);
+			}
+		}
+	}
+}
+
+/*Hash of a packed expression vector*/
+unsigned long hashProfile(unsigned long * bits/*I*/,int numWords/*I*/) {
+	unsigned long hash = 2166136261UL;
+	int w;
+
+	for(w=0;w<numWords;w++) {
+		hash = (hash^bits[w])*16777619UL;
+		hash ^= hash>>15;
+	}
+	return hash;
+}
+
+/*Groups the owned points by distinct expression profile
+*
+*Points are hashed on their packed expression vector into an open addressing table, each profile is represented by its first point
+*/
+void dedupProfiles(dataSet * myData/*I\O*/) {
+	int * table;
+	int tableSize=1,i,u,slot;
+	unsigned long * bits;
+
+	while(tableSize < 2*myData->numOwned) {
+		tableSize *= 2;
+	}
+	table = (int *)emMalloc(sizeof(int)*tableSize);
+	myData->profile = (int *)emMalloc(sizeof(int)*(myData->num+1));
+	myData->profileCell = (int *)emMalloc(sizeof(int)*(myData->numOwned+1));
+	myData->profileCount = (int *)emMalloc(sizeof(int)*(myData->numOwned+1));
+	if (table == NULL || myData->profile == NULL || myData->profileCell == NULL || myData->profileCount == NULL) {
+		printf("Out of memory profiles\n");
+		exit(-1);
+	}
+	for(slot=0;slot<tableSize;slot++) {
+		table[slot] = -1;
+	}
+
+	myData->numProfiles = 0;
+	for(i=0;i<myData->numOwned;i++) {
+		bits = myData->obs[i].bits;
+		slot = (int)(hashProfile(bits,myData->numWords)&(unsigned long)(tableSize-1));
+		/*linear probing until the profile or a free slot is found*/
+		while(table[slot] >= 0 && memcmp(myData->obs[myData->profileCell[table[slot]]].bits,bits,sizeof(unsigned long)*myData->numWords) != 0) {
+			slot = (slot+1)&(tableSize-1);
+		}
+		if(table[slot] < 0) {
+			u = myData->numProfiles++;
+			table[slot] = u;
+			myData->profileCell[u] = i;
+			myData->profileCount[u] = 0;
+		}
+		myData->profile[i] = table[slot];
+		myData->profileCount[table[slot]]++;
+	}
+	/*halo points are never evaluated*/
+	for(i=myData->numOwned;i<myData->num;i++) {
+		myData->profile[i] = -1;
+	}
+	free(table);
+}
+
+/*Reads a whole line, line (NULL at first) growing as needed
+returns its length, -1 at the end of the file*/
+int readLine(FILE * data/*I*/,char ** line/*I\O*/,int * size/*I\O*/) {
+	int length=0;
+
+	if(*line == NULL) {
+		*size = LG_NEI_MAX;
+		*line = (char *)emMalloc(*size);
+	}
+	while(*line != NULL && fgets(*line+length,*size-length,data) != NULL) {
+		length += (int)strlen(*line+length);
+		if((*line)[length-1] == '\n') {
+			return length;
+		}
+		if(length == *size-1) {
+			*size *= 2;
+			*line = (char *)emRealloc(*line,*size);
 		}
-		else{
-			res[i-1] = atoi(result)-1;
+	}
+	if (*line == NULL) {
+		printf("Out of memory lines\n");
+		exit(-1);
+	}
+	return length > 0 ? length : -1;
+}
 
+/*Parses a line of a neighbouring file, number of neighbours then indexes (from 1, stored from 0), storing at most maxNei of them
+returns the number of indexes on the line*/
+int parse_nei(char * line/*I*/,int * res/*O*/,int maxNei/*I*/) {
+	char * cursor = line;
+	char * end;
+	long value;
+	int count=-1;
+
+	value = strtol(cursor,&end,10);
+	while(end != cursor) {
+		if(count >= 0 && count < maxNei) {
+			res[count] = (int)value-1;
 		}
-		result = strtok( NULL, delims );
-		i++;
+		count++;
+		cursor = end;
+		value = strtol(cursor,&end,10);
 	}
-	return length;
+	return count > 0 ? count : 0;
 }
 
 
@@ -125,34 +307,291 @@ int parse_nei(char * line, int * res) {
 returns : void
 */
 void load_nei(FILE * data /*I*/,dataSet * myData/*I\O*/) {
-	/*declarations*/
-	int i=0;
-	char line[LG_NEI_MAX];
-	int length;
+	int num;
+	int * start;
+	int * adj;
+
+	num = load_graph(data,&start,&adj);
+	setNeighbours(myData,num,start,adj,0);
+	free(start);
+	free(adj);
+}
 
-	/*instructions*/
-	while(fgets(line,LG_LIG_MAX+1,data) != NULL) {	
-		(myData->obs)[i].nei = (int *)malloc(sizeof(int)*LG_NEI_MAX);
-		if ((myData->obs)[i].nei == NULL) {
-			printf("Out of memory neighbours\n");
+
+/**********************************START Model workspace*****************************************/
+/* All the buffers of a model are carved once from a single arena when it is created, the EM iterations then run
+* without any heap allocation (make debug prints the number of allocations of each iteration to check it).
+*/
+
+#ifdef EM_DEBUG
+static unsigned long heapAllocations = 0; /*number of heap allocations since the start*/
+#ifndef EM_NO_THREADS
+static pthread_mutex_t heapAllocationsLock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+/*Counts one heap allocation, the pool threads and the jobs of a batch allocating concurrently*/
+static void countAllocation(void) {
+#ifndef EM_NO_THREADS
+	pthread_mutex_lock(&heapAllocationsLock);
+#endif
+	heapAllocations++;
+#ifndef EM_NO_THREADS
+	pthread_mutex_unlock(&heapAllocationsLock);
+#endif
+}
+
+/*Returns the number of heap allocations since the start*/
+static unsigned long allocationCount(void) {
+	unsigned long count;
+
+#ifndef EM_NO_THREADS
+	pthread_mutex_lock(&heapAllocationsLock);
+#endif
+	count = heapAllocations;
+#ifndef EM_NO_THREADS
+	pthread_mutex_unlock(&heapAllocationsLock);
+#endif
+	return count;
+}
+#endif
+
+/*Counted heap allocation functions*/
+void * emMalloc(size_t size) {
+#ifdef EM_DEBUG
+	countAllocation();
+#endif
+	return malloc(size);
+}
+
+void * emCalloc(size_t num, size_t size) {
+#ifdef EM_DEBUG
+	countAllocation();
+#endif
+	return calloc(num,size);
+}
+
+void * emRealloc(void * ptr, size_t size) {
+#ifdef EM_DEBUG
+	countAllocation();
+#endif
+	return realloc(ptr,size);
+}
+
+/*Returns a block of the arena aligned on ARENA_ALIGN bytes
+*An arena without base only measures the space requested, returning NULL
+*/
+void * arenaAlloc(arena * myArena/*I\O*/,size_t size/*I*/) {
+	void * block = NULL;
+
+	if(myArena->base != NULL) {
+		if(myArena->used+size > myArena->size) {
+			printf("Arena exhausted\n");
 			exit(-1);
 		}
-		length = parse_nei(line,(myData->obs)[i].nei);	
+		block = myArena->base+myArena->used;
+	}
+	myArena->used += (size+ARENA_ALIGN-1)/ARENA_ALIGN*ARENA_ALIGN;
+	return block;
+}
 
-		(myData->obs)[i].numNei = length;		
-		i++;
+/*Lays all the buffers of a model out in the arena, only measuring their size when the arena has no base*/
+static void layoutWorkspace(classif * myClassif/*I\O*/,arena * myArena/*I\O*/) {
+	int k;
+	int numClust = myClassif->numClust;
+	int num = myClassif->set.num;
+	int numProfiles = myClassif->set.numProfiles;
+	int length = myClassif->set.length;
+	int m = myClassif->sparseM;
+	int numThreads = myClassif->pool != NULL ? myClassif->pool->numThreads : 1;
+	double * thetas;
+	emReal * values;
+
+	myClassif->beta = (double *)arenaAlloc(myArena,sizeof(double)*numClust);
+	myClassif->clust = (int *)arenaAlloc(myArena,sizeof(int)*num);
+	myClassif->bestClust = (int *)arenaAlloc(myArena,sizeof(int)*num);
+
+	/*per cluster rows in one block*/
+	myClassif->parameters.theta = (double **)arenaAlloc(myArena,sizeof(double*)*numClust);
+	thetas = (double *)arenaAlloc(myArena,sizeof(double)*numClust*length);
+	myClassif->cellDensities = (emReal **)arenaAlloc(myArena,sizeof(emReal*)*numClust);
+	values = (emReal *)arenaAlloc(myArena,sizeof(emReal)*numClust*numProfiles);
+	if(myArena->base != NULL) {
+		for(k=0;k<numClust;k++) {
+			myClassif->parameters.theta[k] = thetas+k*length;
+			myClassif->cellDensities[k] = values+k*numProfiles;
+		}
 	}
-		
 
+	/*posteriors, dense or sparse*/
+	myClassif->tihm = NULL;
+	myClassif->topClust = NULL;
+	myClassif->topTihm = NULL;
+	myClassif->residual = NULL;
+	myClassif->profileTopClust = NULL;
+	myClassif->candidates = NULL;
+	myClassif->candidateMark = NULL;
+	myClassif->sparsePruned = m > 0 && m*(myClassif->set.maxNei+1) < numClust;
+	if(m > 0) {
+		myClassif->topClust = (int *)arenaAlloc(myArena,sizeof(int)*num*m);
+		myClassif->topTihm = (emReal *)arenaAlloc(myArena,sizeof(emReal)*num*m);
+		myClassif->residual = (emReal *)arenaAlloc(myArena,sizeof(emReal)*num);
+		myClassif->candidates = (int *)arenaAlloc(myArena,sizeof(int)*numClust);
+		myClassif->candidateMark = (char *)arenaAlloc(myArena,sizeof(char)*numClust);
+	}
+	if(myClassif->sparsePruned) {
+		myClassif->profileTopClust = (int *)arenaAlloc(myArena,sizeof(int)*numProfiles*m);
+		myClassif->profileDensityMax = (double *)arenaAlloc(myArena,sizeof(double)*numProfiles);
+		myClassif->profileDensitySum = (double *)arenaAlloc(myArena,sizeof(double)*numProfiles);
+		myClassif->profileDensityTotal = (double *)arenaAlloc(myArena,sizeof(double)*numProfiles);
+	}
+	else {
+		myClassif->tihm = (emReal **)arenaAlloc(myArena,sizeof(emReal*)*numClust);
+		values = (emReal *)arenaAlloc(myArena,sizeof(emReal)*numClust*num);
+		if(myArena->base != NULL) {
+			for(k=0;k<numClust;k++) {
+				myClassif->tihm[k] = values+k*num;
+			}
+		}
+	}
+
+	/*tables and scratch vectors of the E and M steps*/
+	myClassif->expBetaTable = (double *)arenaAlloc(myArena,sizeof(double)*numClust*(myClassif->set.maxNei+1));
+	myClassif->expBetaTableBeta = (double *)arenaAlloc(myArena,sizeof(double)*numClust);
+	myClassif->neiCount = (int *)arenaAlloc(myArena,sizeof(int)*numClust);
+	myClassif->logThetaTable = (double *)arenaAlloc(myArena,sizeof(double)*2*myClassif->set.numWords*BITS_PER_WORD*numClust);
+	myClassif->densityAcc = (double *)arenaAlloc(myArena,sizeof(double)*numClust);
+	myClassif->profileClust = (int *)arenaAlloc(myArena,sizeof(int)*numClust*numProfiles);
+	myClassif->thetaCounts = (double *)arenaAlloc(myArena,sizeof(double)*numClust*length);
+	myClassif->classCounts = (int *)arenaAlloc(myArena,sizeof(int)*numClust);
+	myClassif->sweepScratch = (double *)arenaAlloc(myArena,sizeof(double)*2*numClust);
+
+	/*likelihood cache*/
+	myClassif->cellPotts = (double *)arenaAlloc(myArena,sizeof(double)*myClassif->set.numOwned);
+	myClassif->pottsStale = (char *)arenaAlloc(myArena,sizeof(char)*myClassif->set.numOwned);
+	myClassif->staleCells = (int *)arenaAlloc(myArena,sizeof(int)*myClassif->set.numOwned);
+	myClassif->boundaryCells = (int *)arenaAlloc(myArena,sizeof(int)*myClassif->set.numOwned);
+	myClassif->pottsBeta = (double *)arenaAlloc(myArena,sizeof(double)*numClust);
+
+	/*beta estimation*/
+	myClassif->numBetaBlocks = (myClassif->set.numOwned+BETA_BLOCK-1)/BETA_BLOCK;
+	myClassif->betaPartials = (double *)arenaAlloc(myArena,sizeof(double)*myClassif->numBetaBlocks*(2*numClust+1));
+	myClassif->betaTotals = (double *)arenaAlloc(myArena,sizeof(double)*(2*numClust+1));
+	myClassif->betaProbeTable = (double *)arenaAlloc(myArena,sizeof(double)*2*(myClassif->set.maxNei+1));
+	myClassif->betaActive = (int *)arenaAlloc(myArena,sizeof(int)*numClust);
+	myClassif->betaMove = (int *)arenaAlloc(myArena,sizeof(int)*numClust);
+	myClassif->betaPrevious = (double *)arenaAlloc(myArena,sizeof(double)*numClust);
+	myClassif->betaGain = (double *)arenaAlloc(myArena,sizeof(double)*numClust);
+	myClassif->threadNeiCount = (int *)arenaAlloc(myArena,sizeof(int)*numThreads*numClust);
+	myClassif->threadPresent = (int *)arenaAlloc(myArena,sizeof(int)*numThreads*(myClassif->set.maxNei+1));
+
+	/*colouring and scores of the hard engines, a greedy colouring needs at most maxNei+1 colours*/
+	myClassif->colourStart = NULL;
+	myClassif->colourCells = NULL;
+	myClassif->cellColour = NULL;
+	myClassif->threadScores = NULL;
+	if(myClassif->engine != E_STEP_MEAN_FIELD) {
+		myClassif->colourStart = (int *)arenaAlloc(myArena,sizeof(int)*(myClassif->set.maxNei+2));
+		myClassif->colourCells = (int *)arenaAlloc(myArena,sizeof(int)*myClassif->set.numOwned);
+		myClassif->cellColour = (int *)arenaAlloc(myArena,sizeof(int)*myClassif->set.numOwned);
+		myClassif->threadScores = (double *)arenaAlloc(myArena,sizeof(double)*numThreads*numClust);
+	}
+}
+
+/*Allocates all the buffers of a model once numClust, sparseM and the dataset are set, betas are set to beta and posteriors to 0*/
+void createWorkspace(classif * myClassif/*I\O*/,double beta/*I*/) {
+	int i,j,k;
+	int width = myClassif->set.maxNei+1;
+	dataPoint * point;
+
+	/*the hard engines only keep the posterior of the label*/
+	if(myClassif->engine != E_STEP_MEAN_FIELD) {
+		myClassif->sparseM = 1;
+	}
+	if(myClassif->sparseM >= myClassif->numClust) {
+		myClassif->sparseM = 0;
+	}
+
+	/*measuring, then laying out for real*/
+	myClassif->workspace.base = NULL;
+	myClassif->workspace.used = 0;
+	layoutWorkspace(myClassif,&(myClassif->workspace));
+	myClassif->workspace.size = myClassif->workspace.used;
+	myClassif->workspace.used = 0;
+	myClassif->workspace.base = (char *)emCalloc(myClassif->workspace.size,1);
+	if (myClassif->workspace.base == NULL) {
+		printf("Out of memory workspace\n");
+		exit(-1);
+	}
+	layoutWorkspace(myClassif,&(myClassif->workspace));
+
+	for(k=0;k<myClassif->numClust;k++) {
+		myClassif->beta[k] = beta;
+		/*no exp(beta*c) row is valid yet*/
+		myClassif->expBetaTableBeta[k] = beta+1.0;
+		myClassif->expBetaTable[k*width] = 0;
+	}
+	clearPosteriors(myClassif);
+	myClassif->thetaStatsValid = 0;
+	myClassif->numStale = 0;
+	invalidateLikelihood(myClassif);
+	selectKernels(myClassif);
+
+	/*owned cells with a neighbour owned by another process, whose labels change without notice*/
+	myClassif->numBoundary = 0;
+	for(i=0;i<myClassif->set.numOwned;i++) {
+		point = &(myClassif->set.obs[i]);
+		for(j=0;j<point->numNei;j++) {
+			if(point->nei[j] >= myClassif->set.numOwned) {
+				myClassif->boundaryCells[myClassif->numBoundary++] = i;
+				break;
+			}
+		}
+	}
+	myClassif->sweepCount = 0;
+	if(myClassif->engine != E_STEP_MEAN_FIELD) {
+		colourGraph(myClassif);
+	}
+}
+
+/*Releases all the buffers of a model*/
+void freeWorkspace(classif * myClassif/*I\O*/) {
+	free(myClassif->workspace.base);
+	myClassif->workspace.base = NULL;
+	myClassif->workspace.size = 0;
+	myClassif->workspace.used = 0;
 }
 
+/*Bytes createWorkspace would allocate for a model once numClust, sparseM, pool and the dataset are set*/
+size_t workspaceSize(classif * myClassif/*I*/) {
+	classif model = *myClassif;
+	arena measure;
+
+	if(model.engine != E_STEP_MEAN_FIELD) {
+		model.sparseM = 1;
+	}
+	if(model.sparseM >= model.numClust) {
+		model.sparseM = 0;
+	}
+	measure.base = NULL;
+	measure.size = 0;
+	measure.used = 0;
+	layoutWorkspace(&model,&measure);
+	return measure.used;
+}
+
+/**********************************END Model workspace*****************************************/
+
+#ifndef EM_NO_THREADS
+/*The random initialisations of the jobs of a batch run share the generator of the C library, they take turns so that each job draws the labels of its seed*/
+static pthread_mutex_t randomLock = PTHREAD_MUTEX_INITIALIZER;
+#endif
 
 /*Initialize classification randomly
 *
 *The default number of random initialization is 10 (the one with the best initial likelihood is used to proceed), to modify it change the `numRand` parameter and recompile the code
 returns void*/
-void initClassifRand(dataSet set/*I*/,int numClust/*I*/, classif* myClassif/*I\O*/,double beta) {
-	int i,k;
+void initClassifRand(dataSet set/*I*/,int numClust/*I*/, classif* myClassif/*I\O*/,double beta,unsigned seed/*I*/) {
+	int i,k,label;
 	double logLike,bestLogLike;
 	int * bestClust;
 	int numRand = 10;
@@ -161,40 +600,29 @@ void initClassifRand(dataSet set/*I*/,int numClust/*I*/, classif* myClassif/*I\O
 	myClassif->set = set;
 	myClassif->numClust = numClust;
 
-	srand((unsigned)time(NULL));
-	myClassif->beta = (double *)malloc(sizeof(double)*myClassif->numClust);
-	myClassif->clust = (int *)malloc(sizeof(int)*set.num);
-	myClassif->parameters.theta = (double **)malloc(sizeof(double*)*numClust);
-
-	/*Init tihms to 0??*/
-	myClassif->tihm = (double **)malloc(sizeof(double*)*myClassif->numClust);
-	/*Init cell densities*/
-	myClassif->cellDensities = (double **)malloc(sizeof(double*)*myClassif->numClust);
-	
-	/*iter on clusters*/
-	for(k=0;k<numClust;k++) {
-		myClassif->tihm[k] = (double *)malloc(sizeof(double)*myClassif->set.num);
-		myClassif->cellDensities[k] = (double *)malloc(sizeof(double)*myClassif->set.num);
-		for(i=0;i<myClassif->set.num;i++){
-			myClassif->tihm[k][i] = 0;
-		}
-		myClassif->parameters.theta[k] = (double *)malloc(sizeof(double)*(set.length));
-		myClassif->beta[k] = beta;
-	}
-
+	/*Allocating all the model buffers, tihms set to 0*/
+	createWorkspace(myClassif,beta);
+#ifndef EM_NO_THREADS
+	pthread_mutex_lock(&randomLock);
+#endif
+	srand(seed);
 
-	/*Allocating memory for best classif*/
-	bestClust = (int *)malloc(sizeof(int)*set.num);
+	/*Memory for best classif*/
+	bestClust = myClassif->bestClust;
 	bestLogLike = -1e100;
 
 	/*Generate x random classif and take the one with the best likelihood*/
 	for(k=0;k<numRand;k++) {
 
 
-		/*iter on data points*/
-		for(i=0;i<set.num;i++) {
-			myClassif->clust[i] = rand()%numClust+1;
+		/*iter on data points, drawing for the full dataset so that a distributed run gets the same labels*/
+		for(i=0;i<set.numGlobal;i++) {
+			label = rand()%numClust+1;
+			if(localIndex(&set,i) >= 0) {
+				myClassif->clust[localIndex(&set,i)] = label;
+			}
 		}
+		invalidateLikelihood(myClassif);
 
 		/*Computing thetas*/
 		maxThetas(myClassif);
@@ -209,11 +637,15 @@ void initClassifRand(dataSet set/*I*/,int numClust/*I*/, classif* myClassif/*I\O
 			bestLogLike = logLike;
 			memcpy(bestClust,myClassif->clust,(set.num)*sizeof(int)); 
 		}
-		printf("Init %d likelihood : %e\n",k,logLike);
+		fprintf(myClassif->log,"Init %d likelihood : %e\n",k,logLike);
 	}
+#ifndef EM_NO_THREADS
+	pthread_mutex_unlock(&randomLock);
+#endif
 	
 	/*Assigning best random classif, no need to recompute thetas and thims, it will be done at first iteration*/
 	memcpy(myClassif->clust,bestClust,(set.num)*sizeof(int)); 
+	invalidateLikelihood(myClassif);
 
 
 	/*Computing thetas*/
@@ -222,9 +654,7 @@ void initClassifRand(dataSet set/*I*/,int numClust/*I*/, classif* myClassif/*I\O
 	computeCellDensities(myClassif);
 	/*computing tihms with 1 step fixed point*/
 	computeThims(myClassif,2);
-	printf("\tBest init has a likelihood of %e\n",bestLogLike);
-	
-	free(bestClust);
+	fprintf(myClassif->log,"\tBest init has a likelihood of %e\n",bestLogLike);
 
 	
 }
@@ -232,49 +662,41 @@ void initClassifRand(dataSet set/*I*/,int numClust/*I*/, classif* myClassif/*I\O
 /*Initialize classification from file
 returns void*/
 void initClassifFile(dataSet set/*I*/,FILE * data, classif* myClassif/*I\O*/,double beta) {
-	int i,k,maxClust=0;
+	int i,maxClust=0;
 	char line[LG_NEI_MAX];
+	int lineNum=0;
+	int * labels;
 
 
 	/*initializing parameters and setting set*/
 	myClassif->set = set;
 
-	srand((unsigned)time(NULL));
-	myClassif->clust = (int *)malloc(sizeof(int)*set.num);
+	/*the number of clusters is only known once the file is read*/
+	labels = (int *)emMalloc(sizeof(int)*set.num);
 
 	i=0;
 
 	/*reading cluters file*/
-	while(fgets(line,LG_LIG_MAX+1,data) != NULL) {	
+	while(fgets(line,LG_NEI_MAX,data) != NULL) {	
 		if(atoi(line) > maxClust){
 			maxClust = atoi(line);
 		}	
-		myClassif->clust[i] = atoi(line);
-		i++;
+		i = localIndex(&set,lineNum);
+		if(i >= 0) {
+			labels[i] = atoi(line);
+		}
+		lineNum++;
 
 	}
 	myClassif->numClust = maxClust;
-	printf("clusters :%d\n",myClassif->numClust);
-
-	myClassif->beta = (double *)malloc(sizeof(double)*myClassif->numClust);
-	myClassif->parameters.theta = (double **)malloc(sizeof(double*)*myClassif->numClust);
+	fprintf(myClassif->log,"clusters :%d\n",myClassif->numClust);
 
-	/*Init tihms to 0??*/
-	myClassif->tihm = (double **)malloc(sizeof(double*)*myClassif->numClust);
-	/*Init cell densities*/
-	myClassif->cellDensities = (double **)malloc(sizeof(double*)*myClassif->numClust);
-	
-	/*iter on clusters*/
-	for(k=0;k<myClassif->numClust;k++) {
-		myClassif->tihm[k] = (double *)malloc(sizeof(double)*myClassif->set.num);
-		myClassif->cellDensities[k] = (double *)malloc(sizeof(double)*myClassif->set.num);
-		for(i=0;i<myClassif->set.num;i++){
-			myClassif->tihm[k][i] = 0;
-		}
-		myClassif->parameters.theta[k] = (double *)malloc(sizeof(double)*(set.length));
-		myClassif->beta[k] = beta;
-	}
-	printf("thims\n");
+	/*Allocating all the model buffers, tihms set to 0*/
+	createWorkspace(myClassif,beta);
+	memcpy(myClassif->clust,labels,sizeof(int)*set.num);
+	invalidateLikelihood(myClassif);
+	free(labels);
+	fprintf(myClassif->log,"thims\n");
 
 	/*Computing thetas*/
 	maxThetas(myClassif);
@@ -285,509 +707,4983 @@ void initClassifFile(dataSet set/*I*/,FILE * data, classif* myClassif/*I\O*/,dou
 
 }
 
-/*Compute cell density for one cell one cluster*/
-double cellDensity(classif * myClassif/*i*/,int clust/*I*/,int cell/*I*/) {
-	int j;
-	double density=0;
-	double ret=0;
-	
-	/*Iter on genes*/
-	for(j=1;j<myClassif->set.length;j++) {
-		if(myClassif->set.obs[cell].expVect[j] == 1) {
-			density = log((double)myClassif->parameters.theta[clust][j]);
-		}
-		else {
-			density = log((double)1.0-myClassif->parameters.theta[clust][j]);
-		}
-		ret = ret+density;
-		
-	}
+/*Number of set bits of a word*/
+static int countBits(unsigned long word) {
+#ifdef __GNUC__
+	return __builtin_popcountl(word);
+#else
+	int count = 0;
 
+	while(word != 0) {
+		word &= word-1;
+		count++;
+	}
+	return count;
+#endif
+}
 
+/*Number of differing bits of two packed expression vectors*/
+int hammingDistance(unsigned long * a/*I*/,unsigned long * b/*I*/,int numWords/*I*/) {
+	int w,dist = 0;
 
-	return ret;
+	for(w=0;w<numWords;w++) {
+		dist += countBits(a[w]^b[w]);
+	}
+	return dist;
+}
 
+/*Moves the distance of the profiles handled by one thread to the last seed drawn*/
+static void seedDistanceWork(threadTask * task) {
+	seeding * seeds = (seeding *)task->data;
+	dataSet * set = &(seeds->model->set);
+	unsigned long * centre = seeds->centres+(seeds->numCentres-1)*set->numWords;
+	int p,first,last,dist;
+
+	threadRange(task,set->numProfiles,&first,&last);
+	for(p=first;p<last;p++) {
+		dist = hammingDistance(set->obs[set->profileCell[p]].bits,centre,set->numWords);
+		if(seeds->numCentres == 1 || dist < seeds->minDist[p]) {
+			seeds->minDist[p] = dist;
+			seeds->nearest[p] = seeds->numCentres-1;
+		}
+	}
 }
 
-/*Computes all cells densities*/
-void computeCellDensities(classif * myClassif/*I/O*/) {
-	int i,k;	
-	/*Iter on cells*/
-	for(i=0;i<myClassif->set.num;i++) {
-		/*Iter on clusters*/
-		for(k=0;k<myClassif->numClust;k++){
-			myClassif->cellDensities[k][i] = cellDensity(myClassif,k,i);
+/*Draws the numClust seeds of k-means++ among the owned profiles
+*
+*The first seed is drawn uniformly among the points, each next one with a probability proportional to its Hamming distance to the nearest seed
+*(the squared Euclidean distance of binary vectors). The draws only depend on seed and draw, a distributed run adding up the weights of every
+*process and taking the seed from the process it falls in, so that all of them share the same seeds. minDist and nearest are left set
+*/
+static void drawSeeds(seeding * seeds/*I\O*/,unsigned long seed/*I*/,unsigned long draw/*I*/) {
+	classif * myClassif = seeds->model;
+	dataSet * set = &(myClassif->set);
+	int numProcs = set->halo != NULL ? set->halo->numProcs : 1;
+	int rank = set->halo != NULL ? set->halo->rank : 0;
+	int k,p,r,w;
+	double total,target,weight;
+	double * procWeights;
+	double * words;
+	unsigned long * bits;
+
+	procWeights = (double *)emMalloc(sizeof(double)*numProcs);
+	words = (double *)emMalloc(sizeof(double)*2*set->numWords);
+	for(k=0;k<myClassif->numClust;k++) {
+		/*weights of the profiles of each process*/
+		memset(procWeights,0,sizeof(double)*numProcs);
+		for(p=0;p<set->numProfiles;p++) {
+			procWeights[rank] += k == 0 ? set->profileCount[p] : (double)set->profileCount[p]*seeds->minDist[p];
 		}
-		
+		reduceSumVector(procWeights,numProcs);
+		total = 0;
+		for(r=0;r<numProcs;r++) {
+			total += procWeights[r];
+		}
+		target = counterUniform(seed,draw,(unsigned long)k)*total;
+		for(r=0;r<numProcs-1 && target >= procWeights[r];r++) {
+			target -= procWeights[r];
+		}
+
+		/*the process holding the seed shares its expression vector, as two 32 bits halves per word*/
+		memset(words,0,sizeof(double)*2*set->numWords);
+		if(r == rank && set->numProfiles > 0) {
+			for(p=0;p<set->numProfiles-1;p++) {
+				weight = k == 0 ? set->profileCount[p] : (double)set->profileCount[p]*seeds->minDist[p];
+				if(target < weight) {
+					break;
+				}
+				target -= weight;
+			}
+			bits = set->obs[set->profileCell[p]].bits;
+			for(w=0;w<set->numWords;w++) {
+				words[2*w] = (double)(bits[w] & 0xffffffffUL);
+				words[2*w+1] = (double)((bits[w] >> 16) >> 16);
+			}
+		}
+		reduceSumVector(words,2*set->numWords);
+		bits = seeds->centres+k*set->numWords;
+		for(w=0;w<set->numWords;w++) {
+			bits[w] = (unsigned long)words[2*w] | (((unsigned long)words[2*w+1] << 16) << 16);
+		}
+
+		seeds->numCentres = k+1;
+		runPool(myClassif->pool,seedDistanceWork,seeds);
 	}
+	free(procWeights);
+	free(words);
+}
 
+/*Labels the owned cells handled by one thread, a cell whose nearest seed is the one of at least half of its neighbours being a core of it, the others being left unlabelled*/
+static void seedCoreWork(threadTask * task) {
+	seeding * seeds = (seeding *)task->data;
+	dataSet * set = &(seeds->model->set);
+	int i,n,first,last,agree;
+
+	threadRange(task,set->numOwned,&first,&last);
+	for(i=first;i<last;i++) {
+		agree = 0;
+		for(n=0;n<set->obs[i].numNei;n++) {
+			if(seeds->seedLabel[set->obs[i].nei[n]] == seeds->seedLabel[i]) {
+				agree++;
+			}
+		}
+		seeds->next[i] = set->obs[i].numNei > 0 && 2*agree >= set->obs[i].numNei ? seeds->seedLabel[i] : 0;
+	}
 }
 
-/*function to check if all elements of the count vector > 0
-* returns 1 if vector contains 0s 0 otherwise
+/*One growing round on the owned cells handled by one thread
+*An unlabelled cell next to labelled ones joins the cluster of its neighbours whose seed is the nearest to its expression vector
 */
-int zerosInVector(int * vector,int length) {
-	int zeros = 0,index=0;
-	while(zeros == 0 && index<length) {
-		if(vector[index] == 0) {
-			zeros = 1;
+static void seedGrowWork(threadTask * task) {
+	seeding * seeds = (seeding *)task->data;
+	classif * myClassif = seeds->model;
+	dataSet * set = &(myClassif->set);
+	int i,n,label,best,dist,bestDist,first,last,changed=0;
+
+	threadRange(task,set->numOwned,&first,&last);
+	for(i=first;i<last;i++) {
+		best = myClassif->clust[i];
+		if(best == 0) {
+			bestDist = INT_MAX;
+			for(n=0;n<set->obs[i].numNei;n++) {
+				label = myClassif->clust[set->obs[i].nei[n]];
+				if(label == 0) {
+					continue;
+				}
+				dist = hammingDistance(set->obs[i].bits,seeds->centres+(label-1)*set->numWords,set->numWords);
+				if(dist < bestDist || (dist == bestDist && label < best)) {
+					bestDist = dist;
+					best = label;
+				}
+			}
+			if(best != 0) {
+				changed++;
+			}
 		}
-		index++;
+		seeds->next[i] = best;
 	}
-	return zeros;
+	seeds->threadChanged[task->thread] = changed;
 }
 
-/*Checks if current classif has at least one point in each cluster
-*If not it displays a warning.
-*Empty classes usually lead to NaN final likelihood, if you get that error a lot try initializing the the clutering differently
+/*Grows clusters over the neighbour graph from the cores of the seed labels
 *
+*Cores are the cells sharing their nearest seed with at least half of their neighbours, the other cells being labelled by rounds,
+*each one reading the labels of the previous round so that the result does not depend on the threads. Cells out of reach of any core keep their seed label
 */
-void noEmptyClass(classif * myClassif) {
-	int * numTot;
-	int i;
-
-	/*Allocating memory*/
-	numTot = (int *)malloc(sizeof(int)*myClassif->numClust);
-	
+static void growSeeds(seeding * seeds/*I\O*/) {
+	classif * myClassif = seeds->model;
+	dataSet * set = &(myClassif->set);
+	int i,t,changed,rounds=0;
+	int numThreads = myClassif->pool != NULL ? myClassif->pool->numThreads : 1;
+
+	memcpy(seeds->seedLabel,myClassif->clust,sizeof(int)*set->num);
+	runPool(myClassif->pool,seedCoreWork,seeds);
+	memcpy(myClassif->clust,seeds->next,sizeof(int)*set->numOwned);
+	exchangeHaloLabels(myClassif);
+	do {
+		runPool(myClassif->pool,seedGrowWork,seeds);
+		memcpy(myClassif->clust,seeds->next,sizeof(int)*set->numOwned);
+		exchangeHaloLabels(myClassif);
+		changed = 0;
+		for(t=0;t<numThreads;t++) {
+			changed += seeds->threadChanged[t];
+		}
+		changed = (int)reduceSum((double)changed);
+		rounds++;
+	} while(changed > 0);
 
-	/*initialize present to 0*/
-	for(i=0;i<myClassif->numClust;i++) {
-		numTot[i] = 0;
+	for(i=0;i<set->num;i++) {
+		if(myClassif->clust[i] == 0) {
+			myClassif->clust[i] = seeds->seedLabel[i];
+		}
 	}
 
-	/*Filling the count vector in all laziness*/
-	while(zerosInVector(numTot,myClassif->set.num) == 1 && i<myClassif->set.num) {
-		numTot[myClassif->clust[i]]++;
-		i++;
+	/*a cluster without any core gets back the cells of its seed*/
+	memset(seeds->clustCount,0,sizeof(int)*myClassif->numClust);
+	for(i=0;i<set->numOwned;i++) {
+		seeds->clustCount[myClassif->clust[i]-1]++;
 	}
-
-	for(i=0;i<myClassif->numClust;i++) {
-		/*If empty class, alert*/
-		if(numTot[i+1] == 0) {
-			printf("\tWARNING : class %d is empty\n",i+1);
+	reduceSumIntVector(seeds->clustCount,myClassif->numClust);
+	for(i=0;i<set->num;i++) {
+		if(seeds->clustCount[seeds->seedLabel[i]-1] == 0) {
+			myClassif->clust[i] = seeds->seedLabel[i];
 		}
 	}
-
+	fprintf(myClassif->log,"Clusters grown in %d rounds\n",rounds);
 }
 
+/*Initialize classification from k-means++ seeds drawn on the expression profiles
+*
+*Each cell takes the label of the seed nearest to its expression vector (Hamming distance), the clusters being then grown over the neighbour graph
+*from their spatially coherent cores if grow is set. As for the random initialisation, several draws are made (3, the seeds being already spread) and the one with the best initial likelihood is kept
+returns void*/
+void initClassifSeeded(dataSet set/*I*/,int numClust/*I*/, classif* myClassif/*I\O*/,double beta/*I*/,unsigned seed/*I*/,int grow/*I*/) {
+	int i,k;
+	double logLike,bestLogLike;
+	int numRand = 3;
+	int numThreads;
+	seeding seeds;
 
+	myClassif->set = set;
+	myClassif->numClust = numClust;
 
+	/*Allocating all the model buffers, tihms set to 0*/
+	createWorkspace(myClassif,beta);
+	numThreads = myClassif->pool != NULL ? myClassif->pool->numThreads : 1;
+	seeds.model = myClassif;
+	seeds.numCentres = 0;
+	seeds.centres = (unsigned long *)emMalloc(sizeof(unsigned long)*numClust*set.numWords);
+	seeds.minDist = (int *)emMalloc(sizeof(int)*(set.numProfiles+1));
+	seeds.nearest = (int *)emMalloc(sizeof(int)*(set.numProfiles+1));
+	seeds.seedLabel = (int *)emMalloc(sizeof(int)*(set.num+1));
+	seeds.next = (int *)emMalloc(sizeof(int)*(set.numOwned+1));
+	seeds.threadChanged = (int *)emMalloc(sizeof(int)*numThreads);
+	seeds.clustCount = (int *)emMalloc(sizeof(int)*numClust);
+	bestLogLike = -1e100;
 
+	for(k=0;k<numRand;k++) {
+		drawSeeds(&seeds,(unsigned long)seed,(unsigned long)k);
+		for(i=0;i<set.numOwned;i++) {
+			myClassif->clust[i] = seeds.nearest[set.profile[i]]+1;
+		}
+		exchangeHaloLabels(myClassif);
+		if(grow) {
+			growSeeds(&seeds);
+		}
+		invalidateLikelihood(myClassif);
 
-/*Returns the neighboring for one cell and one cluster*/
-double computeNeiCoef(classif * myClassif/*i\O*/,double ** currentT/*I*/,int clust/*I*/,int cell/*I*/){
-	int j;
-	double temp=0;
-	double ret=0;
-
+		/*Computing thetas*/
+		maxThetas(myClassif);
+		/*Computing cell densitites*/
+		computeCellDensities(myClassif);
+		/*computing tihms with 2 step fixed point*/
+		computeThims(myClassif,2);
 
-	for(j=0;j<myClassif->set.obs[cell].numNei;j++) {
-		temp = temp + currentT[clust][myClassif->set.obs[cell].nei[j]];
+		/*Computing loglikelihood*/
+		logLike = computeFullLogLikelihood(myClassif);
+		if(logLike > bestLogLike) {
+			bestLogLike = logLike;
+			memcpy(myClassif->bestClust,myClassif->clust,(set.num)*sizeof(int));
+		}
+		fprintf(myClassif->log,"Init %d likelihood : %e\n",k,logLike);
+	}
+	free(seeds.centres);
+	free(seeds.minDist);
+	free(seeds.nearest);
+	free(seeds.seedLabel);
+	free(seeds.next);
+	free(seeds.threadChanged);
+	free(seeds.clustCount);
+
+	/*Assigning best seeded classif*/
+	memcpy(myClassif->clust,myClassif->bestClust,(set.num)*sizeof(int));
+	invalidateLikelihood(myClassif);
+
+	/*Computing thetas*/
+	maxThetas(myClassif);
+	/*Computing cell densities*/
+	computeCellDensities(myClassif);
+	/*computing tihms with 2 step fixed point*/
+	computeThims(myClassif,2);
+	fprintf(myClassif->log,"\tBest init has a likelihood of %e\n",bestLogLike);
+}
+
+/*Sets the posteriors of one cell from a row of numClust values, keeping the sparseM largest in decreasing order when sparse*/
+static void setCellPosteriors(classif * myClassif/*I\O*/,int i/*I*/,double * row/*I*/) {
+	int k,e,numStored=0;
+	int m = myClassif->sparseM;
+	int * top;
+	emReal * topVal;
+	double keptSum=0;
+
+	if(m == 0) {
+		for(k=0;k<myClassif->numClust;k++) {
+			myClassif->tihm[k][i] = (emReal)row[k];
+		}
+		return;
+	}
+	top = myClassif->topClust+i*m;
+	topVal = myClassif->topTihm+i*m;
+	for(k=0;k<myClassif->numClust;k++) {
+		if(row[k] <= 0) {
+			continue;
+		}
+		if(numStored < m) {
+			numStored++;
+		}
+		else if(row[top[m-1]] >= row[k]) {
+			continue;
+		}
+		for(e=numStored-1;e>0 && row[top[e-1]] < row[k];e--) {
+			top[e] = top[e-1];
+		}
+		top[e] = k;
+	}
+	for(e=0;e<numStored;e++) {
+		topVal[e] = (emReal)row[top[e]];
+		keptSum += row[top[e]];
+	}
+	for(e=numStored;e<m;e++) {
+		top[e] = -1;
+		topVal[e] = 0;
+	}
+	myClassif->residual[i] = keptSum < 1.0 ? 1.0-keptSum : 0.0;
+}
+
+/*Initialize classification from the outputs of a previous run (result folder/outputFileName)
+*
+*Thetas are read from the .theta file and betas from the .clust file (kept at beta if fixed is set or the file is missing),
+*labels from the .csv file and posteriors from the .posteriors.npy file when present, every file being checked against the dataset.
+*Densities and posteriors are computed from these parameters without any random restart, the thetas are only re-estimated by the first M step
+returns void*/
+void initClassifWarm(dataSet set/*I*/,char * prefix/*I*/, classif* myClassif/*I\O*/,double beta/*I*/,int fixed/*I*/) {
+	int i,k,numClust=0,numValues=0,capacity,lineNum,label,rows,cols,haveLabels=0,labelsRead=0,posteriorsRead=0;
+	char * line;
+	char * cursor;
+	char * end;
+	char * name;
+	char kind;
+	size_t size;
+	double value;
+	double * thetas;
+	double * row;
+	unsigned char * raw;
+	FILE * file;
+	int lineSize = 32*(LG_GENES_MAX+1);
+
+	myClassif->set = set;
+	line = (char *)emMalloc(lineSize);
+	capacity = set.length;
+	thetas = (double *)emMalloc(sizeof(double)*capacity);
+	if (line == NULL || thetas == NULL) {
+		printf("Out of memory warm start\n");
+		exit(-1);
+	}
+
+	/*one row of thetas per cluster, one column per gene*/
+	file = openRunFile(prefix,".theta",1);
+	while(fgets(line,lineSize,file) != NULL) {
+		cursor = line;
+		i = 0;
+		value = strtod(cursor,&end);
+		while(end != cursor) {
+			if(numValues == capacity) {
+				capacity *= 2;
+				thetas = (double *)emRealloc(thetas,sizeof(double)*capacity);
+				if (thetas == NULL) {
+					printf("Out of memory warm start\n");
+					exit(-1);
+				}
+			}
+			thetas[numValues++] = value;
+			i++;
+			cursor = end;
+			value = strtod(cursor,&end);
+		}
+		if(i == 0) {
+			continue;
+		}
+		if(i != set.length-1) {
+			printf("%s.theta has %d genes on row %d, the data file %d\n",prefix,i,numClust+1,set.length-1);
+			exit(-1);
+		}
+		numClust++;
+	}
+	fclose(file);
+	if(numClust == 0) {
+		printf("%s.theta has no thetas\n",prefix);
+		exit(-1);
+	}
+	myClassif->numClust = numClust;
+	fprintf(myClassif->log,"clusters :%d\n",myClassif->numClust);
+
+	/*Allocating all the model buffers, tihms set to 0*/
+	createWorkspace(myClassif,beta);
+	for(k=0;k<numClust;k++) {
+		myClassif->parameters.theta[k][0] = 0;
+		memcpy(myClassif->parameters.theta[k]+1,thetas+k*(set.length-1),sizeof(double)*(set.length-1));
+	}
+	free(thetas);
+
+	/*betas, on the line after the header of the .clust file*/
+	file = openRunFile(prefix,".clust",0);
+	if(file != NULL && !fixed) {
+		k = 0;
+		if(fgets(line,lineSize,file) != NULL && fscanf(file,"%*s") == 0) {
+			for(k=0;k<numClust && fscanf(file,"%lf",&value) == 1;k++) {
+				myClassif->beta[k] = value;
+			}
+		}
+		if(k != numClust) {
+			printf("%s.clust has %d betas for %d clusters\n",prefix,k,numClust);
+			exit(-1);
+		}
+	}
+	if(file != NULL) {
+		fclose(file);
+	}
+
+	/*labels*/
+	file = openRunFile(prefix,".csv",0);
+	if(file != NULL) {
+		lineNum = 0;
+		while(fgets(line,lineSize,file) != NULL) {
+			label = atoi(line);
+			if(label < 1 || label > numClust) {
+				printf("%s.csv has label %d on line %d for %d clusters\n",prefix,label,lineNum+1,numClust);
+				exit(-1);
+			}
+			i = localIndex(&set,lineNum);
+			if(i >= 0) {
+				myClassif->clust[i] = label;
+			}
+			lineNum++;
+		}
+		fclose(file);
+		if(lineNum != set.numGlobal) {
+			printf("%s.csv has %d labels for %d points\n",prefix,lineNum,set.numGlobal);
+			exit(-1);
+		}
+		haveLabels = 1;
+		labelsRead = 1;
+	}
+
+	/*posteriors, one row of numClust values per point*/
+	row = (double *)emMalloc(sizeof(double)*numClust);
+	raw = (unsigned char *)emMalloc(sizeof(double)*numClust);
+	if (row == NULL || raw == NULL) {
+		printf("Out of memory warm start\n");
+		exit(-1);
+	}
+	name = emMalloc(strlen(prefix)+strlen(".posteriors.npy")+1);
+	sprintf(name,"%s.posteriors.npy",prefix);
+	file = fopen(name,"rb");
+	if(file != NULL) {
+		if(!readNpyHeader(file,&kind,&size,&rows,&cols) || kind != 'f' || (size != sizeof(double) && size != sizeof(float)) || rows != set.numGlobal || cols != numClust) {
+			printf("%s is not a %d x %d array of floats\n",name,set.numGlobal,numClust);
+			exit(-1);
+		}
+		for(lineNum=0;lineNum<rows;lineNum++) {
+			if(fread(raw,size,cols,file) != (size_t)cols) {
+				printf("%s is truncated\n",name);
+				exit(-1);
+			}
+			i = localIndex(&set,lineNum);
+			if(i < 0) {
+				continue;
+			}
+			for(k=0;k<numClust;k++) {
+				row[k] = size == sizeof(double) ? ((double *)raw)[k] : (double)((float *)raw)[k];
+			}
+			setCellPosteriors(myClassif,i,row);
+		}
+		fclose(file);
+		posteriorsRead = 1;
+		if(!haveLabels) {
+			for(i=0;i<set.numOwned;i++) {
+				myClassif->clust[i] = maxPosteriorClust(myClassif,i);
+			}
+			exchangeHaloLabels(myClassif);
+			haveLabels = 1;
+		}
+	}
+	else if(haveLabels) {
+		/*the labels stand for the posteriors of the first sweeps*/
+		for(i=0;i<set.num;i++) {
+			for(k=0;k<numClust;k++) {
+				row[k] = myClassif->clust[i] == k+1 ? 1.0 : 0.0;
+			}
+			setCellPosteriors(myClassif,i,row);
+		}
+	}
+	free(name);
+	free(row);
+	free(raw);
+	free(line);
+
+	/*Computing cell densities from the thetas read*/
+	computeCellDensities(myClassif);
+	/*computing tihms with 2 step fixed point*/
+	computeThims(myClassif,2);
+	if(!haveLabels) {
+		for(i=0;i<set.numOwned;i++) {
+			myClassif->clust[i] = maxPosteriorClust(myClassif,i);
+		}
+		exchangeHaloLabels(myClassif);
+	}
+	invalidateLikelihood(myClassif);
+	fprintf(myClassif->log,"Warm start from %s%s%s\n",prefix,labelsRead ? ", labels read" : "",posteriorsRead ? ", posteriors read" : "");
+}
+
+/**********************************START Specialised kernels*****************************************/
+/* The hot loops over clusters and gene words are instantiated for every number of clusters from 2 to MAX_KERNEL_CLUST
+* and every number of expression words up to MAX_KERNEL_WORDS, so that their trip counts are compile-time constants and
+* their accumulators can stay in registers. selectKernels picks them from the tables below, index 0 being the generic versions.
+* They sum in the same order as the generic loops and give the same results.
+*/
+
+typedef void (*densityKernel)(classif * myClassif,int profile);
+typedef void (*thimsKernel)(classif * myClassif,int cell);
+typedef int (*argmaxKernel)(classif * myClassif,int cell);
+
+/*Densities of one expression profile for all clusters from the log theta table, generic version*/
+static void densityKernelGeneric(classif * myClassif,int profile) {
+	int k,p,numClust = myClassif->numClust;
+	int numBits = myClassif->set.numWords*BITS_PER_WORD;
+	unsigned long * bits = myClassif->set.obs[myClassif->set.profileCell[profile]].bits;
+	double * row;
+
+	for(k=0;k<numClust;k++) {
+		myClassif->densityAcc[k] = 0;
+	}
+	for(p=0;p<numBits;p++) {
+		row = myClassif->logThetaTable+(2*p+((bits[p/BITS_PER_WORD]>>(p%BITS_PER_WORD))&1UL))*numClust;
+		for(k=0;k<numClust;k++) {
+			myClassif->densityAcc[k] += row[k];
+		}
+	}
+	for(k=0;k<numClust;k++) {
+		myClassif->cellDensities[k][profile] = myClassif->densityAcc[k];
+	}
+}
+
+#define DENSITY_KERNEL(K,W) \
+static void densityKernel_##K##_##W(classif * myClassif,int profile) { \
+	double acc[K]; \
+	unsigned long * bits = myClassif->set.obs[myClassif->set.profileCell[profile]].bits; \
+	unsigned long word; \
+	double * row; \
+	int k,w,b; \
+	for(k=0;k<K;k++) { \
+		acc[k] = 0; \
+	} \
+	for(w=0;w<W;w++) { \
+		word = bits[w]; \
+		for(b=0;b<BITS_PER_WORD;b++) { \
+			row = myClassif->logThetaTable+(2*(w*BITS_PER_WORD+b)+((word>>b)&1UL))*K; \
+			for(k=0;k<K;k++) { \
+				acc[k] += row[k]; \
+			} \
+		} \
+	} \
+	for(k=0;k<K;k++) { \
+		myClassif->cellDensities[k][profile] = acc[k]; \
+	} \
+}
+
+/*Posteriors of one cell, generic version is the loop of computeThims*/
+#define THIMS_KERNEL(K) \
+static void thimsKernel_##K(classif * myClassif,int cell) { \
+	double neiCoef[K]; \
+	double weight[K]; \
+	double sumDivisor = 0.0; \
+	emReal ** tihm = myClassif->tihm; \
+	dataPoint * point = &(myClassif->set.obs[cell]); \
+	int profile = myClassif->set.profile[cell]; \
+	int j,k,n; \
+	for(k=0;k<K;k++) { \
+		neiCoef[k] = 0; \
+	} \
+	for(j=0;j<point->numNei;j++) { \
+		n = point->nei[j]; \
+		for(k=0;k<K;k++) { \
+			neiCoef[k] += tihm[k][n]; \
+		} \
+	} \
+	for(k=0;k<K;k++) { \
+		weight[k] = exp(myClassif->cellDensities[k][profile])*exp(neiCoef[k]*myClassif->beta[k]); \
+		sumDivisor += weight[k]; \
+	} \
+	for(k=0;k<K;k++) { \
+		tihm[k][cell] = weight[k]/sumDivisor; \
+	} \
+}
+
+/*Cluster (from 1) of largest posterior of one cell, generic version is in maxPosteriorClust*/
+#define ARGMAX_KERNEL(K) \
+static int argmaxKernel_##K(classif * myClassif,int cell) { \
+	double maxClust = -1000; \
+	int k,clustK=1; \
+	for(k=0;k<K;k++) { \
+		if((myClassif->tihm[k][cell]-maxClust) > 0.0) { \
+			maxClust = myClassif->tihm[k][cell]; \
+			clustK = k+1; \
+		} \
+	} \
+	return clustK; \
+}
+
+#define KERNELS(K) \
+	DENSITY_KERNEL(K,1) DENSITY_KERNEL(K,2) DENSITY_KERNEL(K,3) DENSITY_KERNEL(K,4) \
+	THIMS_KERNEL(K) ARGMAX_KERNEL(K)
+
+#define FOR_EACH_KERNEL_CLUST(X) \
+	X(2) X(3) X(4) X(5) X(6) X(7) X(8) X(9) X(10) X(11) X(12) X(13) X(14) X(15) X(16) X(17) \
+	X(18) X(19) X(20) X(21) X(22) X(23) X(24) X(25) X(26) X(27) X(28) X(29) X(30) X(31) X(32)
+
+FOR_EACH_KERNEL_CLUST(KERNELS)
+
+#define DENSITY_KERNELS_ROW(K) {densityKernelGeneric,densityKernel_##K##_1,densityKernel_##K##_2,densityKernel_##K##_3,densityKernel_##K##_4},
+#define THIMS_KERNELS_ROW(K) thimsKernel_##K,
+#define ARGMAX_KERNELS_ROW(K) argmaxKernel_##K,
+
+static const densityKernel densityKernels[MAX_KERNEL_CLUST+1][MAX_KERNEL_WORDS+1] = {
+	{densityKernelGeneric,densityKernelGeneric,densityKernelGeneric,densityKernelGeneric,densityKernelGeneric},
+	{densityKernelGeneric,densityKernelGeneric,densityKernelGeneric,densityKernelGeneric,densityKernelGeneric},
+	FOR_EACH_KERNEL_CLUST(DENSITY_KERNELS_ROW)
+};
+
+/*the generic thims and argmax are not called through the tables*/
+static const thimsKernel thimsKernels[MAX_KERNEL_CLUST+1] = {
+	NULL,NULL,
+	FOR_EACH_KERNEL_CLUST(THIMS_KERNELS_ROW)
+};
+
+static const argmaxKernel argmaxKernels[MAX_KERNEL_CLUST+1] = {
+	NULL,NULL,
+	FOR_EACH_KERNEL_CLUST(ARGMAX_KERNELS_ROW)
+};
+
+/*Chooses the kernels matching the number of clusters and of expression words*/
+void selectKernels(classif * myClassif /*I/O*/) {
+	myClassif->kernelK = 0;
+	if(myClassif->numClust >= 2 && myClassif->numClust <= MAX_KERNEL_CLUST) {
+		myClassif->kernelK = myClassif->numClust;
+	}
+	myClassif->kernelWords = 0;
+	if(myClassif->set.numWords <= MAX_KERNEL_WORDS) {
+		myClassif->kernelWords = myClassif->set.numWords;
+	}
+}
+
+/**********************************END Specialised kernels*****************************************/
+
+/*Sets the posteriors of all cells to 0
+*
+*With sparseM > 0 only the sparseM largest posteriors of each cell are kept, sorted in decreasing order, the mass of the other clusters being lumped in a residual
+*/
+void clearPosteriors(classif * myClassif /*I/O*/) {
+	int i,k;
+	int num = myClassif->set.num;
+
+	if(myClassif->sparseM > 0) {
+		for(i=0;i<num*myClassif->sparseM;i++) {
+			myClassif->topClust[i] = -1;
+			myClassif->topTihm[i] = 0;
+		}
+		for(i=0;i<num;i++) {
+			myClassif->residual[i] = 0;
+		}
+		return;
+	}
+
+	for(k=0;k<myClassif->numClust;k++) {
+		for(i=0;i<num;i++){
+			myClassif->tihm[k][i] = 0;
+		}
+	}
+}
+
+/*Returns the number of clusters stored for one cell in the sparse posteriors*/
+int numTopClust(classif * myClassif/*I*/,int cell/*I*/) {
+	int e=0;
+	while(e<myClassif->sparseM && myClassif->topClust[cell*myClassif->sparseM+e] >= 0) {
+		e++;
+	}
+	return e;
+}
+
+/*Returns the share of the residual mass given to each cluster not stored for one cell*/
+double residualShare(classif * myClassif/*I*/,int cell/*I*/) {
+	int numStored = numTopClust(myClassif,cell);
+	if(numStored == myClassif->numClust) {
+		return 0;
+	}
+	return myClassif->residual[cell]/(double)(myClassif->numClust-numStored);
+}
+
+/*Returns the posterior of one cluster for one cell, whatever the storage*/
+double posterior(classif * myClassif/*I*/,int clust/*I*/,int cell/*I*/) {
+	int e,m = myClassif->sparseM;
+	if(m == 0) {
+		return myClassif->tihm[clust][cell];
+	}
+	for(e=0;e<m && myClassif->topClust[cell*m+e] >= 0;e++) {
+		if(myClassif->topClust[cell*m+e] == clust) {
+			return myClassif->topTihm[cell*m+e];
+		}
+	}
+	return residualShare(myClassif,cell);
+}
+
+/*Returns the sum of the posteriors of one cell (1 once computed, 0 before)*/
+double posteriorMass(classif * myClassif/*I*/,int cell/*I*/) {
+	int e,m = myClassif->sparseM;
+	double mass = 0;
+	if(m == 0) {
+		for(e=0;e<myClassif->numClust;e++) {
+			mass += myClassif->tihm[e][cell];
+		}
+		return mass;
+	}
+	for(e=0;e<m;e++) {
+		mass += myClassif->topTihm[cell*m+e];
+	}
+	return mass+myClassif->residual[cell];
+}
+
+/*Returns the cluster (from 1) with the largest posterior for one cell*/
+int maxPosteriorClust(classif * myClassif/*I*/,int cell/*I*/) {
+	int k,clustK=1;
+	double maxClust = -1000;
+
+	if(myClassif->sparseM > 0) {
+		/*stored in decreasing order*/
+		if(myClassif->topClust[cell*myClassif->sparseM] >= 0) {
+			clustK = myClassif->topClust[cell*myClassif->sparseM]+1;
+		}
+		return clustK;
+	}
+	if(myClassif->kernelK > 0) {
+		return argmaxKernels[myClassif->kernelK](myClassif,cell);
+	}
+	for(k=0;k<myClassif->numClust;k++) {
+		if((myClassif->tihm[k][cell]-maxClust) > 0.0) {
+			maxClust = myClassif->tihm[k][cell];
+			clustK = k+1;
+
+		}
+	}
+	return clustK;
+}
+
+/*Compute cell density for one cell one cluster*/
+double cellDensity(classif * myClassif/*i*/,int clust/*I*/,int cell/*I*/) {
+	int j;
+	double density=0;
+	double ret=0;
+	
+	/*Iter on genes*/
+	for(j=1;j<myClassif->set.length;j++) {
+		if(myClassif->set.obs[cell].expVect[j] == 1) {
+			density = log((double)myClassif->parameters.theta[clust][j]);
+		}
+		else {
+			density = log((double)1.0-myClassif->parameters.theta[clust][j]);
+		}
+		ret = ret+density;
+		
+	}
+
+
+
+	return ret;
+
+}
+
+/*Keeps, for each profile, the sparseM clusters of largest density and the sums the sparse sweeps need for the other clusters
+*The densities are read cluster by cluster, in their storage order
+*/
+void rankProfileDensities(classif * myClassif/*I/O*/) {
+	int p,k,e;
+	int m = myClassif->sparseM;
+	int numProfiles = myClassif->set.numProfiles;
+	int * top;
+	emReal * row;
+	double density;
+	double * densityMax = myClassif->profileDensityMax;
+	double * densitySum = myClassif->profileDensitySum;
+	double * densityTotal = myClassif->profileDensityTotal;
+
+	for(p=0;p<numProfiles;p++) {
+		densityMax[p] = -HUGE_VAL;
+		densitySum[p] = 0;
+		densityTotal[p] = 0;
+	}
+	for(e=0;e<numProfiles*m;e++) {
+		myClassif->profileTopClust[e] = -1;
+	}
+
+	/*largest densities by insertion, the unused entries being at the end*/
+	for(k=0;k<myClassif->numClust;k++) {
+		row = myClassif->cellDensities[k];
+		for(p=0;p<numProfiles;p++) {
+			density = row[p];
+			if(density == -HUGE_VAL) {
+				continue;
+			}
+			densityTotal[p] += density;
+			if(density > densityMax[p]) {
+				densityMax[p] = density;
+			}
+			top = myClassif->profileTopClust+p*m;
+			if(top[m-1] >= 0 && myClassif->cellDensities[top[m-1]][p] >= density) {
+				continue;
+			}
+			for(e=m-1;e>0 && (top[e-1] < 0 || myClassif->cellDensities[top[e-1]][p] < density);e--) {
+				top[e] = top[e-1];
+			}
+			top[e] = k;
+		}
+	}
+
+	for(k=0;k<myClassif->numClust;k++) {
+		row = myClassif->cellDensities[k];
+		for(p=0;p<numProfiles;p++) {
+			if(row[p]-densityMax[p] >= SPARSE_LOG_CUTOFF) {
+				densitySum[p] += exp(row[p]-densityMax[p]);
+			}
+		}
+	}
+}
+
+/*Computes all cells densities, once per distinct expression profile*/
+void computeCellDensities(classif * myClassif/*I/O*/) {
+	int i,k,p;	
+	int numClust = myClassif->numClust;
+	densityKernel kernel = densityKernels[myClassif->kernelK][myClassif->kernelWords];
+
+	/*log(1-theta) and log(theta) of each gene, gene major so that the clusters of one gene are contiguous, padding bits stay at 0*/
+	for(p=0;p<myClassif->set.length-1;p++) {
+		for(k=0;k<numClust;k++){
+			myClassif->logThetaTable[2*p*numClust+k] = log((double)1.0-myClassif->parameters.theta[k][p+1]);
+			myClassif->logThetaTable[(2*p+1)*numClust+k] = log((double)myClassif->parameters.theta[k][p+1]);
+		}
+	}
+	/*Iter on distinct expression profiles*/
+	for(i=0;i<myClassif->set.numProfiles;i++) {
+		kernel(myClassif,i);
+	}
+	if(myClassif->sparsePruned) {
+		rankProfileDensities(myClassif);
+	}
+	myClassif->densityLogLikeValid = 0;
+	myClassif->expectationValid = 0;
+
+}
+
+/*function to check if all elements of the count vector > 0
+* returns 1 if vector contains 0s 0 otherwise
+*/
+int zerosInVector(int * vector,int length) {
+	int zeros = 0,index=0;
+	while(zeros == 0 && index<length) {
+		if(vector[index] == 0) {
+			zeros = 1;
+		}
+		index++;
+	}
+	return zeros;
+}
+
+/*Checks if current classif has at least one point in each cluster
+*If not it displays a warning.
+*Empty classes usually lead to NaN final likelihood, if you get that error a lot try initializing the the clutering differently
+*
+*/
+void noEmptyClass(classif * myClassif) {
+	int * numTot;
+	int i;
+
+	numTot = myClassif->classCounts;
+
+	/*initialize present to 0*/
+	for(i=0;i<myClassif->numClust;i++) {
+		numTot[i] = 0;
+	}
+
+	/*Filling the count vector in all laziness*/
+	i = 0;
+	while(zerosInVector(numTot,myClassif->numClust) == 1 && i<myClassif->set.numOwned) {
+		numTot[myClassif->clust[i]-1]++;
+		i++;
+	}
+	/*Some other process may hold the points of a class missing here*/
+	reduceSumIntVector(numTot,myClassif->numClust);
+
+	for(i=0;i<myClassif->numClust;i++) {
+		/*If empty class, alert*/
+		if(numTot[i] == 0) {
+			fprintf(myClassif->log,"\tWARNING : class %d is empty\n",i+1);
+		}
+	}
+}
+
+
+
+
+
+/*Returns the neighboring for one cell and one cluster*/
+double computeNeiCoef(classif * myClassif/*i\O*/,emReal ** currentT/*I*/,int clust/*I*/,int cell/*I*/){
+	int j;
+	double temp=0;
+	double ret=0;
+
+
+	for(j=0;j<myClassif->set.obs[cell].numNei;j++) {
+		if(myClassif->sparseM > 0) {
+			temp = temp + posterior(myClassif,clust,myClassif->set.obs[cell].nei[j]);
+		}
+		else {
+			temp = temp + currentT[clust][myClassif->set.obs[cell].nei[j]];
+		}
 	}
 	
 	ret = temp;
 
-	return ret;
+	return ret;
+}
+
+/*Returns Rz, the neighborhood factor to the model likelihood*/
+double computeNeiLikelihood(classif * myClassif/*i\O*/,int cell/*I*/,int clust/*I*/){
+	int j;
+	double ret=0;
+	
+	/*Iter on cell neighbors*/
+	for(j=0;j<myClassif->set.obs[cell].numNei;j++) {
+		/*If neighbor is in the same cluster than considered cell, increment*/
+		if(myClassif->clust[myClassif->set.obs[cell].nei[j]] == clust) {
+			ret++;
+		}
+	}
+
+	return ret;	
+}
+
+
+/*Returns the expected density of one cell under its sparse posteriors
+*the clusters that are not stored share the residual mass evenly
+*/
+double sparseCellExpectation(classif * myClassif/*I*/,int cell/*I*/) {
+	int e,k,m = myClassif->sparseM;
+	int profile = myClassif->set.profile[cell];
+	double ret=0,storedDensities=0,allDensities=0;
+
+	/*clusters with a null density (a theta of 0 or 1) have a null posterior and are left out*/
+	for(e=0;e<m && myClassif->topClust[cell*m+e] >= 0;e++) {
+		k = myClassif->topClust[cell*m+e];
+		if(myClassif->cellDensities[k][profile] > -HUGE_VAL) {
+			ret += myClassif->cellDensities[k][profile]*myClassif->topTihm[cell*m+e];
+			storedDensities += myClassif->cellDensities[k][profile];
+		}
+	}
+	if(myClassif->residual[cell] > 0) {
+		if(myClassif->sparsePruned) {
+			allDensities = myClassif->profileDensityTotal[profile];
+		}
+		else {
+			for(k=0;k<myClassif->numClust;k++) {
+				if(myClassif->cellDensities[k][profile] > -HUGE_VAL) {
+					allDensities += myClassif->cellDensities[k][profile];
+				}
+			}
+		}
+		ret += residualShare(myClassif,cell)*(allDensities-storedDensities);
+	}
+	return ret;
+}
+
+/*Computes expectation, kept until the posteriors, densities, labels or betas change
+*The beta part uses the cached Potts terms of the cells instead of going through their neighbourhoods again
+*/
+double computeFullExpectation(classif * myClassif/*I*/) {
+	int i,k;
+	double logLikeRx=0.0,logLikeRz=0.0;
+	/*Checking for empty classes*/
+	noEmptyClass(myClassif);
+	refreshPottsCache(myClassif);
+	if(myClassif->expectationValid) {
+		return myClassif->expectation;
+	}
+	/*Iter on cells*/
+	for(i=0;i<myClassif->set.numOwned;i++) {
+		logLikeRz += posteriorMass(myClassif,i)*myClassif->cellPotts[i];
+		if(myClassif->sparseM > 0) {
+			logLikeRx += sparseCellExpectation(myClassif,i);
+			continue;
+		}
+		/*Iter on clusters*/
+		for(k=0;k<myClassif->numClust;k++){
+			/*Iter on genes*/
+			if(myClassif->tihm[k][i] != (emReal)0) {
+				logLikeRx = logLikeRx+((myClassif->cellDensities[k][myClassif->set.profile[i]])*myClassif->tihm[k][i]);
+			}			
+		}
+	}
+	logLikeRx = reduceSum(logLikeRx);
+	logLikeRz = reduceSum(logLikeRz);
+	myClassif->expectation = logLikeRx+logLikeRz;
+	myClassif->expectationValid = 1;
+	/*return value*/
+	return myClassif->expectation;
+}
+
+/*Rebuilds the rows of exp(beta_k*c), c in 0..maxNei, of the clusters whose beta changed since the last call*/
+void updateExpBetaTables(classif * myClassif/*I/O*/) {
+	int k,c;
+	int width = myClassif->set.maxNei+1;
+
+	for(k=0;k<myClassif->numClust;k++) {
+		if(myClassif->expBetaTableBeta[k] == myClassif->beta[k]) {
+			continue;
+		}
+		for(c=0;c<width;c++) {
+			myClassif->expBetaTable[k*width+c] = exp(myClassif->beta[k]*(double)c);
+		}
+		myClassif->expBetaTableBeta[k] = myClassif->beta[k];
+	}
+}
+
+/*Returns the log of the Potts conditional probability of the label of one cell given the labels of its neighbours
+*
+*Clusters absent from the neighbourhood contribute exp(0) = 1 to the normaliser, only the clusters of the neighbours are looked up in the tables
+*/
+double cellPottsLogProb(classif * myClassif/*I*/,int cell/*I*/) {
+	int j,c;
+	int width = myClassif->set.maxNei+1;
+	int * neiCount = myClassif->neiCount;
+	dataPoint * point = &(myClassif->set.obs[cell]);
+	double numerator,denominator;
+
+	for(j=0;j<point->numNei;j++) {
+		neiCount[myClassif->clust[point->nei[j]]-1]++;
+	}
+	c = myClassif->clust[cell]-1;
+	numerator = myClassif->expBetaTable[c*width+neiCount[c]];
+
+	denominator = (double)myClassif->numClust;
+	for(j=0;j<point->numNei;j++) {
+		c = myClassif->clust[point->nei[j]]-1;
+		/*counted once per cluster, reset for the next cell*/
+		if(neiCount[c] > 0) {
+			denominator += myClassif->expBetaTable[c*width+neiCount[c]]-1.0;
+			neiCount[c] = 0;
+		}
+	}
+	return log(numerator/denominator);
+}
+
+/*log(1+x) without losing the small values of x, log1p being C99 only*/
+static double logOnePlus(double x) {
+	volatile double u = 1.0+x;
+
+	if(u == 1.0) {
+		return x;
+	}
+	return log(u)*x/(u-1.0);
+}
+
+/*Beta part of the expected likelihood over the cells of the blocks of one thread, with the changes brought by betaProbe up and down on each active beta
+*A beta not above the step is probed down to 0, the move the gradient ascent then takes.
+*
+*Each block writes 1+2K partial sums, summed afterwards in block order so that the totals do not depend on the number of threads.
+*Only the clusters present around a cell appear in its Potts normaliser, so moving beta_k only changes the terms of the cells having a neighbour in k.
+*/
+static void betaBlockWork(threadTask * task) {
+	classif * myClassif = (classif *)task->data;
+	int numClust = myClassif->numClust;
+	int width = myClassif->set.maxNei+1;
+	int numOwned = myClassif->set.numOwned;
+	int * neiCount = myClassif->threadNeiCount+task->thread*numClust;
+	int * present = myClassif->threadPresent+task->thread*width;
+	double * up = myClassif->betaProbeTable;
+	double * down = myClassif->betaProbeTable+width;
+	int b,i,j,e,c,own,numPresent;
+	double * partial;
+	dataPoint * point;
+	double numerator,denominator,mass,value,lift;
+
+	for(b=task->thread;b<myClassif->numBetaBlocks;b+=task->numThreads) {
+		partial = myClassif->betaPartials+b*(2*numClust+1);
+		memset(partial,0,sizeof(double)*(2*numClust+1));
+		for(i=b*BETA_BLOCK;i<numOwned && i<(b+1)*BETA_BLOCK;i++) {
+			point = &(myClassif->set.obs[i]);
+			/*clusters of the neighbours and their counts*/
+			numPresent = 0;
+			for(j=0;j<point->numNei;j++) {
+				c = myClassif->clust[point->nei[j]]-1;
+				if(neiCount[c]++ == 0) {
+					present[numPresent++] = c;
+				}
+			}
+			own = myClassif->clust[i]-1;
+			numerator = myClassif->expBetaTable[own*width+neiCount[own]];
+			denominator = (double)numClust;
+			for(e=0;e<numPresent;e++) {
+				c = present[e];
+				denominator += myClassif->expBetaTable[c*width+neiCount[c]]-1.0;
+			}
+			mass = posteriorMass(myClassif,i);
+			partial[0] += mass*log(numerator/denominator);
+
+			for(e=0;e<numPresent;e++) {
+				c = present[e];
+				if(myClassif->betaActive[c]) {
+					value = myClassif->expBetaTable[c*width+neiCount[c]];
+					lift = c == own ? log(up[neiCount[c]]) : 0;
+					partial[1+c] += mass*(lift-logOnePlus(value*(up[neiCount[c]]-1.0)/denominator));
+					if(myClassif->beta[c]-myClassif->betaStep > 0) {
+						partial[1+numClust+c] += mass*(-lift-logOnePlus(value*(down[neiCount[c]]-1.0)/denominator));
+					}
+					else {
+						/*exp(beta_c*n) becomes 1*/
+						lift = c == own ? -myClassif->beta[c]*(double)neiCount[c] : 0;
+						partial[1+numClust+c] += mass*(lift-logOnePlus((1.0-value)/denominator));
+					}
+				}
+				neiCount[c] = 0;
+			}
+		}
+	}
+}
+
+/*Evaluates the beta part of the expected likelihood and, for every active cluster, its change when beta_k moves by +-step
+*The totals are left in betaTotals: expectation, then the K changes up, then the K changes down (down to 0 for the betas not above step)
+*/
+void betaObjective(classif * myClassif/*I/O*/,double step/*I*/) {
+	int b,c,n;
+	int numClust = myClassif->numClust;
+	int width = myClassif->set.maxNei+1;
+
+	updateExpBetaTables(myClassif);
+	myClassif->betaStep = step;
+	for(n=0;n<width;n++) {
+		myClassif->betaProbeTable[n] = exp(step*(double)n);
+		myClassif->betaProbeTable[width+n] = exp(-step*(double)n);
+	}
+	runPool(myClassif->pool,betaBlockWork,myClassif);
+
+	/*fixed order reduction*/
+	memset(myClassif->betaTotals,0,sizeof(double)*(2*numClust+1));
+	for(b=0;b<myClassif->numBetaBlocks;b++) {
+		for(c=0;c<2*numClust+1;c++) {
+			myClassif->betaTotals[c] += myClassif->betaPartials[b*(2*numClust+1)+c];
+		}
+	}
+	reduceSumVector(myClassif->betaTotals,2*numClust+1);
+}
+
+/*Computes the beta part of the expected likelihood*/
+double computeBetaExpectation(classif * myClassif/*I*/) {
+	int k;
+
+	for(k=0;k<myClassif->numClust;k++) {
+		myClassif->betaActive[k] = 0;
+	}
+	betaObjective(myClassif,0);
+	return myClassif->betaTotals[0];
+}
+
+/*Computes logLikelihood*/
+double computeFullLogLikelihood(classif * myClassif/*I*/) {
+	int i;
+	double logLikeRx=0.0,logLikeRz;
+	/*Checking for empty classes*/
+	noEmptyClass(myClassif);
+	/*Iter on cells, unless the last E step already did it*/
+	if(myClassif->densityLogLikeValid) {
+		logLikeRx = myClassif->densityLogLike;
+	}
+	else {
+		for(i=0;i<myClassif->set.numOwned;i++) {
+			logLikeRx += myClassif->cellDensities[myClassif->clust[i]-1][myClassif->set.profile[i]];			
+		}
+	}
+	logLikeRx = reduceSum(logLikeRx);
+	logLikeRz = computePseudoLogLikelihood(myClassif);
+	/*return value*/
+	return logLikeRx+logLikeRz;
+}
+
+/*compute model pseudo-logLikelihood from the cached Potts terms*/
+double computePseudoLogLikelihood(classif * myClassif/*I*/) {
+	refreshPottsCache(myClassif);
+	return reduceSum(myClassif->pottsLogLike);
+}
+
+/*Drops every cached likelihood value, called whenever all the labels are replaced*/
+void invalidateLikelihood(classif * myClassif/*I/O*/) {
+	myClassif->pottsValid = 0;
+	myClassif->densityLogLikeValid = 0;
+	myClassif->expectationValid = 0;
+}
+
+/*Marks the Potts terms depending on the label of one cell as stale: its own and those of its neighbours (the neighbouring graph is symmetric)*/
+void markLabelChanged(classif * myClassif/*I/O*/,int cell/*I*/) {
+	int j,other;
+	dataPoint * point = &(myClassif->set.obs[cell]);
+
+	if(!myClassif->pottsStale[cell]) {
+		myClassif->pottsStale[cell] = 1;
+		myClassif->staleCells[myClassif->numStale++] = cell;
+	}
+	for(j=0;j<point->numNei;j++) {
+		other = point->nei[j];
+		if(other < myClassif->set.numOwned && !myClassif->pottsStale[other]) {
+			myClassif->pottsStale[other] = 1;
+			myClassif->staleCells[myClassif->numStale++] = other;
+		}
+	}
+}
+
+/*Brings the cached Potts terms of the owned cells and their running sum up to date
+*
+*All of them are recomputed when the cache was invalidated or a beta changed, otherwise only the stale cells and the cells on a process boundary are
+*/
+void refreshPottsCache(classif * myClassif/*I/O*/) {
+	int i,k,cell;
+	int betaChanged = 0;
+	double logProb;
+
+	updateExpBetaTables(myClassif);
+	for(k=0;k<myClassif->numClust;k++) {
+		if(myClassif->pottsBeta[k] != myClassif->beta[k]) {
+			betaChanged = 1;
+			myClassif->pottsBeta[k] = myClassif->beta[k];
+		}
+	}
+
+	if(!myClassif->pottsValid || betaChanged) {
+		myClassif->pottsLogLike = 0;
+		for(i=0;i<myClassif->set.numOwned;i++) {
+			myClassif->cellPotts[i] = cellPottsLogProb(myClassif,i);
+			myClassif->pottsLogLike += myClassif->cellPotts[i];
+			myClassif->pottsStale[i] = 0;
+		}
+		myClassif->numStale = 0;
+		myClassif->pottsValid = 1;
+		myClassif->expectationValid = 0;
+		return;
+	}
+
+	for(i=0;i<myClassif->numBoundary;i++) {
+		cell = myClassif->boundaryCells[i];
+		if(!myClassif->pottsStale[cell]) {
+			myClassif->pottsStale[cell] = 1;
+			myClassif->staleCells[myClassif->numStale++] = cell;
+		}
+	}
+	for(i=0;i<myClassif->numStale;i++) {
+		cell = myClassif->staleCells[i];
+		logProb = cellPottsLogProb(myClassif,cell);
+		if(logProb != myClassif->cellPotts[cell]) {
+			myClassif->pottsLogLike += logProb-myClassif->cellPotts[cell];
+			myClassif->cellPotts[cell] = logProb;
+			myClassif->expectationValid = 0;
+		}
+		myClassif->pottsStale[cell] = 0;
+	}
+	myClassif->numStale = 0;
+}
+
+
+/*Updates the sparse posteriors of one cell
+*
+*The neighbour sums are built from the stored posteriors of the neighbours, each of them giving its residual share to every other cluster.
+*When the model is pruned, only the candidates, the clusters stored by the neighbours and the sparseM best densities of the profile, are scored, so that the cost of a cell does not depend on numClust.
+*The other clusters only get the residual shares of the neighbours, their mass is the density mass of the profile left by the candidates at the smallest beta.
+*The betas of the clusters left out change that mass by at most exp((largest-smallest beta)*residual shares), all the clusters are scored when it goes past SPARSE_TAIL_TOLERANCE.
+*Only the scores within SPARSE_LOG_CUTOFF of the best one are exponentiated, the sparseM largest are stored and the rest goes to the residual.
+*neiSum and score are numClust scratch vectors
+*/
+void updateSparseCellPosteriors(classif * myClassif /*I/O*/, int i /*I*/, double * neiSum, double * score) {
+	int k,j,e,c,n,numStored,numCand,all;
+	int m = myClassif->sparseM;
+	int profile = myClassif->set.profile[i];
+	int * cand = myClassif->candidates;
+	char * mark = myClassif->candidateMark;
+	double share,shareSum,maxScore,sumDivisor,keptSum,density,densityMax,otherSum;
+	int * top;
+	emReal * topVal;
+
+	/*scoring all the clusters when pruning could not be kept within the tolerance*/
+	all = !myClassif->sparsePruned;
+	if(!all) {
+		shareSum = 0;
+		for(j=0;j<myClassif->set.obs[i].numNei;j++) {
+			shareSum += residualShare(myClassif,myClassif->set.obs[i].nei[j]);
+		}
+		all = (myClassif->sparseBetaMax-myClassif->sparseBetaMin)*shareSum > SPARSE_TAIL_TOLERANCE;
+	}
+	numCand = 0;
+	if(all) {
+		for(k=0;k<myClassif->numClust;k++) {
+			neiSum[k] = 0;
+			cand[numCand++] = k;
+		}
+	}
+
+	/*candidates and their neighbour sums*/
+	shareSum = 0;
+	for(j=0;j<myClassif->set.obs[i].numNei;j++) {
+		n = myClassif->set.obs[i].nei[j];
+		share = residualShare(myClassif,n);
+		shareSum += share;
+		for(e=0;e<m && myClassif->topClust[n*m+e] >= 0;e++) {
+			k = myClassif->topClust[n*m+e];
+			if(!all && !mark[k]) {
+				mark[k] = 1;
+				neiSum[k] = 0;
+				cand[numCand++] = k;
+			}
+			neiSum[k] += myClassif->topTihm[n*m+e]-share;
+		}
+	}
+	for(e=0;!all && e<m && myClassif->profileTopClust[profile*m+e] >= 0;e++) {
+		k = myClassif->profileTopClust[profile*m+e];
+		if(!mark[k]) {
+			mark[k] = 1;
+			neiSum[k] = 0;
+			cand[numCand++] = k;
+		}
+	}
+
+	/*log of the unnormalised posteriors of the candidates, and density mass of the other clusters*/
+	maxScore = -1e100;
+	densityMax = 0;
+	otherSum = 0;
+	if(!all) {
+		densityMax = myClassif->profileDensityMax[profile];
+		otherSum = myClassif->profileDensitySum[profile];
+	}
+	for(c=0;c<numCand;c++) {
+		k = cand[c];
+		density = myClassif->cellDensities[k][profile];
+		score[k] = density+myClassif->beta[k]*(neiSum[k]+shareSum);
+		if(score[k] > maxScore) {
+			maxScore = score[k];
+		}
+		if(!all) {
+			mark[k] = 0;
+			if(density-densityMax >= SPARSE_LOG_CUTOFF) {
+				otherSum -= exp(density-densityMax);
+			}
+		}
+	}
+
+	/*keeping the m largest in decreasing order by insertion*/
+	top = myClassif->topClust+i*m;
+	topVal = myClassif->topTihm+i*m;
+	numStored = 0;
+	sumDivisor = 0;
+	if(otherSum > 0) {
+		sumDivisor = otherSum*exp(densityMax+myClassif->sparseBetaMin*shareSum-maxScore);
+	}
+	for(c=0;c<numCand;c++) {
+		k = cand[c];
+		if(score[k]-maxScore < SPARSE_LOG_CUTOFF) {
+			continue;
+		}
+		score[k] = exp(score[k]-maxScore);
+		sumDivisor += score[k];
+		if(numStored < m) {
+			numStored++;
+		}
+		else if(score[top[m-1]] >= score[k]) {
+			continue;
+		}
+		/*compared on the double scores, the stored values may be single precision*/
+		for(e=numStored-1;e>0 && score[top[e-1]] < score[k];e--) {
+			top[e] = top[e-1];
+		}
+		top[e] = k;
+	}
+
+	keptSum = 0;
+	for(e=0;e<numStored;e++) {
+		topVal[e] = (emReal)(score[top[e]]/sumDivisor);
+		keptSum += score[top[e]]/sumDivisor;
+	}
+	for(e=numStored;e<m;e++) {
+		top[e] = -1;
+		topVal[e] = 0;
+	}
+	myClassif->residual[i] = keptSum < 1.0 ? 1.0-keptSum : 0.0;
+}
+
+/*Updates the posteriors of one cell, generic version of the specialised kernels
+*neiCoef is a numClust scratch vector
+*/
+void updateCellPosteriors(classif * myClassif /*I/O*/, int i /*I*/, double * neiCoef) {
+	int k;
+	double sumDivisor;
+	double temp;
+
+	sumDivisor = 0.0;
+
+	/* Computing all cell densities*/
+	for(k=0;k<myClassif->numClust;k++) {
+
+		neiCoef[k] = exp(computeNeiCoef(myClassif,myClassif->tihm,k,i)*(double)myClassif->beta[k]);
+
+		sumDivisor = sumDivisor+(exp(myClassif->cellDensities[k][myClassif->set.profile[i]])*neiCoef[k]);
+
+
+	}
+	for(k=0;k<myClassif->numClust;k++) {
+		temp = (exp(myClassif->cellDensities[k][myClassif->set.profile[i]])*neiCoef[k])/sumDivisor;
+		myClassif->tihm[k][i] = temp;	
+	}
+}
+
+/*One sweep of the mean field fixed point over the owned cells.
+*
+*When fused, each cell is also assigned to its most likely cluster as soon as its posteriors are final, and the theta counts and the density part of the likelihood are accumulated in the same pass, sparing the argmax, maxThetas and likelihood traversals.
+*returns the number of cells whose cluster changed (fused sweeps only)
+*/
+int meanFieldSweep(classif * myClassif /*I/O*/, int fused /*I*/) {
+	int i,clustK,profile,changed=0;
+	int numProfiles = myClassif->set.numProfiles;
+	double * scratch = myClassif->sweepScratch;
+
+	if(fused) {
+		memset(myClassif->profileClust,0,sizeof(int)*myClassif->numClust*numProfiles);
+		myClassif->densityLogLike = 0;
+	}
+	if(myClassif->sparsePruned) {
+		myClassif->sparseBetaMin = myClassif->beta[0];
+		myClassif->sparseBetaMax = myClassif->beta[0];
+		for(i=1;i<myClassif->numClust;i++) {
+			if(myClassif->beta[i] < myClassif->sparseBetaMin) {
+				myClassif->sparseBetaMin = myClassif->beta[i];
+			}
+			if(myClassif->beta[i] > myClassif->sparseBetaMax) {
+				myClassif->sparseBetaMax = myClassif->beta[i];
+			}
+		}
+	}
+
+	for(i=0;i<myClassif->set.numOwned;i++) {
+		if(myClassif->sparseM > 0) {
+			updateSparseCellPosteriors(myClassif,i,scratch,scratch+myClassif->numClust);
+		}
+		else if(myClassif->kernelK > 0) {
+			thimsKernels[myClassif->kernelK](myClassif,i);
+		}
+		else {
+			updateCellPosteriors(myClassif,i,scratch);
+		}
+		if(!fused) {
+			continue;
+		}
+
+		/*Assigning Cluster !*/
+		clustK = maxPosteriorClust(myClassif,i);
+		if(myClassif->clust[i] != clustK ){
+				changed++;
+				myClassif->clust[i] = clustK;
+				markLabelChanged(myClassif,i);
+		}
+		profile = myClassif->set.profile[i];
+		myClassif->profileClust[(clustK-1)*numProfiles+profile]++;
+		myClassif->densityLogLike += myClassif->cellDensities[clustK-1][profile];
+	}
+
+	/*Neighbours owned by other processes see the new posteriors at the next sweep*/
+	exchangeHaloPosteriors(myClassif);
+	myClassif->expectationValid = 0;
+	if(fused) {
+		exchangeHaloLabels(myClassif);
+		myClassif->thetaStatsValid = 1;
+		myClassif->densityLogLikeValid = 1;
+	}
+
+	return changed;
+}
+
+/*Computes current thims with a fixed point algorithm.
+*
+* The number of iteration of the fixed point algorithm is set through the numIterFixed parameter
+*/
+void computeThims(classif * myClassif /*I/O*/, int numIterFixed /*I*/) {
+	int iterFixed;
+
+	/*computing thims*/
+	for(iterFixed=0;iterFixed<numIterFixed;iterFixed++) {
+		meanFieldSweep(myClassif,0);
+	}
+}
+
+
+
+
+
+/*Gradient ascent maximizing all the betas jointly
+*
+*Each round evaluates, in a single pass over the cells, the expected likelihood and its change when each active beta moves up or down by the step.
+*Every active beta then takes its best move, as the sequential ascent would; a beta stops once neither move improves.
+*If the joint moves lowered the expected likelihood, the round is undone and only the single best move is kept, the last round being checked as well.
+*/
+void gradientAscent(classif * myClassif /*I/O*/) {
+	double step = 0.1;
+	double currentLike,lastLike = 0,bestGain;
+	double derivatePlus,derivateMinus;
+	int numClust = myClassif->numClust;
+	int k,best,numActive = numClust,singleMove = 1;
+
+	for(k=0;k<numClust;k++) {
+		myClassif->betaActive[k] = 1;
+	}
+	while(numActive > 0 || !singleMove) {
+		betaObjective(myClassif,step);
+		currentLike = myClassif->betaTotals[0];
+
+		if(!singleMove && currentLike < lastLike) {
+			/*undoing the round, keeping the move that gained the most*/
+			best = -1;
+			bestGain = 0;
+			for(k=0;k<numClust;k++) {
+				if(myClassif->betaMove[k] != 0) {
+					myClassif->beta[k] = myClassif->betaPrevious[k];
+					myClassif->betaActive[k] = 1;
+					if(best < 0 || myClassif->betaGain[k] > bestGain) {
+						best = k;
+						bestGain = myClassif->betaGain[k];
+					}
+				}
+			}
+			if(myClassif->betaMove[best] == BETA_TO_ZERO) {
+				myClassif->beta[best] = 0.0;
+				myClassif->betaActive[best] = 0;
+			}
+			else {
+				myClassif->beta[best] += myClassif->betaMove[best]*step;
+			}
+			numActive = 0;
+			for(k=0;k<numClust;k++) {
+				myClassif->betaMove[k] = 0;
+				numActive += myClassif->betaActive[k];
+			}
+			singleMove = 1;
+			continue;
+		}
+		/*the last joint round kept the likelihood*/
+		if(numActive == 0) {
+			break;
+		}
+
+		numActive = 0;
+		singleMove = 1;
+		for(k=0;k<numClust;k++) {
+			myClassif->betaMove[k] = 0;
+			myClassif->betaPrevious[k] = myClassif->beta[k];
+			if(!myClassif->betaActive[k]) {
+				continue;
+			}
+			derivatePlus = myClassif->betaTotals[1+k];
+			derivateMinus = myClassif->betaTotals[1+numClust+k];
+			/*which way to go?*/
+			if(derivatePlus > 0 || derivateMinus > 0) {
+				if(derivatePlus > 0 && derivatePlus>derivateMinus) {
+					myClassif->beta[k] += step;
+					myClassif->betaMove[k] = 1;
+					myClassif->betaGain[k] = derivatePlus;
+				}
+				else if((myClassif->beta[k] -step) > 0) {
+					myClassif->beta[k] -= step;
+					myClassif->betaMove[k] = -1;
+					myClassif->betaGain[k] = derivateMinus;
+				}
+				else {
+					myClassif->beta[k] = 0.0;
+					myClassif->betaActive[k] = 0;
+					myClassif->betaMove[k] = BETA_TO_ZERO;
+					myClassif->betaGain[k] = derivateMinus;
+				}
+			}
+			else {
+				myClassif->betaActive[k] = 0;
+			}
+			numActive += myClassif->betaActive[k];
+			if(myClassif->betaMove[k] != 0) {
+				singleMove = 0;
+			}
+
+			/*Uncomment for verbose mode on the gradient ascent*/
+			/*printf("cluster : %d | derivPlus: %e | derivMinus: %e | like : %e | beta : %f | step : %f\n",k,derivatePlus,derivateMinus,currentLike,myClassif->beta[k],step);*/
+		}
+		lastLike = currentLike;
+	}
+}
+
+
+
+
+/*Mean field E step
+*Returns the number of clusters assignments that have changed compared to the previous clustering
+*/
+int meanFieldEStep(classif * myClassif /*I\O*/) {
+	int hasConverged;
+	
+	/*Computing new cell densities*/
+	computeCellDensities(myClassif);
+	/*Computing thims with fixed point algo with 3 steps, the last one assigning cells to clusters*/
+	computeThims(myClassif,2);
+	hasConverged = meanFieldSweep(myClassif,1);
+
+	return reduceSumInt(hasConverged);
+}
+
+/* Hard assignment engines: ICM takes the most likely label of each cell given the labels of its neighbours, Gibbs samples it.
+* They work on the labels and per cell neighbour label counts only, the posteriors being set to 1 for the label (sparse storage with m = 1).
+* The owned cells are coloured so that no two neighbours share a colour, the cells of one colour are then updated in parallel
+* as none of them reads the label of another. Gibbs draws come from a counter based generator keyed on (seed, sweep, cell),
+* so the labels do not depend on the number of threads.
+*/
+
+/*Greedy colouring of the owned cells in index order, cells then grouped by colour in colourCells*/
+void colourGraph(classif * myClassif /*I\O*/) {
+	int i,j,c,other;
+	int numOwned = myClassif->set.numOwned;
+	int * used = myClassif->threadPresent;
+	int * colour = myClassif->cellColour;
+	dataPoint * point;
+
+	for(c=0;c<=myClassif->set.maxNei;c++) {
+		used[c] = -1;
+	}
+	myClassif->numColours = 0;
+	for(i=0;i<numOwned;i++) {
+		point = &(myClassif->set.obs[i]);
+		/*colours of the neighbours already coloured, halo points are updated by their own process*/
+		for(j=0;j<point->numNei;j++) {
+			other = point->nei[j];
+			if(other < i) {
+				used[colour[other]] = i;
+			}
+		}
+		for(c=0;used[c] == i;c++);
+		colour[i] = c;
+		if(c+1 > myClassif->numColours) {
+			myClassif->numColours = c+1;
+		}
+	}
+
+	/*counting sort by colour*/
+	memset(myClassif->colourStart,0,sizeof(int)*(myClassif->numColours+1));
+	for(i=0;i<numOwned;i++) {
+		myClassif->colourStart[colour[i]+1]++;
+	}
+	for(c=0;c<myClassif->numColours;c++) {
+		myClassif->colourStart[c+1] += myClassif->colourStart[c];
+	}
+	for(i=0;i<numOwned;i++) {
+		myClassif->colourCells[myClassif->colourStart[colour[i]]++] = i;
+	}
+	for(c=myClassif->numColours;c>0;c--) {
+		myClassif->colourStart[c] = myClassif->colourStart[c-1];
+	}
+	myClassif->colourStart[0] = 0;
+}
+
+/*Mixes the bits of a 32 bits value*/
+static unsigned long mix32(unsigned long x) {
+	x &= 0xffffffffUL;
+	x ^= x >> 16;
+	x = (x*0x7feb352dUL) & 0xffffffffUL;
+	x ^= x >> 15;
+	x = (x*0x846ca68bUL) & 0xffffffffUL;
+	x ^= x >> 16;
+	return x;
+}
+
+/*Uniform number in ]0,1[ drawn from a seed and two counters, the same whatever the thread*/
+double counterUniform(unsigned long seed/*I*/,unsigned long counter/*I*/,unsigned long cell/*I*/) {
+	unsigned long x;
+
+	x = mix32(seed ^ mix32(counter*0x9e3779b9UL ^ mix32(cell+0x632be5abUL)));
+	return ((double)x+0.5)/4294967296.0;
+}
+
+/*Updates the labels of the cells of the current colour handled by one thread*/
+static void hardSweepWork(threadTask * task) {
+	classif * myClassif = (classif *)task->data;
+	int numClust = myClassif->numClust;
+	int * neiCount = myClassif->threadNeiCount+task->thread*numClust;
+	double * score = myClassif->threadScores+task->thread*numClust;
+	int * cells = myClassif->colourCells+myClassif->colourStart[myClassif->currentColour];
+	int first,last,e,i,j,k,label;
+	double maxScore,sum,draw;
+	dataPoint * point;
+	emReal * densities;
+
+	threadRange(task,myClassif->colourStart[myClassif->currentColour+1]-myClassif->colourStart[myClassif->currentColour],&first,&last);
+	for(e=first;e<last;e++) {
+		i = cells[e];
+		point = &(myClassif->set.obs[i]);
+		for(j=0;j<point->numNei;j++) {
+			neiCount[myClassif->clust[point->nei[j]]-1]++;
+		}
+
+		/*log of the unnormalised probability of each label*/
+		label = myClassif->clust[i];
+		maxScore = -HUGE_VAL;
+		for(k=0;k<numClust;k++) {
+			densities = myClassif->cellDensities[k];
+			score[k] = densities[myClassif->set.profile[i]]+myClassif->beta[k]*neiCount[k];
+			if(score[k] > maxScore) {
+				maxScore = score[k];
+				label = k+1;
+			}
+			neiCount[k] = 0;
+		}
+		/*no possible label, the cell keeps its own*/
+		if(maxScore == -HUGE_VAL) {
+			continue;
+		}
+		if(myClassif->engine == E_STEP_GIBBS) {
+			sum = 0;
+			for(k=0;k<numClust;k++) {
+				score[k] = exp(score[k]-maxScore);
+				sum += score[k];
+			}
+			draw = counterUniform(myClassif->rngSeed,myClassif->sweepCount,(unsigned long)i)*sum;
+			for(k=0;k<numClust-1 && draw >= score[k];k++) {
+				draw -= score[k];
+			}
+			label = k+1;
+		}
+		myClassif->clust[i] = label;
+	}
+}
+
+/*ICM or Gibbs E step
+*Returns the number of clusters assignments that have changed compared to the previous clustering
+*/
+int hardEStep(classif * myClassif /*I\O*/) {
+	int i,c,s,changed=0;
+	int m = myClassif->sparseM;
+
+	computeCellDensities(myClassif);
+	memcpy(myClassif->bestClust,myClassif->clust,sizeof(int)*myClassif->set.num);
+	for(s=0;s<HARD_SWEEPS;s++) {
+		for(c=0;c<myClassif->numColours;c++) {
+			myClassif->currentColour = c;
+			runPool(myClassif->pool,hardSweepWork,myClassif);
+		}
+		myClassif->sweepCount++;
+		/*Neighbours owned by other processes see the new labels at the next sweep*/
+		exchangeHaloLabels(myClassif);
+	}
+
+	/*the posterior of a cell is 1 for its label*/
+	for(i=0;i<myClassif->set.numOwned;i++) {
+		if(myClassif->clust[i] != myClassif->bestClust[i]) {
+			changed++;
+			markLabelChanged(myClassif,i);
+		}
+		if(m > 0) {
+			myClassif->topClust[i*m] = myClassif->clust[i]-1;
+			myClassif->topTihm[i*m] = 1;
+			myClassif->residual[i] = 0;
+		}
+		else {
+			myClassif->tihm[0][i] = 1;
+		}
+	}
+	exchangeHaloPosteriors(myClassif);
+	myClassif->thetaStatsValid = 0;
+	myClassif->densityLogLikeValid = 0;
+	myClassif->expectationValid = 0;
+
+	return reduceSumInt(changed);
+}
+
+/*E step engines, indexed by E_STEP_MEAN_FIELD, E_STEP_ICM and E_STEP_GIBBS*/
+static int (*eStepEngines[3])(classif *) = {meanFieldEStep,hardEStep,hardEStep};
+
+/*E Step of the EM algorithm
+*Returns the number of clusters assignments that have changed compared to the previous clustering
+*this value is used to know if convergence has been reached
+*/
+int eStep(classif * myClassif /*I\O*/) {
+	return eStepEngines[myClassif->engine](myClassif);
+}
+
+
+/*returns the numbers of cells having similarly expressed genes as the exp one in the same cluster*/
+int numCellsAlike(int exp,int indexGene,int clust,classif * myClassif) {
+	int numCells=0,i;
+	for(i=0;i<myClassif->set.num;i++) {
+		if(exp == myClassif->set.obs[i].expVect[indexGene] && clust == myClassif->clust[i]){
+			numCells++;
+		}
+	}
+	return numCells;
+}
+
+/*returns number of cells for one cluster*/
+int numCellsClust(int clust,classif * myClassif) {
+	int numCells=0,i;
+	for(i=0;i<myClassif->set.numOwned;i++) {
+		if(clust == myClassif->clust[i]){
+			numCells++;
+		}
+	}
+	return reduceSumInt(numCells);
+}
+
+
+/*Maximize thetas
+*
+*The cells of each cluster are first counted per expression profile, each profile then adds its multiplicity to the counts of its expressed genes.
+*Column 0 (the cell ID) of each cluster row holds the number of cells in the cluster
+*/
+void maxThetas(classif * myClassif /*I/O*/) {
+	double numtheta;
+	double dentheta;	
+	int k,j,i,u;
+	int length = myClassif->set.length;
+	int numProfiles = myClassif->set.numProfiles;
+	double * counts;
+	int * profileClust = myClassif->profileClust;
+	int * expVect;
+
+	counts = myClassif->thetaCounts;
+	memset(counts,0,sizeof(double)*myClassif->numClust*length);
+
+	/*Iter on cells, unless the last E step already counted them*/
+	if(!myClassif->thetaStatsValid) {
+		memset(profileClust,0,sizeof(int)*myClassif->numClust*numProfiles);
+		for(i=0;i<myClassif->set.numOwned;i++) {
+			profileClust[(myClassif->clust[i]-1)*numProfiles+myClassif->set.profile[i]]++;
+		}
+	}
+	/*the counts are consumed, labels may change before the next call*/
+	myClassif->thetaStatsValid = 0;
+	for(k=0;k<myClassif->numClust;k++) {
+		for(u=0;u<numProfiles;u++) {
+			if(profileClust[k*numProfiles+u] == 0) {
+				continue;
+			}
+			counts[k*length] += profileClust[k*numProfiles+u];
+			expVect = myClassif->set.obs[myClassif->set.profileCell[u]].expVect;
+			/*Iter on genes starting at 1 because first value is cell ID !!!*/
+			for(j=1;j<length;j++){
+				if(expVect[j] == 1) {
+					counts[k*length+j] += profileClust[k*numProfiles+u];
+				}
+			}
+		}
+	}
+	reduceSumVector(counts,myClassif->numClust*length);
+
+	/*Iter on clusters*/
+	for(k=0;k<myClassif->numClust;k++) {
+		/*Iter on genes starting at 1 because first value is cell ID !!!*/
+		for(j=1;j<length;j++){
+			numtheta =  counts[k*length+j];
+			dentheta = counts[k*length];
+
+			myClassif->parameters.theta[k][j] = (numtheta/dentheta);
+
+		}		
+			
+	}
+}
+
+/*M step of the algorithm*/
+void mStep(classif * myClassif,int type_beta) {
+	
+	/*Maximizing thetas*/
+	maxThetas(myClassif);
+	if(type_beta == 0){
+		/*Maximizing betas*/
+		gradientAscent(myClassif);
+	}
+
+	
+}
+
+
+
+
+
+/**********************************START Distributed run functions*****************************************/
+/* Without MPI (or with a single process) every point is owned and these functions reduce to no-ops.
+* With MPI, each process updates its owned points and keeps read-only copies (halo) of their neighbours owned by other processes.
+*/
+
+/*Returns 1 on the process in charge of printing and writing the output files*/
+int isMainProcess(void) {
+#ifdef USE_MPI
+	int rank;
+	MPI_Comm_rank(MPI_COMM_WORLD,&rank);
+	return rank == 0;
+#else
+	return 1;
+#endif
+}
+
+/*Returns the local index of a point of the full dataset, -1 if it is not stored by this process*/
+int localIndex(dataSet * set/*I*/,int globalIndex/*I*/) {
+	if(set->halo == NULL) {
+		return globalIndex;
+	}
+	return set->halo->globalToLocal[globalIndex];
+}
+
+/*Sums a vector over all processes*/
+void reduceSumVector(double * vect/*I\O*/,int length/*I*/) {
+#ifdef USE_MPI
+	MPI_Allreduce(MPI_IN_PLACE,vect,length,MPI_DOUBLE,MPI_SUM,MPI_COMM_WORLD);
+#endif
+}
+
+void reduceSumIntVector(int * vect/*I\O*/,int length/*I*/) {
+#ifdef USE_MPI
+	MPI_Allreduce(MPI_IN_PLACE,vect,length,MPI_INT,MPI_SUM,MPI_COMM_WORLD);
+#endif
+}
+
+double reduceSum(double value/*I*/) {
+	reduceSumVector(&value,1);
+	return value;
+}
+
+int reduceSumInt(int value/*I*/) {
+	reduceSumIntVector(&value,1);
+	return value;
+}
+
+#ifdef USE_MPI
+/*Makes sure the halo buffers can hold numValues values per point*/
+void growHaloBuffers(haloPlan * halo/*I\O*/,int numValues/*I*/) {
+	if(halo->bufSize >= numValues) {
+		return;
+	}
+	free(halo->sendBuf);
+	free(halo->recvBuf);
+	halo->sendBuf = (double *)emMalloc(sizeof(double)*(halo->numSend*numValues+1));
+	halo->recvBuf = (double *)emMalloc(sizeof(double)*(halo->numRecv*numValues+1));
+	if (halo->sendBuf == NULL || halo->recvBuf == NULL) {
+		printf("Out of memory halo\n");
+		exit(-1);
+	}
+	halo->bufSize = numValues;
+}
+
+/*Sends numValues values per point from the send buffer and receives those of the halo points*/
+void exchangeHaloBuffers(haloPlan * halo/*I\O*/,int numValues/*I*/) {
+	int p,numRequests=0;
+
+	for(p=0;p<halo->numProcs;p++) {
+		if(halo->recvCount[p] > 0) {
+			MPI_Irecv(halo->recvBuf+halo->recvDispl[p]*numValues,halo->recvCount[p]*numValues,MPI_DOUBLE,p,0,MPI_COMM_WORLD,&(halo->requests[numRequests++]));
+		}
+	}
+	for(p=0;p<halo->numProcs;p++) {
+		if(halo->sendCount[p] > 0) {
+			MPI_Isend(halo->sendBuf+halo->sendDispl[p]*numValues,halo->sendCount[p]*numValues,MPI_DOUBLE,p,0,MPI_COMM_WORLD,&(halo->requests[numRequests++]));
+		}
+	}
+	MPI_Waitall(numRequests,halo->requests,MPI_STATUSES_IGNORE);
+}
+#endif
+
+/*Copies the posteriors of the owned points to the processes holding them as halo points*/
+void exchangeHaloPosteriors(classif * myClassif/*I\O*/) {
+#ifdef USE_MPI
+	haloPlan * halo = myClassif->set.halo;
+	int i,k,numClust = myClassif->numClust;
+	int m = myClassif->sparseM;
+
+	if(halo == NULL) {
+		return;
+	}
+	if(m > 0) {
+		/*stored clusters, their posteriors and the residual*/
+		growHaloBuffers(halo,2*m+1);
+		for(i=0;i<halo->numSend;i++) {
+			for(k=0;k<m;k++) {
+				halo->sendBuf[i*(2*m+1)+k] = (double)myClassif->topClust[halo->sendIdx[i]*m+k];
+				halo->sendBuf[i*(2*m+1)+m+k] = myClassif->topTihm[halo->sendIdx[i]*m+k];
+			}
+			halo->sendBuf[i*(2*m+1)+2*m] = myClassif->residual[halo->sendIdx[i]];
+		}
+		exchangeHaloBuffers(halo,2*m+1);
+		for(i=0;i<halo->numRecv;i++) {
+			for(k=0;k<m;k++) {
+				myClassif->topClust[(myClassif->set.numOwned+i)*m+k] = (int)halo->recvBuf[i*(2*m+1)+k];
+				myClassif->topTihm[(myClassif->set.numOwned+i)*m+k] = halo->recvBuf[i*(2*m+1)+m+k];
+			}
+			myClassif->residual[myClassif->set.numOwned+i] = halo->recvBuf[i*(2*m+1)+2*m];
+		}
+		return;
+	}
+	growHaloBuffers(halo,numClust);
+	/*packing the values of each point contiguously*/
+	for(i=0;i<halo->numSend;i++) {
+		for(k=0;k<numClust;k++) {
+			halo->sendBuf[i*numClust+k] = myClassif->tihm[k][halo->sendIdx[i]];
+		}
+	}
+	exchangeHaloBuffers(halo,numClust);
+	for(i=0;i<halo->numRecv;i++) {
+		for(k=0;k<numClust;k++) {
+			myClassif->tihm[k][myClassif->set.numOwned+i] = halo->recvBuf[i*numClust+k];
+		}
+	}
+#endif
+}
+
+/*Copies the labels of the owned points to the processes holding them as halo points*/
+void exchangeHaloLabels(classif * myClassif/*I\O*/) {
+#ifdef USE_MPI
+	haloPlan * halo = myClassif->set.halo;
+	int i;
+
+	if(halo == NULL) {
+		return;
+	}
+	growHaloBuffers(halo,1);
+	for(i=0;i<halo->numSend;i++) {
+		halo->sendBuf[i] = (double)myClassif->clust[halo->sendIdx[i]];
+	}
+	exchangeHaloBuffers(halo,1);
+	for(i=0;i<halo->numRecv;i++) {
+		myClassif->clust[myClassif->set.numOwned+i] = (int)halo->recvBuf[i];
+	}
+#endif
+}
+
+/*Collects the labels of all points in the dataset order
+returns a newly allocated vector on the main process, NULL on the others*/
+int * gatherLabels(classif * myClassif/*I*/) {
+	int * labels = NULL;
+#ifdef USE_MPI
+	int * counts = NULL;
+	int * displs = NULL;
+	int * ids = NULL;
+	int * clusts = NULL;
+	int p,i,numOwned = myClassif->set.numOwned;
+	haloPlan * halo = myClassif->set.halo;
+
+	if(halo != NULL) {
+		if(isMainProcess()) {
+			counts = (int *)emMalloc(sizeof(int)*halo->numProcs);
+			displs = (int *)emMalloc(sizeof(int)*halo->numProcs);
+			ids = (int *)emMalloc(sizeof(int)*myClassif->set.numGlobal);
+			clusts = (int *)emMalloc(sizeof(int)*myClassif->set.numGlobal);
+			labels = (int *)emMalloc(sizeof(int)*myClassif->set.numGlobal);
+		}
+		MPI_Gather(&numOwned,1,MPI_INT,counts,1,MPI_INT,0,MPI_COMM_WORLD);
+		if(isMainProcess()) {
+			displs[0] = 0;
+			for(p=1;p<halo->numProcs;p++) {
+				displs[p] = displs[p-1]+counts[p-1];
+			}
+		}
+		MPI_Gatherv(myClassif->set.globalId,numOwned,MPI_INT,ids,counts,displs,MPI_INT,0,MPI_COMM_WORLD);
+		MPI_Gatherv(myClassif->clust,numOwned,MPI_INT,clusts,counts,displs,MPI_INT,0,MPI_COMM_WORLD);
+		if(isMainProcess()) {
+			for(i=0;i<myClassif->set.numGlobal;i++) {
+				labels[ids[i]] = clusts[i];
+			}
+			free(counts);
+			free(displs);
+			free(ids);
+			free(clusts);
+		}
+		return labels;
+	}
+#endif
+	labels = (int *)emMalloc(sizeof(int)*myClassif->set.num);
+	memcpy(labels,myClassif->clust,sizeof(int)*myClassif->set.num);
+	return labels;
+}
+
+/*Reads the neighbouring file into a compressed graph (start offsets of size num+1 and 0 based neighbours indexes)
+returns the number of points*/
+int load_graph(FILE * data/*I*/,int ** start/*O*/,int ** adj/*O*/) {
+	char * line = NULL;
+	int lineSize;
+	int i=0,length,capacity=1024,adjCapacity=8192;
+
+	*start = (int *)emMalloc(sizeof(int)*(capacity+1));
+	*adj = (int *)emMalloc(sizeof(int)*adjCapacity);
+	(*start)[0] = 0;
+	while(readLine(data,&line,&lineSize) >= 0) {
+		length = atoi(line);
+		if(length < 0) {
+			length = 0;
+		}
+		if(i == capacity) {
+			capacity *= 2;
+			*start = (int *)emRealloc(*start,sizeof(int)*(capacity+1));
+		}
+		while((*start)[i]+length > adjCapacity) {
+			adjCapacity *= 2;
+			*adj = (int *)emRealloc(*adj,sizeof(int)*adjCapacity);
+		}
+		if (*start == NULL || *adj == NULL) {
+			printf("Out of memory neighbours\n");
+			exit(-1);
+		}
+		if(parse_nei(line,(*adj)+(*start)[i],length) != length) {
+			printf("Line %d of the neighbouring file does not list the %d neighbours it declares\n",i+1,length);
+			exit(-1);
+		}
+		(*start)[i+1] = (*start)[i]+length;
+		i++;
+	}
+	free(line);
+	return i;
+}
+
+/*Reads the num first lines of a x,y,z coordinates file*/
+void load_coordinates(FILE * data/*I*/,int num/*I*/,double * coords/*O*/) {
+	char line[LG_NEI_MAX];
+	int i=0;
+
+	while(i < num && fgets(line,LG_NEI_MAX,data) != NULL) {
+		if(strchr(line,'\n') == NULL && !feof(data)) {
+			printf("Line %d of the coordinates file is longer than %d characters\n",i+1,LG_NEI_MAX-2);
+			exit(-1);
+		}
+		if(sscanf(line,"%lf,%lf,%lf",&coords[3*i],&coords[3*i+1],&coords[3*i+2]) != 3) {
+			printf("Wrong coordinates on line %d\n",i+1);
+			exit(-1);
+		}
+		i++;
+	}
+	if(i < num) {
+		printf("Missing coordinates, %d lines for %d points\n",i,num);
+		exit(-1);
+	}
+}
+
+/*qsort has no context argument, the axis and coordinates being sorted are kept here*/
+static double * sortCoords;
+static int sortAxis;
+
+int compareCoordinates(const void * a, const void * b) {
+	int ia = *(const int *)a, ib = *(const int *)b;
+	double ca = sortCoords[3*ia+sortAxis], cb = sortCoords[3*ib+sortAxis];
+
+	if(ca != cb) {
+		return ca < cb ? -1 : 1;
+	}
+	/*ties broken on index so that every process gets the same partition*/
+	return ia-ib;
+}
+
+/*Recursive coordinate bisection of the points ids[0..num-1] into numParts spatial blocks*/
+void bisectCoordinates(double * coords/*I*/,int * ids/*I\O*/,int num/*I*/,int firstPart/*I*/,int numParts/*I*/,int * owner/*O*/) {
+	int i,d,axis=0,cut,leftParts;
+	double low[3],high[3];
+
+	if(numParts == 1 || num == 0) {
+		for(i=0;i<num;i++) {
+			owner[ids[i]] = firstPart;
+		}
+		return;
+	}
+	/*cutting across the longest extent*/
+	for(d=0;d<3;d++) {
+		low[d] = high[d] = coords[3*ids[0]+d];
+	}
+	for(i=1;i<num;i++) {
+		for(d=0;d<3;d++) {
+			if(coords[3*ids[i]+d] < low[d]) low[d] = coords[3*ids[i]+d];
+			if(coords[3*ids[i]+d] > high[d]) high[d] = coords[3*ids[i]+d];
+		}
+	}
+	for(d=1;d<3;d++) {
+		if(high[d]-low[d] > high[axis]-low[axis]) {
+			axis = d;
+		}
+	}
+	sortCoords = coords;
+	sortAxis = axis;
+	qsort(ids,num,sizeof(int),compareCoordinates);
+
+	leftParts = numParts/2;
+	cut = (int)((double)num*leftParts/numParts);
+	bisectCoordinates(coords,ids,cut,firstPart,leftParts,owner);
+	bisectCoordinates(coords,ids+cut,num-cut,firstPart+leftParts,numParts-leftParts,owner);
+}
+
+/*Graph partitioning by breadth first growth of numParts connected blocks of equal size*/
+void growPartitions(int num/*I*/,int * start/*I*/,int * adj/*I*/,int numParts/*I*/,int * owner/*O*/) {
+	int * queue;
+	int i,j,head=0,tail=0,seed=0,part=0,size=0,target;
+
+	queue = (int *)emMalloc(sizeof(int)*num);
+	for(i=0;i<num;i++) {
+		owner[i] = -1;
+	}
+	target = num/numParts+(num%numParts > 0);
+	while(tail < num) {
+		/*block exhausted its connected component, restart from the first free point*/
+		if(head == tail) {
+			while(owner[seed] >= 0) {
+				seed++;
+			}
+			if(size == target) {
+				part++;
+				size = 0;
+				target = (num-tail)/(numParts-part)+((num-tail)%(numParts-part) > 0);
+			}
+			owner[seed] = part;
+			queue[tail++] = seed;
+			size++;
+		}
+		i = queue[head++];
+		for(j=start[i];j<start[i+1] && tail<num;j++) {
+			if(owner[adj[j]] < 0) {
+				if(size == target) {
+					/*next block grows from the current front*/
+					part++;
+					size = 0;
+					target = (num-tail)/(numParts-part)+((num-tail)%(numParts-part) > 0);
+				}
+				owner[adj[j]] = part;
+				queue[tail++] = adj[j];
+				size++;
+			}
+		}
+	}
+	free(queue);
+}
+
+#ifdef USE_MPI
+/*Partitions the dataset over the processes and loads the owned points and their neighbours
+*The partition is a spatial bisection if a coordinates file is given, a graph partition otherwise
+*/
+void load_distributed(FILE * data/*I*/,int numGlobal/*I*/,int * start/*I*/,int * adj/*I*/,FILE * coords/*I*/,dataSet * myData/*O*/) {
+	int * owner;
+	int * ids;
+	int * vect;
+	int * recvIds;
+	double * coordinates;
+	char * line;
+	haloPlan * halo;
+	int numOwned=0,numHalo=0,i,j,p,g,l,length=0;
+
+	halo = (haloPlan *)emCalloc(1,sizeof(haloPlan));
+	myData->maxNei = 0;
+	MPI_Comm_size(MPI_COMM_WORLD,&(halo->numProcs));
+	MPI_Comm_rank(MPI_COMM_WORLD,&(halo->rank));
+
+	/*every process has the whole graph and computes the same partition*/
+	owner = (int *)emMalloc(sizeof(int)*numGlobal);
+	if(coords != NULL) {
+		coordinates = (double *)emMalloc(sizeof(double)*3*numGlobal);
+		ids = (int *)emMalloc(sizeof(int)*numGlobal);
+		load_coordinates(coords,numGlobal,coordinates);
+		for(i=0;i<numGlobal;i++) {
+			ids[i] = i;
+		}
+		bisectCoordinates(coordinates,ids,numGlobal,0,halo->numProcs,owner);
+		free(coordinates);
+		free(ids);
+	}
+	else {
+		growPartitions(numGlobal,start,adj,halo->numProcs,owner);
+	}
+
+	/*owned points first in dataset order, then halo points grouped by owner*/
+	halo->globalToLocal = (int *)emMalloc(sizeof(int)*numGlobal);
+	for(g=0;g<numGlobal;g++) {
+		halo->globalToLocal[g] = -1;
+		if(owner[g] == halo->rank) {
+			halo->globalToLocal[g] = numOwned++;
+		}
+	}
+	halo->recvCount = (int *)emCalloc(halo->numProcs,sizeof(int));
+	halo->recvDispl = (int *)emCalloc(halo->numProcs,sizeof(int));
+	halo->sendCount = (int *)emCalloc(halo->numProcs,sizeof(int));
+	halo->sendDispl = (int *)emCalloc(halo->numProcs,sizeof(int));
+	for(g=0;g<numGlobal;g++) {
+		if(owner[g] != halo->rank) {
+			continue;
+		}
+		for(j=start[g];j<start[g+1];j++) {
+			if(owner[adj[j]] != halo->rank && halo->globalToLocal[adj[j]] == -1) {
+				/*marked until the halo is laid out*/
+				halo->globalToLocal[adj[j]] = -2;
+				halo->recvCount[owner[adj[j]]]++;
+				numHalo++;
+			}
+		}
+	}
+	for(p=1;p<halo->numProcs;p++) {
+		halo->recvDispl[p] = halo->recvDispl[p-1]+halo->recvCount[p-1];
+	}
+	myData->globalId = (int *)emMalloc(sizeof(int)*(numOwned+numHalo));
+	ids = (int *)emCalloc(halo->numProcs,sizeof(int));
+	for(g=0;g<numGlobal;g++) {
+		if(halo->globalToLocal[g] >= 0) {
+			myData->globalId[halo->globalToLocal[g]] = g;
+		}
+		else if(halo->globalToLocal[g] == -2) {
+			halo->globalToLocal[g] = numOwned+halo->recvDispl[owner[g]]+ids[owner[g]]++;
+			myData->globalId[halo->globalToLocal[g]] = g;
+		}
+	}
+	free(ids);
+
+	/*telling the owners which of their points are needed here*/
+	MPI_Alltoall(halo->recvCount,1,MPI_INT,halo->sendCount,1,MPI_INT,MPI_COMM_WORLD);
+	for(p=1;p<halo->numProcs;p++) {
+		halo->sendDispl[p] = halo->sendDispl[p-1]+halo->sendCount[p-1];
+	}
+	halo->numRecv = numHalo;
+	halo->numSend = halo->sendDispl[halo->numProcs-1]+halo->sendCount[halo->numProcs-1];
+	halo->sendIdx = (int *)emMalloc(sizeof(int)*(halo->numSend+1));
+	recvIds = myData->globalId+numOwned;
+	MPI_Alltoallv(recvIds,halo->recvCount,halo->recvDispl,MPI_INT,halo->sendIdx,halo->sendCount,halo->sendDispl,MPI_INT,MPI_COMM_WORLD);
+	for(i=0;i<halo->numSend;i++) {
+		halo->sendIdx[i] = halo->globalToLocal[halo->sendIdx[i]];
+	}
+	halo->requests = (MPI_Request *)emMalloc(sizeof(MPI_Request)*2*halo->numProcs);
+
+	/*local neighbouring, halo points have no neighbours of their own*/
+	myData->obs = (dataPoint *)emCalloc(numOwned+numHalo,sizeof(dataPoint));
+	for(g=0;g<numGlobal;g++) {
+		l = halo->globalToLocal[g];
+		if(l < 0 || l >= numOwned) {
+			continue;
+		}
+		myData->obs[l].numNei = start[g+1]-start[g];
+		if(myData->obs[l].numNei > myData->maxNei) {
+			myData->maxNei = myData->obs[l].numNei;
+		}
+		myData->obs[l].nei = (int *)emMalloc(sizeof(int)*(myData->obs[l].numNei+1));
+		for(j=start[g];j<start[g+1];j++) {
+			myData->obs[l].nei[j-start[g]] = halo->globalToLocal[adj[j]];
+		}
+	}
+	free(start);
+	free(adj);
+	free(owner);
+
+	/*keeping the expression vectors of the owned points only*/
+	line = (char *)emMalloc(sizeof(char)*LG_LIG_MAX);
+	vect = (int *)emMalloc(sizeof(int)*LG_GENES_MAX);
+	g = 0;
+	while(g < numGlobal && fgets(line,LG_LIG_MAX,data) != NULL) {
+		l = halo->globalToLocal[g];
+		if(l >= 0 && l < numOwned) {
+			length = parse_vect(line,vect);
+			myData->obs[l].expVect = (int *)emMalloc(sizeof(int)*length);
+			if (myData->obs[l].expVect == NULL) {
+				printf("Out of memory data\n");
+				exit(-1);
+			}
+			memcpy(myData->obs[l].expVect,vect,sizeof(int)*length);
+		}
+		g++;
+	}
+	/*trailing lines are counted as the serial load_data does, so that both reject them*/
+	while(fgets(line,LG_LIG_MAX,data) != NULL) {
+		g++;
+	}
+	free(line);
+	free(vect);
+	if(g != numGlobal) {
+		printf("The data file has %d lines, the neighbouring file %d\n",g,numGlobal);
+		exit(-1);
+	}
+
+	myData->length = length;
+	myData->num = numOwned+numHalo;
+	myData->numOwned = numOwned;
+	myData->numGlobal = numGlobal;
+	myData->halo = halo;
+	/*a process may own no point at all, it still needs the vector length*/
+	MPI_Allreduce(MPI_IN_PLACE,&(myData->length),1,MPI_INT,MPI_MAX,MPI_COMM_WORLD);
+	packExpression(myData);
+	dedupProfiles(myData);
+	printf("Process %d owns %d points and %d halo points\n",halo->rank,numOwned,numHalo);
+}
+#endif
+
+/**********************************END Distributed run functions*****************************************/
+
+
+/**********************************START Threads*****************************************/
+
+/*Number of processors available, the default number of threads*/
+int defaultThreads(void) {
+#if defined(_SC_NPROCESSORS_ONLN) && !defined(EM_NO_THREADS)
+	long numProcs = sysconf(_SC_NPROCESSORS_ONLN);
+	if(numProcs > 0) {
+		return (int)numProcs;
+	}
+#endif
+	return 1;
+}
+
+#ifndef EM_NO_THREADS
+/*Entry point of the pthreads*/
+static void * threadMain(void * task) {
+	threadTask * myTask = (threadTask *)task;
+	myTask->work(myTask);
+	return NULL;
+}
+#endif
+
+/*Runs work once per thread index, the calling thread taking index 0
+*Built with -DEM_NO_THREADS the indexes are run one after the other, the results are the same
+*/
+void runThreads(int numThreads/*I*/,void (*work)(threadTask *)/*I*/,void * data/*I*/) {
+	int t;
+	threadTask * tasks;
+#ifndef EM_NO_THREADS
+	pthread_t * threads;
+#endif
+
+	if(numThreads < 1) {
+		numThreads = 1;
+	}
+	tasks = (threadTask *)emMalloc(sizeof(threadTask)*numThreads);
+	if (tasks == NULL) {
+		printf("Out of memory threads\n");
+		exit(-1);
+	}
+	for(t=0;t<numThreads;t++) {
+		tasks[t].thread = t;
+		tasks[t].numThreads = numThreads;
+		tasks[t].work = work;
+		tasks[t].data = data;
+		tasks[t].pool = NULL;
+	}
+#ifndef EM_NO_THREADS
+	threads = (pthread_t *)emMalloc(sizeof(pthread_t)*numThreads);
+	if (threads == NULL) {
+		printf("Out of memory threads\n");
+		exit(-1);
+	}
+	for(t=1;t<numThreads;t++) {
+		if(pthread_create(&threads[t],NULL,threadMain,&tasks[t]) != 0) {
+			printf("Cannot start thread %d\n",t);
+			exit(-1);
+		}
+	}
+	work(&tasks[0]);
+	for(t=1;t<numThreads;t++) {
+		pthread_join(threads[t],NULL);
+	}
+	free(threads);
+#else
+	for(t=0;t<numThreads;t++) {
+		work(&tasks[t]);
+	}
+#endif
+	free(tasks);
+}
+
+/*First and last (excluded) item of the block of one thread*/
+void threadRange(threadTask * task/*I*/,int num/*I*/,int * first/*O*/,int * last/*O*/) {
+	*first = (int)(((long)num*task->thread)/task->numThreads);
+	*last = (int)(((long)num*(task->thread+1))/task->numThreads);
+}
+
+#ifndef EM_NO_THREADS
+/*Worker of a pool, runs the work of each generation*/
+static void * poolMain(void * task) {
+	threadTask * myTask = (threadTask *)task;
+	threadPool * pool = (threadPool *)myTask->pool;
+	int generation = 0;
+
+	while(1) {
+		pthread_mutex_lock(&(pool->lock));
+		while(pool->generation == generation && !pool->stop) {
+			pthread_cond_wait(&(pool->start),&(pool->lock));
+		}
+		if(pool->stop) {
+			pthread_mutex_unlock(&(pool->lock));
+			return NULL;
+		}
+		generation = pool->generation;
+		pthread_mutex_unlock(&(pool->lock));
+
+		myTask->work(myTask);
+
+		pthread_mutex_lock(&(pool->lock));
+		if(--(pool->remaining) == 0) {
+			pthread_cond_signal(&(pool->done));
+		}
+		pthread_mutex_unlock(&(pool->lock));
+	}
+}
+#endif
+
+/*Starts the numThreads-1 workers of a pool, the thread calling runPool being the first one*/
+void createPool(threadPool * pool/*O*/,int numThreads/*I*/) {
+	int t;
+
+#ifdef EM_NO_THREADS
+	numThreads = 1;
+#endif
+	pool->numThreads = numThreads < 1 ? 1 : numThreads;
+	pool->generation = 0;
+	pool->remaining = 0;
+	pool->stop = 0;
+	pool->tasks = (threadTask *)emMalloc(sizeof(threadTask)*pool->numThreads);
+	if (pool->tasks == NULL) {
+		printf("Out of memory threads\n");
+		exit(-1);
+	}
+	for(t=0;t<pool->numThreads;t++) {
+		pool->tasks[t].thread = t;
+		pool->tasks[t].numThreads = pool->numThreads;
+		pool->tasks[t].pool = pool;
+	}
+#ifndef EM_NO_THREADS
+	pool->threads = (pthread_t *)emMalloc(sizeof(pthread_t)*pool->numThreads);
+	if (pool->threads == NULL) {
+		printf("Out of memory threads\n");
+		exit(-1);
+	}
+	pthread_mutex_init(&(pool->lock),NULL);
+	pthread_cond_init(&(pool->start),NULL);
+	pthread_cond_init(&(pool->done),NULL);
+	for(t=1;t<pool->numThreads;t++) {
+		if(pthread_create(&(pool->threads[t]),NULL,poolMain,&(pool->tasks[t])) != 0) {
+			printf("Cannot start thread %d\n",t);
+			exit(-1);
+		}
+	}
+#endif
+}
+
+/*Runs work once per thread of the pool and waits for all of them, without allocating
+*A NULL pool runs it on the calling thread only
+*/
+void runPool(threadPool * pool/*I\O*/,void (*work)(threadTask *)/*I*/,void * data/*I*/) {
+	int t;
+	threadTask task;
+
+	if(pool == NULL || pool->numThreads == 1) {
+		task.thread = 0;
+		task.numThreads = 1;
+		task.work = work;
+		task.data = data;
+		task.pool = pool;
+		work(&task);
+		return;
+	}
+	for(t=0;t<pool->numThreads;t++) {
+		pool->tasks[t].work = work;
+		pool->tasks[t].data = data;
+	}
+#ifndef EM_NO_THREADS
+	pthread_mutex_lock(&(pool->lock));
+	pool->remaining = pool->numThreads-1;
+	pool->generation++;
+	pthread_cond_broadcast(&(pool->start));
+	pthread_mutex_unlock(&(pool->lock));
+
+	work(&(pool->tasks[0]));
+
+	pthread_mutex_lock(&(pool->lock));
+	while(pool->remaining > 0) {
+		pthread_cond_wait(&(pool->done),&(pool->lock));
+	}
+	pthread_mutex_unlock(&(pool->lock));
+#endif
+}
+
+/*Stops the workers of a pool*/
+void destroyPool(threadPool * pool/*I\O*/) {
+#ifndef EM_NO_THREADS
+	int t;
+
+	pthread_mutex_lock(&(pool->lock));
+	pool->stop = 1;
+	pthread_cond_broadcast(&(pool->start));
+	pthread_mutex_unlock(&(pool->lock));
+	for(t=1;t<pool->numThreads;t++) {
+		pthread_join(pool->threads[t],NULL);
+	}
+	pthread_mutex_destroy(&(pool->lock));
+	pthread_cond_destroy(&(pool->start));
+	pthread_cond_destroy(&(pool->done));
+	free(pool->threads);
+#endif
+	free(pool->tasks);
+}
+
+/**********************************END Threads*****************************************/
+
+/**********************************START Graph building*****************************************/
+/* The neighbouring graph can be built from the 3D coordinates of the points instead of being read from a .nei file.
+* Points are binned in a uniform grid of cells, each point then only looks at the cells around its own.
+* With a radius every point closer than it is a neighbour, with knn the k nearest points are (and the graph is made symmetric).
+*/
+
+/*qsort order of ints*/
+int compareInts(const void * a, const void * b) {
+	return *(const int *)a-*(const int *)b;
+}
+
+/*Cell of the grid holding a coordinate along one axis*/
+static int gridCoordinate(neighbourGrid * grid/*I*/,double x/*I*/,int axis/*I*/) {
+	int c = (int)floor((x-grid->origin[axis])/grid->cellSize);
+	if(c < 0) {
+		return 0;
+	}
+	if(c >= grid->dims[axis]) {
+		return grid->dims[axis]-1;
+	}
+	return c;
+}
+
+/*Bins the points in a grid of cells of at least cellSize, enlarged so that there are not many more cells than points*/
+void buildGrid(neighbourGrid * grid/*O*/,double * coords/*I*/,int num/*I*/,double cellSize/*I*/) {
+	int i,a,c;
+	double low[3],high[3];
+	double numCells;
+
+	for(a=0;a<3;a++) {
+		low[a] = num > 0 ? coords[a] : 0;
+		high[a] = low[a];
+	}
+	for(i=0;i<num;i++) {
+		for(a=0;a<3;a++) {
+			if(coords[3*i+a] < low[a]) {
+				low[a] = coords[3*i+a];
+			}
+			if(coords[3*i+a] > high[a]) {
+				high[a] = coords[3*i+a];
+			}
+		}
+	}
+	grid->num = num;
+	grid->coords = coords;
+	grid->cellSize = cellSize > 0 ? cellSize : 1.0;
+	do {
+		numCells = 1;
+		for(a=0;a<3;a++) {
+			grid->origin[a] = low[a];
+			grid->dims[a] = (int)floor((high[a]-low[a])/grid->cellSize)+1;
+			numCells *= grid->dims[a];
+		}
+		if(numCells > 4.0*num+64) {
+			grid->cellSize *= 1.5;
+		}
+	} while(numCells > 4.0*num+64);
+	grid->numCells = (int)numCells;
+
+	/*counting sort of the points by cell, each cell keeps them in increasing order*/
+	grid->cellStart = (int *)emCalloc(grid->numCells+1,sizeof(int));
+	grid->cellPoints = (int *)emMalloc(sizeof(int)*(num+1));
+	grid->pointCell = (int *)emMalloc(sizeof(int)*(num+1));
+	grid->cellCoords = (double *)emMalloc(sizeof(double)*(3*num+1));
+	if (grid->cellStart == NULL || grid->cellPoints == NULL || grid->pointCell == NULL || grid->cellCoords == NULL) {
+		printf("Out of memory grid\n");
+		exit(-1);
+	}
+	for(i=0;i<num;i++) {
+		c = (gridCoordinate(grid,coords[3*i],0)*grid->dims[1]+gridCoordinate(grid,coords[3*i+1],1))*grid->dims[2]+gridCoordinate(grid,coords[3*i+2],2);
+		grid->pointCell[i] = c;
+		grid->cellStart[c+1]++;
+	}
+	for(c=0;c<grid->numCells;c++) {
+		grid->cellStart[c+1] += grid->cellStart[c];
+	}
+	for(i=0;i<num;i++) {
+		grid->cellPoints[grid->cellStart[grid->pointCell[i]]++] = i;
+	}
+	for(c=grid->numCells;c>0;c--) {
+		grid->cellStart[c] = grid->cellStart[c-1];
+	}
+	grid->cellStart[0] = 0;
+	/*coordinates in cell order, so that the points of neighbouring cells are read contiguously*/
+	for(c=0;c<num;c++) {
+		for(a=0;a<3;a++) {
+			grid->cellCoords[3*c+a] = coords[3*grid->cellPoints[c]+a];
+		}
+	}
+}
+
+void freeGrid(neighbourGrid * grid/*I\O*/) {
+	free(grid->cellStart);
+	free(grid->cellPoints);
+	free(grid->pointCell);
+	free(grid->cellCoords);
+}
+
+/*Squared distance between a point and the p-th point of the grid in cell order*/
+static double squaredDistance(double * point/*I*/,double * cellCoords/*I*/,int p/*I*/) {
+	double dx = point[0]-cellCoords[3*p];
+	double dy = point[1]-cellCoords[3*p+1];
+	double dz = point[2]-cellCoords[3*p+2];
+	return dx*dx+dy*dy+dz*dz;
+}
+
+/*Neighbours of point i within the radius in increasing order, only counted when nei is NULL
+*returns the number of neighbours
+*/
+int radiusNeighbours(neighbourGrid * grid/*I*/,int i/*I*/,double radius/*I*/,int * nei/*O*/) {
+	int a,c,p,x,y,count=0;
+	int low[3],high[3];
+	double r2 = radius*radius;
+	double * point = grid->coords+3*i;
+
+	for(a=0;a<3;a++) {
+		low[a] = gridCoordinate(grid,point[a]-radius,a);
+		high[a] = gridCoordinate(grid,point[a]+radius,a);
+	}
+	for(x=low[0];x<=high[0];x++) {
+		for(y=low[1];y<=high[1];y++) {
+			/*the cells along z are contiguous*/
+			c = (x*grid->dims[1]+y)*grid->dims[2];
+			for(p=grid->cellStart[c+low[2]];p<grid->cellStart[c+high[2]+1];p++) {
+				if(squaredDistance(point,grid->cellCoords,p) <= r2 && grid->cellPoints[p] != i) {
+					if(nei != NULL) {
+						nei[count] = grid->cellPoints[p];
+					}
+					count++;
+				}
+			}
+		}
+	}
+	if(nei != NULL) {
+		qsort(nei,count,sizeof(int),compareInts);
+	}
+	return count;
+}
+
+/*The k nearest neighbours of point i (ties broken by index) in increasing order, dist is k scratch values
+*Shells of cells are searched outwards until the next shell cannot hold a closer point
+*returns the number of neighbours (less than k only if there are not enough points)
+*/
+int nearestNeighbours(neighbourGrid * grid/*I*/,int i/*I*/,int k/*I*/,int * nei/*O*/,double * dist/*O*/) {
+	int a,c,p,e,x,y,z,j,shell,count=0;
+	int centre[3],low[3],high[3];
+	double d;
+	double * point = grid->coords+3*i;
+
+	for(a=0;a<3;a++) {
+		centre[a] = gridCoordinate(grid,point[a],a);
+	}
+	for(shell=0;;shell++) {
+		for(a=0;a<3;a++) {
+			low[a] = centre[a]-shell;
+			high[a] = centre[a]+shell;
+		}
+		for(x=low[0];x<=high[0];x++) {
+			for(y=low[1];y<=high[1];y++) {
+				for(z=low[2];z<=high[2];z++) {
+					/*only the cells on the surface of the shell, inside the grid*/
+					if(x < 0 || y < 0 || z < 0 || x >= grid->dims[0] || y >= grid->dims[1] || z >= grid->dims[2]) {
+						continue;
+					}
+					if(x != low[0] && x != high[0] && y != low[1] && y != high[1] && z != low[2] && z != high[2]) {
+						continue;
+					}
+					c = (x*grid->dims[1]+y)*grid->dims[2]+z;
+					for(p=grid->cellStart[c];p<grid->cellStart[c+1];p++) {
+						j = grid->cellPoints[p];
+						if(j == i) {
+							continue;
+						}
+						d = squaredDistance(point,grid->cellCoords,p);
+						if(count == k && (d > dist[k-1] || (d == dist[k-1] && j > nei[k-1]))) {
+							continue;
+						}
+						/*insertion in the sorted list*/
+						e = count < k ? count++ : k-1;
+						while(e > 0 && (dist[e-1] > d || (dist[e-1] == d && nei[e-1] > j))) {
+							dist[e] = dist[e-1];
+							nei[e] = nei[e-1];
+							e--;
+						}
+						dist[e] = d;
+						nei[e] = j;
+					}
+				}
+			}
+		}
+		/*points outside the shell are at least shell cells away*/
+		if(count == k && dist[k-1] <= (shell*grid->cellSize)*(shell*grid->cellSize)) {
+			break;
+		}
+		if(low[0] <= 0 && low[1] <= 0 && low[2] <= 0 && high[0] >= grid->dims[0]-1 && high[1] >= grid->dims[1]-1 && high[2] >= grid->dims[2]-1) {
+			break;
+		}
+	}
+	qsort(nei,count,sizeof(int),compareInts);
+	return count;
+}
+
+/*Shared state of the graph building threads*/
+typedef struct {
+	neighbourGrid * grid;
+	double radius;
+	int knn;
+	int * start; /*counts first, then offsets*/
+	int * adj; /*NULL while counting*/
+} graphJob;
+
+static void graphWork(threadTask * task) {
+	graphJob * job = (graphJob *)task->data;
+	int i,q,first,last;
+	double * dist = NULL;
+
+	threadRange(task,job->grid->num,&first,&last);
+	if(job->knn > 0) {
+		dist = (double *)emMalloc(sizeof(double)*job->knn);
+		if (dist == NULL) {
+			printf("Out of memory graph\n");
+			exit(-1);
+		}
+	}
+	/*points taken in cell order, so that consecutive searches look at the same cells*/
+	for(q=first;q<last;q++) {
+		i = job->grid->cellPoints[q];
+		if(job->knn > 0) {
+			/*k neighbours per point, stored directly*/
+			nearestNeighbours(job->grid,i,job->knn,job->adj+(long)i*job->knn,dist);
+		}
+		else if(job->adj == NULL) {
+			job->start[i+1] = radiusNeighbours(job->grid,i,job->radius,NULL);
+		}
+		else {
+			radiusNeighbours(job->grid,i,job->radius,job->adj+job->start[i]);
+		}
+	}
+	free(dist);
+}
+
+/*Makes a k nearest neighbours graph symmetric: j is a neighbour of i if either one is among the nearest of the other*/
+static void symmetriseGraph(int num/*I*/,int knn/*I*/,int * found/*I*/,int * numFound/*I*/,int ** start/*O*/,int ** adj/*O*/) {
+	int i,j,e,n,last;
+	int * fill;
+
+	*start = (int *)emCalloc(num+1,sizeof(int));
+	fill = (int *)emCalloc(num+1,sizeof(int));
+	if (*start == NULL || fill == NULL) {
+		printf("Out of memory graph\n");
+		exit(-1);
+	}
+	for(i=0;i<num;i++) {
+		for(e=0;e<numFound[i];e++) {
+			(*start)[i+1]++;
+			(*start)[found[(long)i*knn+e]+1]++;
+		}
+	}
+	for(i=0;i<num;i++) {
+		(*start)[i+1] += (*start)[i];
+	}
+	*adj = (int *)emMalloc(sizeof(int)*((*start)[num]+1));
+	if (*adj == NULL) {
+		printf("Out of memory graph\n");
+		exit(-1);
+	}
+	for(i=0;i<num;i++) {
+		for(e=0;e<numFound[i];e++) {
+			j = found[(long)i*knn+e];
+			(*adj)[(*start)[i]+fill[i]++] = j;
+			(*adj)[(*start)[j]+fill[j]++] = i;
+		}
+	}
+	/*sorting each list and dropping the pairs found both ways*/
+	n = 0;
+	for(i=0;i<num;i++) {
+		qsort(*adj+(*start)[i],fill[i],sizeof(int),compareInts);
+		last = -1;
+		e = (*start)[i];
+		(*start)[i] = n;
+		for(;e<(*start)[i+1];e++) {
+			if((*adj)[e] != last) {
+				last = (*adj)[e];
+				(*adj)[n++] = last;
+			}
+		}
+	}
+	(*start)[num] = n;
+	free(fill);
+}
+
+/*Builds the CSR neighbouring graph of the points, from the radius if knn is 0, otherwise from the knn nearest points
+*returns the number of points
+*/
+int buildNeighbourGraph(double * coords/*I*/,int num/*I*/,double radius/*I*/,int knn/*I*/,int numThreads/*I*/,int ** start/*O*/,int ** adj/*O*/) {
+	int i;
+	int * numFound;
+	neighbourGrid grid;
+	graphJob job;
+	double volume = 1;
+
+	job.grid = &grid;
+	job.radius = radius;
+	job.knn = knn;
+	if(knn > 0) {
+		/*cells holding about knn points*/
+		buildGrid(&grid,coords,num,1.0);
+		for(i=0;i<3;i++) {
+			volume *= grid.dims[i]*grid.cellSize;
+		}
+		freeGrid(&grid);
+		buildGrid(&grid,coords,num,pow(volume*knn/(num > 0 ? num : 1),1.0/3.0));
+
+		job.start = NULL;
+		job.adj = (int *)emMalloc(sizeof(int)*((long)num*knn+1));
+		if (job.adj == NULL) {
+			printf("Out of memory graph\n");
+			exit(-1);
+		}
+		runThreads(numThreads,graphWork,&job);
+		numFound = (int *)emMalloc(sizeof(int)*(num+1));
+		for(i=0;i<num;i++) {
+			numFound[i] = knn < num-1 ? knn : num-1;
+		}
+		symmetriseGraph(num,knn,job.adj,numFound,start,adj);
+		free(numFound);
+		free(job.adj);
+		freeGrid(&grid);
+		return num;
+	}
+
+	buildGrid(&grid,coords,num,radius);
+	/*counting, then filling at the offsets*/
+	job.start = (int *)emCalloc(num+1,sizeof(int));
+	job.adj = NULL;
+	if (job.start == NULL) {
+		printf("Out of memory graph\n");
+		exit(-1);
+	}
+	runThreads(numThreads,graphWork,&job);
+	for(i=0;i<num;i++) {
+		job.start[i+1] += job.start[i];
+	}
+	job.adj = (int *)emMalloc(sizeof(int)*(job.start[num]+1));
+	if (job.adj == NULL) {
+		printf("Out of memory graph\n");
+		exit(-1);
+	}
+	runThreads(numThreads,graphWork,&job);
+	freeGrid(&grid);
+	*start = job.start;
+	*adj = job.adj;
+	return num;
+}
+
+/*Writes a CSR graph in the neighbouring file format*/
+void outputGraph(FILE * out/*I*/,int num/*I*/,int * start/*I*/,int * adj/*I*/) {
+	int i,j;
+
+	for(i=0;i<num;i++) {
+		fprintf(out,"%d",start[i+1]-start[i]);
+		for(j=start[i];j<start[i+1];j++) {
+			fprintf(out,"\t%d",adj[j]+1);
+		}
+		fprintf(out,"\n");
+	}
+}
+
+/*Number of lines of a file, which is rewound*/
+int count_lines(FILE * data/*I*/) {
+	int c,num=0,last='\n';
+
+	while((c = fgetc(data)) != EOF) {
+		if(c == '\n') {
+			num++;
+		}
+		last = c;
+	}
+	if(last != '\n') {
+		num++;
+	}
+	rewind(data);
+	return num;
+}
+
+/*Loads the neighbouring graph in CSR form, read from a neighbouring file or built from a coordinates file when radius or knn is positive
+*returns the number of points
+*/
+int load_graph_input(char * path/*I*/,double radius/*I*/,int knn/*I*/,int numThreads/*I*/,int ** start/*O*/,int ** adj/*O*/) {
+	FILE * data;
+	double * coords;
+	int num;
+
+	data = fopen(path,"r");
+	if(data == NULL) {
+		printf("Cannot open %s\n",path);
+		exit(-1);
+	}
+	if(radius <= 0 && knn <= 0) {
+		num = load_graph(data,start,adj);
+		fclose(data);
+		return num;
+	}
+	num = count_lines(data);
+	coords = (double *)emMalloc(sizeof(double)*(3*num+1));
+	if (coords == NULL) {
+		printf("Out of memory coordinates\n");
+		exit(-1);
+	}
+	load_coordinates(data,num,coords);
+	fclose(data);
+	buildNeighbourGraph(coords,num,radius,knn,numThreads,start,adj);
+	free(coords);
+	printf("Neighbouring graph built on %d points, %d edges\n",num,(*start)[num]);
+	return num;
+}
+
+/*Stores the neighbours of a CSR graph in the points of a serial dataset, pointing in adj instead of copying them if share is set*/
+void setNeighbours(dataSet * myData/*I\O*/,int num/*I*/,int * start/*I*/,int * adj/*I*/,int share/*I*/) {
+	int i;
+
+	if(num != myData->num) {
+		printf("The data file has %d lines, the neighbouring graph %d points\n",myData->num,num);
+		exit(-1);
+	}
+	myData->maxNei = 0;
+	for(i=0;i<num;i++) {
+		myData->obs[i].numNei = start[i+1]-start[i];
+		if(share) {
+			myData->obs[i].nei = adj+start[i];
+		}
+		else {
+			myData->obs[i].nei = (int *)emMalloc(sizeof(int)*(myData->obs[i].numNei+1));
+			if (myData->obs[i].nei == NULL) {
+				printf("Out of memory neighbours\n");
+				exit(-1);
+			}
+			memcpy(myData->obs[i].nei,adj+start[i],sizeof(int)*myData->obs[i].numNei);
+		}
+		if(myData->obs[i].numNei > myData->maxNei) {
+			myData->maxNei = myData->obs[i].numNei;
+		}
+	}
+}
+
+/**********************************END Graph building*****************************************/
+
+
+/**********************************END Defining nethods*****************************************/
+/*******************************************************************************************/
+/**********************************Result analysis functions*****************************************/
+
+/*Outputs he clustering results*/
+void outputCSV(char * out, classif * myClassif) {
+	int i;
+	int * labels;
+	FILE * file;	
+
+	labels = gatherLabels(myClassif);
+	if(labels == NULL) {
+		return;
+	}
+	file = fopen(out,"w");
+	for(i = 0;i<myClassif->set.numGlobal;i++) {
+		fprintf(file,"%d\n",labels[i]);
+	}
+	fclose(file);
+	free(labels);
+}
+
+/*Outputs the final values for the theta parameters*/
+void outputThetas(char * out,classif * myClassif) {
+	int i,k;
+	FILE * file;	
+
+	if(!isMainProcess()) {
+		return;
+	}
+	file = fopen(out,"w");
+	for(k = 0;k<myClassif->numClust;k++) {
+		for(i = 1;i<myClassif->set.length;i++) {
+			fprintf(file,"%f\t",myClassif->parameters.theta[k][i]);
+		}
+		fprintf(file,"\n");
+	}
+	fclose(file);
+}
+
+
+/*Outputs EM summary for further analysis*/
+void outputEMSummary(char * out,classif * myClassif,int numIter) {
+	double likely;
+	FILE * file;	
+
+	likely = computeFullExpectation(myClassif);
+	if(!isMainProcess()) {
+		return;
+	}
+	file = fopen(out,"w");
+	fprintf(file,"numClust\t%d\n",myClassif->numClust);
+	fprintf(file,"likelihood\t%e\n",likely);
+	fprintf(file,"Iterations\t%d\n",numIter);
+	fprintf(file,"initialisation\t%s\n",myClassif->initName);
+	fprintf(file,"initTime\t%.3f\n",myClassif->initTime);
+	fclose(file);
+} 
+
+
+/*Outputs EM summary for each cluster*/
+void outputClustSummary(char * out,classif * myClassif) {
+	FILE * file;
+	int k;	
+	int * numCells;
+
+	/*Counting before opening the file as every process takes part in it*/
+	numCells = (int *)emMalloc(sizeof(int)*myClassif->numClust);
+	for(k=1;k<=myClassif->numClust;k++) {
+		numCells[k-1] = numCellsClust(k,myClassif);
+	}
+	if(!isMainProcess()) {
+		free(numCells);
+		return;
+	}
+
+	file = fopen(out,"w");
+	
+	/*Outputing header*/
+	fprintf(file,"\t");
+	for(k=0;k<myClassif->numClust;k++) {
+		fprintf(file,"cluster_%d\t",(k+1));
+	}
+	fprintf(file,"\n");
+	
+	/*Outputing betas*/
+	fprintf(file,"beta");
+	for(k=0;k<myClassif->numClust;k++) {
+		fprintf(file,"\t%f",myClassif->beta[k]);
+	}
+	fprintf(file,"\n");
+	
+	/*Outputing num per clust*/
+	fprintf(file,"numCells");
+	for(k=1;k<=myClassif->numClust;k++) {
+		fprintf(file,"\t%d",numCells[k-1]);
+	}
+	fprintf(file,"\n");
+	
+	
+	fclose(file);
+	free(numCells);
+}
+
+/* Binary outputs: labels, posteriors, thetas and betas as .npy arrays (little or big endian as the machine, C order),
+* which numpy.load(..., mmap_mode='r') maps without parsing. Snapshots taken during the EM loop are written by a
+* background thread from two buffers, a snapshot arriving while the previous one still waits is dropped rather than waited for.
+*/
+
+/*numpy type of an array of items of the given kind ('i' or 'f') and size, in the byte order of the machine*/
+static void npyDescr(char kind/*I*/,size_t size/*I*/,char * descr/*O*/) {
+	unsigned int one = 1;
+	sprintf(descr,"%c%c%d",*(unsigned char *)&one == 1 ? '<' : '>',kind,(int)size);
+}
+
+/*Writes a rows x cols array (a vector if cols is 0) of items of the given size in the .npy format*/
+void writeNpy(char * out/*I*/,char kind/*I*/,size_t size/*I*/,int rows/*I*/,int cols/*I*/,void * data/*I*/) {
+	FILE * file;
+	char descr[8];
+	char header[128];
+	int length;
+
+	npyDescr(kind,size,descr);
+	if(cols > 0) {
+		length = sprintf(header,"{'descr': '%s', 'fortran_order': False, 'shape': (%d, %d), }",descr,rows,cols);
+	}
+	else {
+		length = sprintf(header,"{'descr': '%s', 'fortran_order': False, 'shape': (%d,), }",descr,rows);
+	}
+	/*magic, version and header length take 10 bytes, the data starts on a multiple of 64*/
+	while((10+length+1)%64 != 0) {
+		header[length++] = ' ';
+	}
+	header[length++] = '\n';
+
+	file = fopen(out,"wb");
+	if(file == NULL) {
+		printf("Cannot write %s\n",out);
+		return;
+	}
+	fwrite("\x93NUMPY\x01\x00",1,8,file);
+	fputc(length & 0xff,file);
+	fputc((length >> 8) & 0xff,file);
+	fwrite(header,1,length,file);
+	fwrite(data,size,(size_t)rows*(cols > 0 ? cols : 1),file);
+	fclose(file);
+}
+
+/*Reads the header of a .npy file written in the byte order of the machine, leaving the file at the start of the data
+*cols is 0 for a vector
+returns 1 if the header could be read, 0 otherwise*/
+int readNpyHeader(FILE * file/*I*/,char * kind/*O*/,size_t * size/*O*/,int * rows/*O*/,int * cols/*O*/) {
+	unsigned char magic[12];
+	char descr[8];
+	char * header;
+	char * field;
+	char * end;
+	size_t length;
+	int read = 0;
+
+	if(fread(magic,1,10,file) != 10 || memcmp(magic,"\x93NUMPY",6) != 0) {
+		return 0;
+	}
+	length = magic[8] | (magic[9] << 8);
+	/*version 2 headers have a 4 bytes length*/
+	if(magic[6] >= 2) {
+		if(fread(magic+10,1,2,file) != 2) {
+			return 0;
+		}
+		length |= ((size_t)magic[10] << 16) | ((size_t)magic[11] << 24);
+	}
+	header = (char *)emMalloc(length+1);
+	if (header == NULL) {
+		printf("Out of memory npy\n");
+		exit(-1);
+	}
+	if(fread(header,1,length,file) == length) {
+		header[length] = '\0';
+		field = strstr(header,"'descr': '");
+		if(field != NULL && strstr(header,"'fortran_order': False") != NULL) {
+			field += strlen("'descr': '");
+			*kind = field[1];
+			*size = (size_t)strtoul(field+2,NULL,10);
+			npyDescr(*kind,*size,descr);
+			/*single bytes have no order*/
+			read = (field[0] == descr[0] || field[0] == '|');
+		}
+		field = strstr(header,"'shape': (");
+		if(read && field != NULL) {
+			field += strlen("'shape': (");
+			*rows = (int)strtol(field,&end,10);
+			*cols = 0;
+			read = end != field;
+			if(*end == ',') {
+				field = end+1;
+				*cols = (int)strtol(field,&end,10);
+			}
+		}
+		else {
+			read = 0;
+		}
+	}
+	free(header);
+	return read;
+}
+
+/*Writes the 4 arrays of a snapshot, named prefix.name.npy for the final one and prefix.iterN.name.npy otherwise*/
+void writeSnapshot(snapshotWriter * writer/*I\O*/,modelSnapshot * snapshot/*I*/) {
+	char * names[4] = {"labels","posteriors","theta","beta"};
+	int a;
+
+	for(a=0;a<4;a++) {
+		if(snapshot->iteration < 0) {
+			sprintf(writer->path,"%s.%s.npy",writer->prefix,names[a]);
+		}
+		else {
+			sprintf(writer->path,"%s.iter%d.%s.npy",writer->prefix,snapshot->iteration,names[a]);
+		}
+		switch(a) {
+			case 0:
+				writeNpy(writer->path,'i',sizeof(int),writer->numPoints,0,snapshot->labels);
+				break;
+			case 1:
+				writeNpy(writer->path,'f',sizeof(emReal),writer->numPoints,writer->numClust,snapshot->posteriors);
+				break;
+			case 2:
+				writeNpy(writer->path,'f',sizeof(double),writer->numClust,writer->numGenes,snapshot->theta);
+				break;
+			default:
+				writeNpy(writer->path,'f',sizeof(double),writer->numClust,0,snapshot->beta);
+		}
+	}
+}
+
+#ifndef EM_NO_THREADS
+/*Background writer, writes the pending snapshot until asked to stop*/
+static void * snapshotThread(void * arg) {
+	snapshotWriter * writer = (snapshotWriter *)arg;
+
+	pthread_mutex_lock(&(writer->lock));
+	while(1) {
+		while(writer->pending < 0 && !writer->stop) {
+			pthread_cond_wait(&(writer->ready),&(writer->lock));
+		}
+		if(writer->pending < 0) {
+			break;
+		}
+		writer->writing = writer->pending;
+		writer->pending = -1;
+		pthread_mutex_unlock(&(writer->lock));
+		writeSnapshot(writer,&(writer->slots[writer->writing]));
+		pthread_mutex_lock(&(writer->lock));
+		writer->writing = -1;
+		pthread_cond_broadcast(&(writer->freed));
+	}
+	pthread_mutex_unlock(&(writer->lock));
+	return NULL;
+}
+#endif
+
+/*Prepares the buffers of the binary outputs written as prefix.*.npy, with a background thread if asked (and built with threads)*/
+void createSnapshotWriter(snapshotWriter * writer/*O*/,classif * myClassif/*I*/,char * prefix/*I*/,int background/*I*/) {
+	int s;
+#ifdef USE_MPI
+	int p,numOwned = myClassif->set.numOwned;
+	int width = myClassif->numClust+1;
+	haloPlan * halo = myClassif->set.halo;
+#endif
+
+	writer->numPoints = myClassif->set.numGlobal;
+	writer->numClust = myClassif->numClust;
+	writer->numGenes = myClassif->set.length-1;
+	writer->prefix = prefix;
+	writer->writing = -1;
+	writer->pending = -1;
+	writer->stop = 0;
+	writer->dropped = 0;
+	writer->log = myClassif->log;
+	writer->background = 0;
+	writer->numSlots = 0;
+	writer->gatherCounts = NULL;
+	writer->gatherDispls = NULL;
+	writer->gatherIds = NULL;
+	writer->gatherBuf = NULL;
+	writer->gatheredBuf = NULL;
+#ifndef EM_NO_THREADS
+	writer->background = background;
+#endif
+
+#ifdef USE_MPI
+	/*owned points are gathered as rows of label and posteriors, their dataset lines once for all*/
+	if(halo != NULL) {
+		writer->gatherBuf = (double *)emMalloc(sizeof(double)*((long)numOwned*width+1));
+		if(isMainProcess()) {
+			writer->gatherCounts = (int *)emMalloc(sizeof(int)*halo->numProcs);
+			writer->gatherDispls = (int *)emMalloc(sizeof(int)*halo->numProcs);
+			writer->gatherIds = (int *)emMalloc(sizeof(int)*writer->numPoints);
+			writer->gatheredBuf = (double *)emMalloc(sizeof(double)*((long)writer->numPoints*width));
+			if (writer->gatherCounts == NULL || writer->gatherDispls == NULL || writer->gatherIds == NULL || writer->gatheredBuf == NULL) {
+				printf("Out of memory snapshots\n");
+				exit(-1);
+			}
+		}
+		MPI_Gather(&numOwned,1,MPI_INT,writer->gatherCounts,1,MPI_INT,0,MPI_COMM_WORLD);
+		if(isMainProcess()) {
+			writer->gatherDispls[0] = 0;
+			for(p=1;p<halo->numProcs;p++) {
+				writer->gatherDispls[p] = writer->gatherDispls[p-1]+writer->gatherCounts[p-1];
+			}
+		}
+		MPI_Gatherv(myClassif->set.globalId,numOwned,MPI_INT,writer->gatherIds,writer->gatherCounts,writer->gatherDispls,MPI_INT,0,MPI_COMM_WORLD);
+		if(isMainProcess()) {
+			for(p=0;p<halo->numProcs;p++) {
+				writer->gatherCounts[p] *= width;
+				writer->gatherDispls[p] *= width;
+			}
+		}
+	}
+#endif
+	if(!isMainProcess()) {
+		return;
+	}
+
+	/*one snapshot being written and one waiting*/
+	writer->numSlots = writer->background ? 2 : 1;
+	writer->path = (char *)emMalloc(strlen(prefix)+64);
+	for(s=0;s<writer->numSlots;s++) {
+		writer->slots[s].labels = (int *)emMalloc(sizeof(int)*writer->numPoints);
+		writer->slots[s].posteriors = (emReal *)emMalloc(sizeof(emReal)*((long)writer->numPoints*writer->numClust));
+		writer->slots[s].theta = (double *)emMalloc(sizeof(double)*(writer->numClust*writer->numGenes+1));
+		writer->slots[s].beta = (double *)emMalloc(sizeof(double)*writer->numClust);
+		if (writer->path == NULL || writer->slots[s].labels == NULL || writer->slots[s].posteriors == NULL || writer->slots[s].theta == NULL || writer->slots[s].beta == NULL) {
+			printf("Out of memory snapshots\n");
+			exit(-1);
+		}
+	}
+#ifndef EM_NO_THREADS
+	if(writer->background) {
+		pthread_mutex_init(&(writer->lock),NULL);
+		pthread_cond_init(&(writer->ready),NULL);
+		pthread_cond_init(&(writer->freed),NULL);
+		if(pthread_create(&(writer->thread),NULL,snapshotThread,writer) != 0) {
+			printf("Cannot start the snapshot writer\n");
+			exit(-1);
+		}
+	}
+#endif
+}
+
+/*Gathers the labels and posteriors of all the points on the main process in a distributed run, every process taking part*/
+static void gatherSnapshot(snapshotWriter * writer/*I\O*/,classif * myClassif/*I*/) {
+#ifdef USE_MPI
+	int i,k;
+	int width = myClassif->numClust+1;
+
+	if(myClassif->set.halo == NULL) {
+		return;
+	}
+	for(i=0;i<myClassif->set.numOwned;i++) {
+		writer->gatherBuf[(long)i*width] = myClassif->clust[i];
+		for(k=0;k<myClassif->numClust;k++) {
+			writer->gatherBuf[(long)i*width+k+1] = posterior(myClassif,k,i);
+		}
+	}
+	MPI_Gatherv(writer->gatherBuf,myClassif->set.numOwned*width,MPI_DOUBLE,writer->gatheredBuf,writer->gatherCounts,writer->gatherDispls,MPI_DOUBLE,0,MPI_COMM_WORLD);
+#endif
+}
+
+/*Copies the current labels, posteriors and parameters of the model in a snapshot, in the dataset order*/
+static void fillSnapshot(snapshotWriter * writer/*I*/,classif * myClassif/*I*/,modelSnapshot * snapshot/*O*/,int iteration/*I*/) {
+	int i,k;
+	int numClust = writer->numClust;
+	int width = numClust+1;
+	emReal * row;
+
+	snapshot->iteration = iteration;
+	if(writer->gatheredBuf != NULL) {
+		for(i=0;i<writer->numPoints;i++) {
+			snapshot->labels[writer->gatherIds[i]] = (int)writer->gatheredBuf[(long)i*width];
+			row = snapshot->posteriors+(long)writer->gatherIds[i]*numClust;
+			for(k=0;k<numClust;k++) {
+				row[k] = (emReal)writer->gatheredBuf[(long)i*width+k+1];
+			}
+		}
+	}
+	else {
+		memcpy(snapshot->labels,myClassif->clust,sizeof(int)*writer->numPoints);
+		for(i=0;i<writer->numPoints;i++) {
+			row = snapshot->posteriors+(long)i*numClust;
+			for(k=0;k<numClust;k++) {
+				row[k] = (emReal)posterior(myClassif,k,i);
+			}
+		}
+	}
+	for(k=0;k<numClust;k++) {
+		memcpy(snapshot->theta+k*writer->numGenes,myClassif->parameters.theta[k]+1,sizeof(double)*writer->numGenes);
+		snapshot->beta[k] = myClassif->beta[k];
+	}
+}
+
+/*Takes a snapshot of the model (iteration -1 for the final outputs) and hands it to the writer
+*In the background it is dropped while the previous one still waits for the writer, unless wait is set
+*/
+void queueSnapshot(snapshotWriter * writer/*I\O*/,classif * myClassif/*I*/,int iteration/*I*/,int wait/*I*/) {
+	int s = 0;
+
+	gatherSnapshot(writer,myClassif);
+	if(!isMainProcess()) {
+		return;
+	}
+	if(!writer->background) {
+		fillSnapshot(writer,myClassif,&(writer->slots[s]),iteration);
+		writeSnapshot(writer,&(writer->slots[s]));
+		return;
+	}
+#ifndef EM_NO_THREADS
+	/*a snapshot already waiting is never replaced, the new one waits or is dropped until the writer has taken it*/
+	pthread_mutex_lock(&(writer->lock));
+	while(wait && writer->pending >= 0) {
+		pthread_cond_wait(&(writer->freed),&(writer->lock));
+	}
+	if(writer->pending >= 0) {
+		writer->dropped++;
+		pthread_mutex_unlock(&(writer->lock));
+		fprintf(writer->log,"\tSnapshot of iteration %d dropped, the writer is busy\n",iteration);
+		return;
+	}
+	/*the slot not being written*/
+	while(s == writer->writing) {
+		s++;
+	}
+	pthread_mutex_unlock(&(writer->lock));
+
+	fillSnapshot(writer,myClassif,&(writer->slots[s]),iteration);
+
+	pthread_mutex_lock(&(writer->lock));
+	writer->pending = s;
+	pthread_cond_signal(&(writer->ready));
+	pthread_mutex_unlock(&(writer->lock));
+#endif
+}
+
+/*Waits for the queued snapshots to be written and releases the writer*/
+void closeSnapshotWriter(snapshotWriter * writer/*I\O*/) {
+	int s;
+
+#ifndef EM_NO_THREADS
+	if(writer->background && isMainProcess()) {
+		pthread_mutex_lock(&(writer->lock));
+		writer->stop = 1;
+		pthread_cond_signal(&(writer->ready));
+		pthread_mutex_unlock(&(writer->lock));
+		pthread_join(writer->thread,NULL);
+		pthread_mutex_destroy(&(writer->lock));
+		pthread_cond_destroy(&(writer->ready));
+		pthread_cond_destroy(&(writer->freed));
+		if(writer->dropped > 0) {
+			fprintf(writer->log,"%d snapshots dropped\n",writer->dropped);
+		}
+	}
+#endif
+	for(s=0;s<writer->numSlots;s++) {
+		free(writer->slots[s].labels);
+		free(writer->slots[s].posteriors);
+		free(writer->slots[s].theta);
+		free(writer->slots[s].beta);
+	}
+	if(writer->numSlots > 0) {
+		free(writer->path);
+	}
+	free(writer->gatherCounts);
+	free(writer->gatherDispls);
+	free(writer->gatherIds);
+	free(writer->gatherBuf);
+	free(writer->gatheredBuf);
+	writer->numSlots = 0;
+}
+
+
+
+
+/*Reads a clustering results file (one label per line)
+returns the number of points, the labels are newly allocated*/
+int load_labels(FILE * data/*I*/,int ** labels/*O*/) {
+	char line[LG_NEI_MAX];
+	int num=0,capacity=1024;
+
+	*labels = (int *)emMalloc(sizeof(int)*capacity);
+	while(fgets(line,LG_NEI_MAX,data) != NULL) {
+		if(num == capacity) {
+			capacity *= 2;
+			*labels = (int *)emRealloc(*labels,sizeof(int)*capacity);
+			if (*labels == NULL) {
+				printf("Out of memory labels\n");
+				exit(-1);
+			}
+		}
+		(*labels)[num++] = atoi(line);
+	}
+	return num;
+}
+
+/*Returns the adjusted Rand index between two labellings (labels from 1)*/
+double adjustedRandIndex(int * labelsA/*I*/,int * labelsB/*I*/,int num/*I*/) {
+	int i,a,b,numA=0,numB=0;
+	double * table;
+	double sumTable=0,sumA=0,sumB=0,rowSum,colSum,expected,maxIndex;
+
+	for(i=0;i<num;i++) {
+		if(labelsA[i] > numA) numA = labelsA[i];
+		if(labelsB[i] > numB) numB = labelsB[i];
+	}
+	/*contingency table*/
+	table = (double *)emCalloc((numA+1)*(numB+1),sizeof(double));
+	for(i=0;i<num;i++) {
+		table[labelsA[i]*(numB+1)+labelsB[i]]++;
+	}
+	for(a=0;a<=numA;a++) {
+		rowSum = 0;
+		for(b=0;b<=numB;b++) {
+			sumTable += table[a*(numB+1)+b]*(table[a*(numB+1)+b]-1)/2;
+			rowSum += table[a*(numB+1)+b];
+		}
+		sumA += rowSum*(rowSum-1)/2;
+	}
+	for(b=0;b<=numB;b++) {
+		colSum = 0;
+		for(a=0;a<=numA;a++) {
+			colSum += table[a*(numB+1)+b];
+		}
+		sumB += colSum*(colSum-1)/2;
+	}
+	free(table);
+
+	expected = sumA*sumB/((double)num*(num-1)/2);
+	maxIndex = (sumA+sumB)/2;
+	if(maxIndex == expected) {
+		return 1.0;
+	}
+	return (sumTable-expected)/(maxIndex-expected);
+}
+
+/*Returns the likelihood written in a summary file*/
+double load_summaryLikelihood(FILE * data/*I*/) {
+	char line[LG_NEI_MAX];
+	double likely=0;
+
+	while(fgets(line,LG_NEI_MAX,data) != NULL) {
+		if(strncmp(line,"likelihood\t",11) == 0) {
+			likely = atof(line+11);
+		}
+	}
+	return likely;
+}
+
+/*Returns the largest absolute difference between the values of two theta files*/
+double maxThetaDifference(FILE * thetaA/*I*/,FILE * thetaB/*I*/) {
+	double a,b,maxDiff=0;
+
+	while(fscanf(thetaA,"%lf",&a) == 1 && fscanf(thetaB,"%lf",&b) == 1) {
+		if(fabs(a-b) > maxDiff) {
+			maxDiff = fabs(a-b);
+		}
+	}
+	return maxDiff;
+}
+
+/*Opens the output file of a run with the given extension, NULL if it is missing and not required*/
+FILE * openRunFile(char * prefix/*I*/,char * extension/*I*/,int required/*I*/) {
+	char * name;
+	FILE * file;
+
+	name = emMalloc(strlen(prefix)+strlen(extension)+1);
+	sprintf(name,"%s%s",prefix,extension);
+	file = fopen(name,"r");
+	if(file == NULL && required) {
+		printf("Cannot open %s\n",name);
+		exit(-1);
+	}
+	free(name);
+	return file;
+}
+
+/*Compares the outputs of two runs (given as result folder/outputFileName)*/
+void compareRunFiles(char * prefixA/*I*/,char * prefixB/*I*/,runComparison * comparison/*O*/) {
+	FILE * file;
+	FILE * fileB;
+	int * labelsA;
+	int * labelsB;
+	int i,num,numB,same=0;
+
+	file = openRunFile(prefixA,".csv",1);
+	num = load_labels(file,&labelsA);
+	fclose(file);
+	file = openRunFile(prefixB,".csv",1);
+	numB = load_labels(file,&labelsB);
+	fclose(file);
+	if(num != numB) {
+		printf("The runs have %d and %d points\n",num,numB);
+		exit(-1);
+	}
+	for(i=0;i<num;i++) {
+		same += (labelsA[i] == labelsB[i]);
+	}
+	comparison->numPoints = num;
+	comparison->sameLabels = (double)same/num;
+	comparison->adjustedRandIndex = adjustedRandIndex(labelsA,labelsB,num);
+
+	file = openRunFile(prefixA,".summary",1);
+	comparison->likelihoodReference = load_summaryLikelihood(file);
+	fclose(file);
+	file = openRunFile(prefixB,".summary",1);
+	comparison->likelihoodCompared = load_summaryLikelihood(file);
+	fclose(file);
+	comparison->likelihoodDifference = fabs(comparison->likelihoodReference-comparison->likelihoodCompared)/fabs(comparison->likelihoodReference);
+
+	file = openRunFile(prefixA,".theta",1);
+	fileB = openRunFile(prefixB,".theta",1);
+	comparison->thetaDifference = maxThetaDifference(file,fileB);
+	fclose(file);
+	fclose(fileB);
+
+	free(labelsA);
+	free(labelsB);
 }
 
-/*Returns Rz, the neighborhood factor to the model likelihood*/
-double computeNeiLikelihood(classif * myClassif/*i\O*/,int cell/*I*/,int clust/*I*/){
-	int j;
-	double ret=0;
-	
-	/*Iter on cell neighbors*/
-	for(j=0;j<myClassif->set.obs[cell].numNei;j++) {
-		/*If neighbor is in the same cluster than considered cell, increment*/
-		if(myClassif->clust[myClassif->set.obs[cell].nei[j]] == clust) {
-			ret++;
+/*Compares the outputs of two runs (given as result folder/outputFileName) and writes a validation report*/
+void compareRuns(char * prefixA/*I*/,char * prefixB/*I*/,FILE * report/*I*/) {
+	runComparison comparison;
+
+	compareRunFiles(prefixA,prefixB,&comparison);
+	fprintf(report,"reference\t%s\n",prefixA);
+	fprintf(report,"compared\t%s\n",prefixB);
+	fprintf(report,"numPoints\t%d\n",comparison.numPoints);
+	fprintf(report,"sameLabels\t%f\n",comparison.sameLabels);
+	fprintf(report,"adjustedRandIndex\t%f\n",comparison.adjustedRandIndex);
+	fprintf(report,"likelihoodReference\t%e\n",comparison.likelihoodReference);
+	fprintf(report,"likelihoodCompared\t%e\n",comparison.likelihoodCompared);
+	fprintf(report,"likelihoodRelativeDifference\t%e\n",comparison.likelihoodDifference);
+	fprintf(report,"thetaMaxDifference\t%e\n",comparison.thetaDifference);
+}
+
+/*Writes a synthetic dataset of numGenes genes in prefix.tab
+*
+*The points are read from a x,y,z coordinates file, or when points is a number drawn uniformly in a cube holding one point per unit volume
+*and written in prefix.csv. numClust centres are drawn among them, each point belonging to the region of its nearest centre, and every gene
+*of a region is expressed with a probability of 0.05, 0.1, 0.8 or 0.9. The draws only depend on seed
+*/
+void writeSynthetic(char * points/*I*/,char * prefix/*I*/,int numGenes/*I*/,int numClust/*I*/,unsigned long seed/*I*/) {
+	FILE * file;
+	char * name;
+	double * coords;
+	double * probs;
+	int * centres;
+	int i,k,g,a,num,region;
+	double side,dist,bestDist;
+	double levels[4] = {0.05,0.1,0.8,0.9};
+
+	if(strspn(points,"0123456789") == strlen(points)) {
+		/*drawn points*/
+		num = atoi(points);
+		coords = (double *)emMalloc(sizeof(double)*(3*num+1));
+		side = pow((double)num,1.0/3.0);
+		for(i=0;i<3*num;i++) {
+			coords[i] = side*counterUniform(seed,0,(unsigned long)i);
+		}
+		name = emMalloc(snprintf(NULL, 0, "%s.csv", prefix) + 1);
+		sprintf(name, "%s.csv", prefix);
+		file = fopen(name,"w");
+		if(file == NULL) {
+			printf("Cannot write %s\n",name);
+			exit(-1);
 		}
+		for(i=0;i<num;i++) {
+			fprintf(file,"%.4f,%.4f,%.4f\n",coords[3*i],coords[3*i+1],coords[3*i+2]);
+		}
+		fclose(file);
+		free(name);
+	}
+	else {
+		file = fopen(points,"r");
+		if(file == NULL) {
+			printf("Cannot open %s\n",points);
+			exit(-1);
+		}
+		num = count_lines(file);
+		coords = (double *)emMalloc(sizeof(double)*(3*num+1));
+		load_coordinates(file,num,coords);
+		fclose(file);
 	}
 
-	return ret;	
+	centres = (int *)emMalloc(sizeof(int)*numClust);
+	probs = (double *)emMalloc(sizeof(double)*numClust*numGenes);
+	for(k=0;k<numClust;k++) {
+		centres[k] = (int)(counterUniform(seed,1,(unsigned long)k)*num);
+		for(g=0;g<numGenes;g++) {
+			probs[k*numGenes+g] = levels[(int)(counterUniform(seed,2,(unsigned long)(k*numGenes+g))*4)];
+		}
+	}
+
+	name = emMalloc(snprintf(NULL, 0, "%s.tab", prefix) + 1);
+	sprintf(name, "%s.tab", prefix);
+	file = fopen(name,"w");
+	if(file == NULL) {
+		printf("Cannot write %s\n",name);
+		exit(-1);
+	}
+	for(i=0;i<num;i++) {
+		region = 0;
+		bestDist = HUGE_VAL;
+		for(k=0;k<numClust;k++) {
+			dist = 0;
+			for(a=0;a<3;a++) {
+				dist += (coords[3*i+a]-coords[3*centres[k]+a])*(coords[3*i+a]-coords[3*centres[k]+a]);
+			}
+			if(dist < bestDist) {
+				bestDist = dist;
+				region = k;
+			}
+		}
+		fprintf(file,"%d",i+1);
+		for(g=0;g<numGenes;g++) {
+			fprintf(file,"\t%d",counterUniform(seed,3,(unsigned long)i*numGenes+g) < probs[region*numGenes+g]);
+		}
+		fprintf(file,"\n");
+	}
+	fclose(file);
+	printf("%d points of %d genes in %d regions written to %s\n",num,numGenes,numClust,name);
+	free(name);
+	free(coords);
+	free(centres);
+	free(probs);
 }
 
+/*Copies a string*/
+static char * copyString(char * text/*I*/) {
+	char * copy = (char *)emMalloc(strlen(text)+1);
 
-/*Computes expectation*/
-double computeFullExpectation(classif * myClassif/*I*/) {
-	int i,k;
-	double logLikeRx=0.0,logLikeRz;
-	/*Checking for empty classes*/
-	noEmptyClass(myClassif);
-	/*Iter on cells*/
-	for(i=0;i<myClassif->set.num;i++) {
-		/*Iter on clusters*/
-		for(k=0;k<myClassif->numClust;k++){
-			/*Iter on genes*/
-			if(myClassif->tihm[k][i] != (double)0) {
-				logLikeRx = logLikeRx+((myClassif->cellDensities[k][i])*myClassif->tihm[k][i]);
-			}			
+	if (copy == NULL) {
+		printf("Out of memory manifest\n");
+		exit(-1);
+	}
+	strcpy(copy,text);
+	return copy;
+}
+
+/*Reads the lines of a profile file (name, phase, wall time and peak memory), skipping its header
+returns the number of records*/
+int load_profile(FILE * data/*I*/,phaseRecord ** records/*O*/) {
+	char line[LG_NEI_MAX];
+	char * name;
+	char * phase;
+	char * rest;
+	int num=0,capacity=16;
+
+	*records = (phaseRecord *)emMalloc(sizeof(phaseRecord)*capacity);
+	while(fgets(line,LG_NEI_MAX,data) != NULL) {
+		name = line;
+		phase = strchr(name,'\t');
+		if(phase == NULL || strncmp(line,"name\t",5) == 0) {
+			continue;
+		}
+		*phase++ = '\0';
+		rest = strchr(phase,'\t');
+		if(rest == NULL) {
+			continue;
+		}
+		*rest++ = '\0';
+		if(num == capacity) {
+			capacity *= 2;
+			*records = (phaseRecord *)emRealloc(*records,sizeof(phaseRecord)*capacity);
+			if (*records == NULL) {
+				printf("Out of memory profile\n");
+				exit(-1);
+			}
 		}
+		(*records)[num].name = copyString(name);
+		(*records)[num].phase = copyString(phase);
+		(*records)[num].wallTime = strtod(rest,&rest);
+		(*records)[num].peakMemory = strtod(rest,NULL);
+		num++;
 	}
-	logLikeRz = computeBetaExpectation(myClassif);
-	/*return value*/
-	return logLikeRx+logLikeRz;
+	return num;
 }
 
-/*Computes the beta part of the expected likelihood*/
-double computeBetaExpectation(classif * myClassif/*I*/) {
-	double expectation = 0,numerator,denominator=0;
-	int i,k;
-	
-	/*summing over the cells to compute denominator*/
-	for(i=0;i<myClassif->set.num;i++) {
-		denominator = 0;
-		/*Iter on clusters to compute denominator*/
-		for(k=1;k<=myClassif->numClust;k++){
-			denominator += exp(myClassif->beta[k-1]* computeNeiLikelihood(myClassif,i,k));
+/*Frees the records of a profile file*/
+void freeProfile(phaseRecord * records/*I\O*/,int num/*I*/) {
+	int i;
 
+	for(i=0;i<num;i++) {
+		free(records[i].name);
+		free(records[i].phase);
+	}
+	free(records);
+}
 
-		}
-		numerator = exp(myClassif->beta[(myClassif->clust[i]-1)]*computeNeiLikelihood(myClassif,i,myClassif->clust[i]));
+/*Returns the index of the record of a phase of a run, -1 if it is missing*/
+static int findPhase(phaseRecord * records/*I*/,int num/*I*/,char * name/*I*/,char * phase/*I*/) {
+	int r;
 
-		/*Iter on possible clusters*/
-		for(k=1;k<=myClassif->numClust;k++){
-			expectation += myClassif->tihm[k-1][i]*log(numerator/denominator);
+	for(r=0;r<num;r++) {
+		if(strcmp(records[r].name,name) == 0 && strcmp(records[r].phase,phase) == 0) {
+			return r;
 		}
 	}
+	return -1;
+}
 
-	return expectation;
+/*Keeps one record per run and phase of a profile, with the fastest wall time and the smallest peak memory of the repeats of the run,
+*so that one run slowed down by the machine does not fail a check
+returns the number of records kept*/
+static int fastestRepeats(phaseRecord * records/*I\O*/,int num/*I*/) {
+	int r,k,kept=0;
+
+	for(r=0;r<num;r++) {
+		k = findPhase(records,kept,records[r].name,records[r].phase);
+		if(k < 0) {
+			records[kept++] = records[r];
+			continue;
+		}
+		if(records[r].wallTime < records[k].wallTime) {
+			records[k].wallTime = records[r].wallTime;
+		}
+		if(records[r].peakMemory < records[k].peakMemory) {
+			records[k].peakMemory = records[r].peakMemory;
+		}
+		free(records[r].name);
+		free(records[r].phase);
+	}
+	return kept;
 }
 
-/*Computes logLikelihood*/
-double computeFullLogLikelihood(classif * myClassif/*I*/) {
-	int i;
-	double logLikeRx=0.0,logLikeRz;
-	/*Checking for empty classes*/
-	noEmptyClass(myClassif);
-	/*Iter on cells*/
-	for(i=0;i<myClassif->set.num;i++) {
-		logLikeRx += myClassif->cellDensities[myClassif->clust[i]-1][i];			
+/*Writes one check of a regression report, a check failing when value is above limit (below it if lower is set)
+returns 1 if the check failed*/
+static int reportCheck(FILE * report/*I*/,char * name/*I*/,char * check/*I*/,double value/*I*/,double reference/*I*/,double limit/*I*/,int lower/*I*/) {
+	int failed = lower ? !(value >= limit) : !(value <= limit);
+
+	fprintf(report,"%s\t%s\t%g\t%g\t%g\t%s\n",name,check,value,reference,limit,failed ? "FAIL" : "ok");
+	if(failed) {
+		printf("FAIL %s %s : %g for a limit of %g\n",name,check,value,limit);
 	}
-	logLikeRz = computePseudoLogLikelihood(myClassif);
-	/*return value*/
-	return logLikeRx+logLikeRz;
+	return failed;
 }
 
-/*compute model pseudo-logLikelihood*/
-double computePseudoLogLikelihood(classif * myClassif/*I*/) {
-	double pseudoLike = 0,numerator,denominator=0;
-	int i,k;
-	
-	/*summing over the cells to compute denominator*/
-	for(i=0;i<myClassif->set.num;i++) {
-		denominator = 0;
-		/*Iter on clusters to compute denominator*/
-		for(k=1;k<=myClassif->numClust;k++){
-			denominator += exp(myClassif->beta[k-1]* computeNeiLikelihood(myClassif,i,k));
+/*Checks the runs of the profile of an output folder against the golden runs and profile of a reference folder
+*
+*Every run named in output/profile.tsv is compared with the run of the same name in the golden folder (labels, likelihood and thetas),
+*and the wall time and peak memory of each of its phases with the golden profile, both profiles keeping the fastest of the repeats of a run. The golden wall times are scaled by the ratio of the
+*calibration times of the two profiles, so that the limits follow the speed of the machine. One line per check is written in report
+returns the number of failed checks*/
+int checkRegression(char * golden/*I*/,char * output/*I*/,char * report/*I*/,regressionLimits * limits/*I*/) {
+	FILE * file;
+	FILE * reportFile;
+	char * path;
+	char * check;
+	char * prefixA;
+	char * prefixB;
+	phaseRecord * current;
+	phaseRecord * reference;
+	int i,r,c,g,numCurrent,numReference,numChecks=0,failed=0;
+	double scale;
+	runComparison comparison;
+
+	path = emMalloc(snprintf(NULL, 0, "%s/profile.tsv", golden) + 1);
+	sprintf(path, "%s/profile.tsv", golden);
+	file = fopen(path,"r");
+	if(file == NULL) {
+		printf("Cannot open %s\n",path);
+		exit(-1);
+	}
+	numReference = load_profile(file,&reference);
+	numReference = fastestRepeats(reference,numReference);
+	fclose(file);
+	free(path);
+	path = emMalloc(snprintf(NULL, 0, "%s/profile.tsv", output) + 1);
+	sprintf(path, "%s/profile.tsv", output);
+	file = fopen(path,"r");
+	if(file == NULL) {
+		printf("Cannot open %s\n",path);
+		exit(-1);
+	}
+	numCurrent = load_profile(file,&current);
+	numCurrent = fastestRepeats(current,numCurrent);
+	fclose(file);
+	free(path);
+
+	reportFile = fopen(report,"w");
+	if(reportFile == NULL) {
+		printf("Cannot write %s\n",report);
+		exit(-1);
+	}
+	fprintf(reportFile,"name\tcheck\tvalue\treference\tlimit\tstatus\n");
+	for(i=0;i<numCurrent;i++) {
+		/*results, once per run*/
+		if(i == 0 || strcmp(current[i].name,current[i-1].name) != 0) {
+			prefixA = emMalloc(snprintf(NULL, 0, "%s/%s", golden, current[i].name) + 1);
+			sprintf(prefixA, "%s/%s", golden, current[i].name);
+			prefixB = emMalloc(snprintf(NULL, 0, "%s/%s", output, current[i].name) + 1);
+			sprintf(prefixB, "%s/%s", output, current[i].name);
+			file = openRunFile(prefixA,".summary",0);
+			if(file == NULL) {
+				failed += reportCheck(reportFile,current[i].name,"golden",0,0,1,1);
+				numChecks++;
+			}
+			else {
+				fclose(file);
+				compareRunFiles(prefixA,prefixB,&comparison);
+				failed += reportCheck(reportFile,current[i].name,"adjustedRandIndex",comparison.adjustedRandIndex,1,limits->minAdjustedRand,1);
+				failed += reportCheck(reportFile,current[i].name,"likelihoodRelativeDifference",comparison.likelihoodDifference,comparison.likelihoodReference,limits->maxLikelihood,0);
+				failed += reportCheck(reportFile,current[i].name,"thetaMaxDifference",comparison.thetaDifference,0,limits->maxTheta,0);
+				numChecks += 3;
+			}
+			free(prefixA);
+			free(prefixB);
 		}
 
-		numerator = exp(myClassif->beta[(myClassif->clust[i]-1)]*computeNeiLikelihood(myClassif,i,myClassif->clust[i]));
-		pseudoLike += log(numerator/denominator);
+		/*performance of the phase, the golden times being scaled by the calibration times of both machines*/
+		r = findPhase(reference,numReference,current[i].name,current[i].phase);
+		c = findPhase(current,numCurrent,current[i].name,"calibration");
+		g = findPhase(reference,numReference,current[i].name,"calibration");
+		scale = 1;
+		if(c >= 0 && g >= 0 && current[c].wallTime > 0 && reference[g].wallTime > 0) {
+			scale = current[c].wallTime/reference[g].wallTime;
+		}
+		check = emMalloc(snprintf(NULL, 0, "%sPeakMemory", current[i].phase) + 1);
+		if(strcmp(current[i].phase,"calibration") == 0) {
+			fprintf(reportFile,"%s\tcalibrationWallTime\t%g\t%g\t\tinfo\n",current[i].name,current[i].wallTime,g >= 0 ? reference[g].wallTime : 0);
+		}
+		else if(r < 0) {
+			sprintf(check, "%sGolden", current[i].phase);
+			failed += reportCheck(reportFile,current[i].name,check,0,0,1,1);
+			numChecks++;
+		}
+		else {
+			sprintf(check, "%sWallTime", current[i].phase);
+			failed += reportCheck(reportFile,current[i].name,check,current[i].wallTime,reference[r].wallTime*scale,(reference[r].wallTime*limits->maxSlowdown+limits->timeSlack)*scale,0);
+			sprintf(check, "%sPeakMemory", current[i].phase);
+			failed += reportCheck(reportFile,current[i].name,check,current[i].peakMemory,reference[r].peakMemory,reference[r].peakMemory*limits->maxMemory+limits->memorySlack,0);
+			numChecks += 2;
+		}
+		free(check);
 	}
+	fclose(reportFile);
+	printf("%d checks on %d phases, %d failed, report written to %s\n",numChecks,numCurrent,failed,report);
+	freeProfile(current,numCurrent);
+	freeProfile(reference,numReference);
+	return failed;
+}
+
+
+
+/**********************************END Result analysis functions*****************************************/
+/*******************************************************************************************/
+/**********************************START Model runs*****************************************/
+
+/*Creates a result folder*/
+void makeFolder(char * path/*I*/) {
+	#if defined(linux) || defined(__APPLE__)
+	mode_t process_mask;
 
-	return pseudoLike;
+	process_mask = umask(0);
+	mkdir(path, S_IRWXU | S_IRWXG | S_IRWXO);
+	umask(process_mask);
+	#endif
+	#if defined(_WIN32)
+	_mkdir(path);
+	#endif
 }
 
+/*Sets the posterior storage and E step engine of a model from the arguments of a run (sparse=m, estep=meanfield|icm|gibbs), seed keying the Gibbs draws*/
+void modelOptions(int argc/*I*/,char * argv[]/*I*/,classif * myClassif/*O*/,unsigned seed/*I*/) {
+	char * engine = optionValue(argc,argv,"estep");
 
-/*Computes current thims with a fixed point algorithm.
-*
-* The number of iteration of the fixed point algorithm is set through the numIterFixed parameter
-*/
-void computeThims(classif * myClassif /*I/O*/, int numIterFixed /*I*/) {
-	int k,i,iterFixed;
-	double sumDivisor;
-	double * neiCoef;
-	double temp;
-	
+	/*Sparse posteriors*/
+	myClassif->sparseM = 0;
+	if(optionValue(argc,argv,"sparse") != NULL) {
+		myClassif->sparseM = atoi(optionValue(argc,argv,"sparse"));
+	}
+	myClassif->engine = E_STEP_MEAN_FIELD;
+	if(engine != NULL && strcmp(engine,"icm") == 0) {
+		myClassif->engine = E_STEP_ICM;
+	}
+	else if(engine != NULL && strcmp(engine,"gibbs") == 0) {
+		myClassif->engine = E_STEP_GIBBS;
+	}
+	else if(engine != NULL && strcmp(engine,"meanfield") != 0) {
+		printf("Unknown E step engine %s, using meanfield\n",engine);
+	}
+	myClassif->rngSeed = seed;
+	myClassif->profile = NULL;
+}
+
+/*Initialises a model from the initialisation argument of a run : 'rand', a labels file or warm=previous run
+*sparseM, pool and log must be set*/
+void initModel(int argc/*I*/,char * argv[]/*I*/,dataSet set/*I*/,classif * myClassif/*I\O*/,double beta/*I*/,unsigned seed/*I*/) {
+	FILE *finit;
+	double start = wallClock();
+
+	fprintf(myClassif->log,"%d points, %d distinct expression profiles\n",set.numOwned,set.numProfiles);
+	fprintf(myClassif->log,"Starting initialisation\n");
+	/* INITIALIZATION STEP */
+	if(strncmp(argv[3],"rand",100) == 0){
+		fprintf(myClassif->log,"Random Initialisation\n");
+		initClassifRand(set,atoi(argv[5]),myClassif,beta,seed);
+		myClassif->initName = "rand";
+	}
+	else if(strncmp(argv[3],"kmeans",100) == 0 || strncmp(argv[3],"grow",100) == 0){
+		fprintf(myClassif->log,"K-means++ Initialisation%s\n",argv[3][0] == 'g' ? " grown over the neighbouring graph" : "");
+		initClassifSeeded(set,atoi(argv[5]),myClassif,beta,seed,argv[3][0] == 'g');
+		myClassif->initName = argv[3][0] == 'g' ? "grow" : "kmeans";
+	}
+	else if(strncmp(argv[3],"warm=",5) == 0){
+		fprintf(myClassif->log,"Warm start from previous run : %s\n",argv[3]+5);
+		initClassifWarm(set,argv[3]+5,myClassif,beta,hasOption(argc,argv,"fixed") || optionValue(argc,argv,"betas") != NULL);
+		myClassif->initName = "warm";
+	}
+	else{
+		finit = fopen(argv[3],"r");
+		fprintf(myClassif->log,"Initialisation from file : %s\n",argv[3]);
+		initClassifFile(set,finit,myClassif,beta);
+		fclose(finit);
+		myClassif->initName = "file";
+	}
+	myClassif->initTime = wallClock()-start;
+	fprintf(myClassif->log,"Initialisation took %.3f s\n",myClassif->initTime);
+	recordPhase(myClassif->profile,argv[7],"init",start);
+}
 
-	/*Allocating memory*/
-	neiCoef = (double *)malloc(sizeof(double)*myClassif->numClust);
+/*Runs EM on an initialised model until convergence and writes the output files as result folder/name
+*
+*Convergence, tolerance and the .npy outputs are read from the arguments of the run, the progress messages go to the log of the model
+returns the number of iterations*/
+int fitModel(int argc/*I*/,char * argv[]/*I*/,classif * myClassif/*I\O*/,char * name/*I*/,int type_beta/*I*/) {
+	/* File names*/
+	char * summaryFile;
+	char * clustFile;
+	char * csvFile;
+	char * thetaFile;
+	FILE * log = myClassif->log;
 
-	/* Checking if mem alloc went OK*/
-	if (neiCoef != NULL) {
-		/*computing thims*/
-		for(iterFixed=0;iterFixed<numIterFixed;iterFixed++) {
+	int j=1,k;
+	int hasConverged;
+	int convergeLimit;
+	int limitIter = 100;
+	double likelihood,lastLikelihood=-1e100;
+	double tolerance=0;
+	double phaseStart;
+	/*Binary outputs*/
+	snapshotWriter writer;
+	char * prefix;
+	int snapshots=0,binary;
+#ifdef EM_DEBUG
+	unsigned long iterAllocations;
+#endif
 
-			for(i=0;i<myClassif->set.num;i++) {
+	/*Set required parameters*/
+	hasConverged=atoi(argv[8])+1;
+	convergeLimit=atoi(argv[8]);
+	if(optionValue(argc,argv,"tolerance") != NULL) {
+		tolerance = atof(optionValue(argc,argv,"tolerance"));
+	}
 
-				sumDivisor = 0.0;
+	/*.npy outputs, and snapshots every few iterations written in the background*/
+	binary = hasOption(argc,argv,"npy");
+	if(optionValue(argc,argv,"snapshots") != NULL) {
+		snapshots = atoi(optionValue(argc,argv,"snapshots"));
+	}
+	if(binary || snapshots > 0) {
+		prefix = emMalloc(snprintf(NULL, 0, "%s/%s", argv[6], name) + 1);
+		sprintf(prefix, "%s/%s", argv[6], name);
+		createSnapshotWriter(&writer,myClassif,prefix,snapshots > 0);
+	}
 
-				/* Computing all cell densities*/
-				for(k=0;k<myClassif->numClust;k++) {
+	fprintf(log,"Initialisation done.\n");
+	/* END INITIALIZATION */
+	fprintf(log,"\n");
+	fprintf(log,"\n");
 
-					neiCoef[k] = exp(computeNeiCoef(myClassif,myClassif->tihm,k,i)*(double)myClassif->beta[k]);
 
-					sumDivisor = sumDivisor+(exp(myClassif->cellDensities[k][i])*neiCoef[k]);
+	/* WHILE not converged*/
+	fprintf(log,"Starting EM process\n");
+	phaseStart = wallClock();
+	while(hasConverged > convergeLimit && limitIter-->=0){
+#ifdef EM_DEBUG
+		iterAllocations = allocationCount();
+#endif
 
+		/* E-Step */
+		fprintf(log,"\tE Step, estimating\n");
+		hasConverged =eStep(myClassif);
 
-				}
-				for(k=0;k<myClassif->numClust;k++) {
-					temp = (exp(myClassif->cellDensities[k][i])*neiCoef[k])/sumDivisor;
-					myClassif->tihm[k][i] = temp;	
-				}
+		/* Compute thetas based on random classification */
+		fprintf(log,"\tM Step, maximazing parameters\n");
+		mStep(myClassif,type_beta);
 
+		fprintf(log,"\tCurrent beta values :");
+		for(k=0;k<myClassif->numClust;k++) {
+			fprintf(log," %f",myClassif->beta[k]);
+		}
+		fprintf(log,"\n");
 
+		likelihood = computeFullLogLikelihood(myClassif);
+		fprintf(log,"\tClusters changed : %d\n\tCurrent Likelihood :%e\n",hasConverged,likelihood);
+		/*the likelihood no longer moving also means convergence*/
+		if(tolerance > 0 && fabs(likelihood-lastLikelihood) <= tolerance*fabs(likelihood)) {
+			hasConverged = convergeLimit;
+		}
+		lastLikelihood = likelihood;
+		if(snapshots > 0 && j%snapshots == 0) {
+			queueSnapshot(&writer,myClassif,j,0);
+		}
+#ifdef EM_DEBUG
+		fprintf(log,"\tHeap allocations : %lu\n",allocationCount()-iterAllocations);
+#endif
 
-			}
 
-			
+		if(hasConverged <= convergeLimit) {
+			fprintf(log,"Converges !");
 		}
+		fprintf(log,"\n\n");
+		j++;
 	}
+	recordPhase(myClassif->profile,name,"em",phaseStart);
+	phaseStart = wallClock();
+	fprintf(log,"Creating output\n");
 
-	/*Freeing memory*/
-	free(neiCoef);
-	neiCoef = NULL;
 
-	return;
-			
-}
 
+	/*Outputing results*/
 
+	summaryFile = emMalloc(snprintf(NULL, 0, "%s/%s.summary", argv[6], name) + 9);
+	sprintf(summaryFile, "%s/%s.summary", argv[6], name);
+	outputEMSummary(summaryFile,myClassif,j);
 
 
+	csvFile = emMalloc(snprintf(NULL, 0, "%s/%s.csv", argv[6], name) + 5);
+	sprintf(csvFile, "%s/%s.csv", argv[6], name);
+	outputCSV(csvFile,myClassif);
 
-/*Gradient descent algorithm to maximize beta paramters sequentially*/
-void gradientAscent(classif * myClassif /*I/O*/) {
-	double derivatePlus,derivateMinus;
-	double init_step = 0.1;
-	double step = init_step;
-	double currentLike = 0;
-	double oriBeta;
-	int stopAscent =0;
-	int k;
+	thetaFile = emMalloc(snprintf(NULL, 0, "%s/%s.theta", argv[6], name) + 7);
+	sprintf(thetaFile, "%s/%s.theta", argv[6], name);
+	outputThetas(thetaFile,myClassif);
 	
+	
+	clustFile = emMalloc(snprintf(NULL, 0, "%s/%s.clust", argv[6], name) + 7);
+	sprintf(clustFile,"%s/%s.clust", argv[6], name);
+	outputClustSummary(clustFile,myClassif);
 
-	/*for each beta*/
-	for(k=0;k<myClassif->numClust;k++) {
-		derivatePlus = -100;
-		derivateMinus = -100;
-		step = init_step;
-		currentLike = 0;
-		stopAscent = 0;
-		/*varying beta until convergence to local maximum*/
-		while(stopAscent <1) { 
-			/*Registering current Beta*/
-			oriBeta = myClassif->beta[k];
-			/*numerical derivate*/
-			currentLike = 	computeBetaExpectation(myClassif);
-			/*Computing derivate */
-			myClassif->beta[k] = oriBeta +step;
-			derivatePlus = computeBetaExpectation(myClassif)-currentLike;
-			myClassif->beta[k] = oriBeta - step;
-			derivateMinus = computeBetaExpectation(myClassif)-currentLike;
-			/*which way to go?*/
-			if(derivatePlus > 0 || derivateMinus > 0) {
-				if(derivatePlus > 0 && derivatePlus>derivateMinus) {
-					myClassif->beta[k] = oriBeta +step;
-				}
-				else if((oriBeta -step) > 0) {
-					myClassif->beta[k] = oriBeta -step;
-				}
-				else {
-					myClassif->beta[k] = 0.0;
-					stopAscent = 1;
-				}
+	if(binary) {
+		queueSnapshot(&writer,myClassif,-1,1);
+	}
+	if(binary || snapshots > 0) {
+		closeSnapshotWriter(&writer);
+		free(prefix);
+	}
+
+	free(summaryFile);
+	free(csvFile);
+	free(thetaFile);
+	free(clustFile);
+	recordPhase(myClassif->profile,name,"output",phaseStart);
+	return j-1;
+}
+
+/*Fits the model on a loaded dataset with the arguments of a run (argv[2] is not read)
+*
+*Initialises the model, runs EM until convergence and writes the output files in the result folder, the progress messages going to log.
+*With betas=schedule, the fits of a fixed beta path are run instead (see runBetaPath)
+returns the number of iterations, the final expected likelihood in likelihood*/
+int runModel(int argc/*I*/,char * argv[]/*I*/,dataSet set/*I*/,threadPool * pool/*I*/,unsigned seed/*I*/,FILE * log/*I*/,double * likelihood/*O*/) {
+	/*Classification object*/
+	classif clusters;
+	int numIter;
+
+	/*Initializing output*/
+	if(isMainProcess()) {
+		makeFolder(argv[6]);
+	}
+	if(optionValue(argc,argv,"betas") != NULL) {
+		return runBetaPath(argc,argv,set,pool,seed,log,likelihood);
+	}
+
+	/*Posterior storage and E step engine*/
+	modelOptions(argc,argv,&clusters,seed);
+	/*Threads of the parallel loops*/
+	clusters.pool = pool;
+	clusters.log = log;
+	if(optionValue(argc,argv,"profile") != NULL) {
+		clusters.profile = openProfile(optionValue(argc,argv,"profile"));
+	}
+
+	initModel(argc,argv,set,&clusters,atof(argv[4]),seed);
+	/*detecting beta type*/
+	numIter = fitModel(argc,argv,&clusters,argv[7],hasOption(argc,argv,"fixed"));
+
+	/*the summary likelihood, cached by outputEMSummary*/
+	*likelihood = computeFullExpectation(&clusters);
+	if(clusters.profile != NULL) {
+		fclose(clusters.profile);
+	}
+	freeWorkspace(&clusters);
+	return numIter;
+}
+
+/*Reads a beta schedule, either a list (0,0.5,1) or a range start:end:step
+returns a newly allocated vector of betas, their number in numBetas*/
+double * parseBetaSchedule(char * schedule/*I*/,int * numBetas/*O*/) {
+	double start,end,step,value;
+	double * betas;
+	char * cursor;
+	char * last;
+	int b,capacity=16;
+
+	if(sscanf(schedule,"%lf:%lf:%lf",&start,&end,&step) == 3) {
+		*numBetas = step > 0 && end >= start ? (int)floor((end-start)/step+1e-9)+1 : 1;
+		betas = (double *)emMalloc(sizeof(double)*(*numBetas));
+		if (betas == NULL) {
+			printf("Out of memory betas\n");
+			exit(-1);
+		}
+		for(b=0;b<*numBetas;b++) {
+			betas[b] = start+b*step;
+		}
+		return betas;
+	}
+	betas = (double *)emMalloc(sizeof(double)*capacity);
+	*numBetas = 0;
+	cursor = schedule;
+	while(betas != NULL) {
+		value = strtod(cursor,&last);
+		if(last == cursor) {
+			break;
+		}
+		if(*numBetas == capacity) {
+			capacity *= 2;
+			betas = (double *)emRealloc(betas,sizeof(double)*capacity);
+			if(betas == NULL) {
+				break;
 			}
-			else {
-				myClassif->beta[k] = oriBeta;
-				stopAscent = 1;	
+		}
+		betas[(*numBetas)++] = value;
+		cursor = last;
+		while(*cursor == ',') {
+			cursor++;
+		}
+	}
+	if (betas == NULL) {
+		printf("Out of memory betas\n");
+		exit(-1);
+	}
+	return betas;
+}
+
+/*Fits the betas of the path segments of one worker, each segment starting from the initialisation of the run and each beta from the model converged at the previous one*/
+static void betaPathWorker(threadTask * task/*I*/) {
+	betaPath * path = (betaPath *)task->data;
+	classif clusters;
+	char * name;
+	char * logFile;
+	int s,b,k,first,last;
+	double start;
+
+	for(s=task->thread;s<path->numSegments;s+=task->numThreads) {
+		first = (int)(((long)path->numBetas*s)/path->numSegments);
+		last = (int)(((long)path->numBetas*(s+1))/path->numSegments);
+
+		modelOptions(path->argc,path->argv,&clusters,path->seed);
+		/*segments run side by side are single threaded*/
+		clusters.pool = task->numThreads > 1 ? NULL : path->pool;
+		clusters.log = path->log;
+		logFile = NULL;
+		if(task->numThreads > 1) {
+			logFile = emMalloc(snprintf(NULL, 0, "%s/%s.segment%d.log", path->argv[6], path->argv[7], s+1) + 1);
+			sprintf(logFile, "%s/%s.segment%d.log", path->argv[6], path->argv[7], s+1);
+			clusters.log = fopen(logFile,"w");
+			if(clusters.log == NULL) {
+				printf("Cannot write %s\n",logFile);
+				exit(-1);
 			}
+		}
 
-			/*Uncomment for verbose mode on the gradient ascent*/
-			/*printf("cluster : %d | derivPlus: %e | derivMinus: %e | like : %e | beta : %f | step : %f\n",k,derivatePlus,derivateMinus,currentLike,myClassif->beta[k],step);*/
+		initModel(path->argc,path->argv,path->set,&clusters,path->betas[first],path->seed);
+		for(b=first;b<last;b++) {
+			/*warm start from the previous beta*/
+			for(k=0;k<clusters.numClust;k++) {
+				clusters.beta[k] = path->betas[b];
+			}
+			invalidateLikelihood(&clusters);
+			fprintf(clusters.log,"Fitting beta %g\n",path->betas[b]);
+
+			name = emMalloc(snprintf(NULL, 0, "%s.beta%g", path->argv[7], path->betas[b]) + 1);
+			sprintf(name, "%s.beta%g", path->argv[7], path->betas[b]);
+			start = wallClock();
+			path->iterations[b] = fitModel(path->argc,path->argv,&clusters,name,1);
+			path->wallTimes[b] = wallClock()-start;
+			path->likelihoods[b] = computeFullExpectation(&clusters);
+			path->segment[b] = s+1;
+			free(name);
+			/*the next fits start from this one*/
+			clusters.initName = "previous beta";
+			clusters.initTime = 0;
+		}
+		freeWorkspace(&clusters);
+		if(logFile != NULL) {
+			fclose(clusters.log);
+			free(logFile);
 		}
 	}
-	
+}
+
+/*Fits the model for every beta of a schedule (betas=...) with fixed betas
+*
+*The schedule is cut in segments=n contiguous segments started from the initialisation of the run, within a segment each fit starts from
+*the labels and posteriors converged at the previous beta, so that it only takes a few iterations. Segments are independent and run
+*side by side (up to the number of threads, each one logging to outputFileName.segmentN.log), the fits being written as outputFileName.betaB
+*and the likelihood of each beta in outputFileName.path
+returns the total number of iterations, the likelihood of the last beta in likelihood*/
+int runBetaPath(int argc/*I*/,char * argv[]/*I*/,dataSet set/*I*/,threadPool * pool/*I*/,unsigned seed/*I*/,FILE * log/*I*/,double * likelihood/*O*/) {
+	betaPath path;
+	char * tableFile;
+	FILE * table;
+	int b,numWorkers,numIter=0;
+
+	path.argc = argc;
+	path.argv = argv;
+	path.set = set;
+	path.pool = pool;
+	path.seed = seed;
+	path.log = log;
+	path.betas = parseBetaSchedule(optionValue(argc,argv,"betas"),&(path.numBetas));
+	if(path.numBetas == 0) {
+		/*an empty schedule is the beta of the run*/
+		path.betas[path.numBetas++] = atof(argv[4]);
+	}
+	path.numSegments = optionValue(argc,argv,"segments") != NULL ? atoi(optionValue(argc,argv,"segments")) : 1;
+	if(path.numSegments > path.numBetas) {
+		path.numSegments = path.numBetas;
+	}
+	if(path.numSegments < 1) {
+		path.numSegments = 1;
+	}
+	path.iterations = (int *)emMalloc(sizeof(int)*(path.numBetas+1));
+	path.segment = (int *)emMalloc(sizeof(int)*(path.numBetas+1));
+	path.likelihoods = (double *)emMalloc(sizeof(double)*(path.numBetas+1));
+	path.wallTimes = (double *)emMalloc(sizeof(double)*(path.numBetas+1));
+	if (path.iterations == NULL || path.segment == NULL || path.likelihoods == NULL || path.wallTimes == NULL) {
+		printf("Out of memory betas\n");
+		exit(-1);
+	}
+
+	/*one worker per thread at most*/
+	numWorkers = pool != NULL ? pool->numThreads : 1;
+	if(numWorkers > path.numSegments) {
+		numWorkers = path.numSegments;
+	}
+#ifdef USE_MPI
+	/*the reductions of a fit are collective calls of the main thread*/
+	numWorkers = 1;
+#endif
+	fprintf(log,"Beta path of %d values in %d segments\n",path.numBetas,path.numSegments);
+	runThreads(numWorkers,betaPathWorker,&path);
+
+	/*likelihood versus beta*/
+	if(isMainProcess()) {
+		tableFile = emMalloc(snprintf(NULL, 0, "%s/%s.path", argv[6], argv[7]) + 1);
+		sprintf(tableFile, "%s/%s.path", argv[6], argv[7]);
+		table = fopen(tableFile,"w");
+		if(table == NULL) {
+			printf("Cannot write %s\n",tableFile);
+			exit(-1);
+		}
+		fprintf(table,"beta\tsegment\titerations\tlikelihood\twallTime\n");
+		for(b=0;b<path.numBetas;b++) {
+			fprintf(table,"%g\t%d\t%d\t%e\t%.3f\n",path.betas[b],path.segment[b],path.iterations[b],path.likelihoods[b],path.wallTimes[b]);
+		}
+		fclose(table);
+		free(tableFile);
+	}
+	for(b=0;b<path.numBetas;b++) {
+		numIter += path.iterations[b];
+	}
+	*likelihood = path.likelihoods[path.numBetas-1];
+
+	free(path.betas);
+	free(path.iterations);
+	free(path.segment);
+	free(path.likelihoods);
+	free(path.wallTimes);
+	return numIter;
+}
 
+/*Seconds elapsed since an arbitrary origin*/
+double wallClock(void) {
+#if defined(CLOCK_MONOTONIC) && !defined(EM_NO_THREADS)
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC,&now);
+	return (double)now.tv_sec+1e-9*(double)now.tv_nsec;
+#else
+	/*time() only counts seconds, a single threaded build measures the processor time instead*/
+	return (double)clock()/CLOCKS_PER_SEC;
+#endif
 }
 
+/*Peak resident memory of the process in MB, 0 where it is not available*/
+double peakMemory(void) {
+#ifdef linux
+	struct rusage usage;
 
+	getrusage(RUSAGE_SELF,&usage);
+	return (double)usage.ru_maxrss/1024.0;
+#else
+	return 0;
+#endif
+}
 
+/*Opens a profile file to append to, writing its header if it is new*/
+FILE * openProfile(char * path/*I*/) {
+	FILE * profile;
 
-/*E Step of the EM algorithm
-*Returns the number of clusters assignments that have changed compared to the previous clustering
-*this value is used to know if convergence has been reached
-*/
-int eStep(classif * myClassif /*I\O*/) {
-	int k,i,hasConverged=0;
-	double maxClust;
-	int clustK;
-	
-	/*Computing new cell densities*/
-	computeCellDensities(myClassif);
-	/*Computing thims with fixed point algo with 3 steps*/
-	computeThims(myClassif,3);
-	
+	if(!isMainProcess()) {
+		return NULL;
+	}
+	profile = fopen(path,"a");
+	if(profile == NULL) {
+		printf("Cannot write %s\n",path);
+		return NULL;
+	}
+	if(ftell(profile) == 0) {
+		fprintf(profile,"name\tphase\twallTime\tpeakMemoryMB\n");
+	}
+	return profile;
+}
+
+/*Keeps the result of the calibration loop from being optimised away*/
+static volatile double calibrationSink;
+
+/*Seconds taken by a fixed loop of the exp, log and memory accesses of the E step on this machine, the best of 3 runs
+*The phases of a profile are compared with the golden ones relative to it, so that a slower machine does not look like a regression*/
+double calibrationTime(void) {
+	int r,i;
+	double start,elapsed,best=0,sum;
+	double * table;
+
+	table = (double *)emMalloc(sizeof(double)*65536);
+	for(i=0;i<65536;i++) {
+		table[i] = 1.0+(double)(i%1000)*1e-3;
+	}
+	for(r=0;r<3;r++) {
+		start = wallClock();
+		sum = 0;
+		for(i=0;i<10000000;i++) {
+			sum += exp(-table[((unsigned)i*40503u)&65535u])*log(table[i&65535]);
+		}
+		calibrationSink = sum;
+		elapsed = wallClock()-start;
+		if(r == 0 || elapsed < best) {
+			best = elapsed;
+		}
+	}
+	free(table);
+	return best;
+}
+
+/*Appends the calibration time of this machine to a profile, if any*/
+void recordCalibration(FILE * profile/*I*/,char * name/*I*/) {
+	if(profile != NULL) {
+		fprintf(profile,"%s\tcalibration\t%.4f\t%.1f\n",name,calibrationTime(),peakMemory());
+	}
+}
 
-	/*assigning cells to cluster*/
-	for(i=0;i<myClassif->set.num;i++) {
-		maxClust = -1000;
-		clustK=1;
-		for(k=0;k<myClassif->numClust;k++) {
-			if((myClassif->tihm[k][i]-maxClust) > 0.0) {
-				maxClust = myClassif->tihm[k][i];
-				clustK = k+1;
+/*Appends the wall time since start and the peak memory reached by the end of a phase of a run to its profile, if any*/
+void recordPhase(FILE * profile/*I*/,char * name/*I*/,char * phase/*I*/,double start/*I*/) {
+	if(profile != NULL) {
+		fprintf(profile,"%s\t%s\t%.3f\t%.1f\n",name,phase,wallClock()-start,peakMemory());
+	}
+}
 
+/*Reads a batch manifest
+*
+*Each line holds the arguments of a run without the neighbouring file: [data file] ['rand' | initialisation file] [beta] [K] [result folder] [outputFileName] [convergence] {options}
+*Empty lines and lines starting with # are skipped, jobs reading the same data file share one cache entry
+returns the number of jobs*/
+int load_manifest(FILE * manifest/*I*/,char * program/*I*/,char * graph/*I*/,batchRun * run/*O*/) {
+	char line[LG_NEI_MAX*20];
+	char * tokens[LG_NEI_MAX];
+	char * token;
+	int numTokens,d,t,size=16;
+	batchJob * job;
+
+	run->jobs = (batchJob *)emMalloc(sizeof(batchJob)*size);
+	run->datasets = (cachedDataset *)emMalloc(sizeof(cachedDataset)*size);
+	if (run->jobs == NULL || run->datasets == NULL) {
+		printf("Out of memory manifest\n");
+		exit(-1);
+	}
+	run->numJobs = 0;
+	run->numDatasets = 0;
+
+	while(fgets(line,LG_NEI_MAX*20,manifest) != NULL) {
+		numTokens = 0;
+		token = strtok(line," \t\r\n");
+		while(token != NULL && numTokens < LG_NEI_MAX) {
+			tokens[numTokens++] = token;
+			token = strtok(NULL," \t\r\n");
+		}
+		if(numTokens == 0 || tokens[0][0] == '#') {
+			continue;
+		}
+		if(numTokens < 7) {
+			printf("Skipping manifest line with %d arguments instead of at least 7 : %s\n",numTokens,tokens[0]);
+			continue;
+		}
+		if(run->numJobs == size) {
+			size *= 2;
+			run->jobs = (batchJob *)emRealloc(run->jobs,sizeof(batchJob)*size);
+			run->datasets = (cachedDataset *)emRealloc(run->datasets,sizeof(cachedDataset)*size);
+			if (run->jobs == NULL || run->datasets == NULL) {
+				printf("Out of memory manifest\n");
+				exit(-1);
 			}
 		}
 
-		/*Assigning Cluster !*/
-		if(myClassif->clust[i] != clustK ){
-				hasConverged++;
-				myClassif->clust[i] = clustK;
+		/*the arguments of a single run, with the shared neighbouring file in argv[2]*/
+		job = &(run->jobs[run->numJobs]);
+		job->argc = numTokens+2;
+		job->argv = (char **)emMalloc(sizeof(char *)*(job->argc+1));
+		if (job->argv == NULL) {
+			printf("Out of memory manifest\n");
+			exit(-1);
 		}
-
-
+		job->argv[0] = copyString(program);
+		job->argv[1] = copyString(tokens[0]);
+		job->argv[2] = copyString(graph);
+		for(t=1;t<numTokens;t++) {
+			job->argv[t+2] = copyString(tokens[t]);
+		}
+		job->argv[job->argc] = NULL;
+		job->status = 1;
+		job->iterations = 0;
+		job->likelihood = 0;
+		job->wallTime = 0;
+		job->memory = 0;
+
+		/*cache entry of the data file*/
+		for(d=0;d<run->numDatasets && strcmp(run->datasets[d].path,tokens[0]) != 0;d++);
+		if(d == run->numDatasets) {
+			run->datasets[d].path = job->argv[1];
+			run->datasets[d].state = 0;
+			run->datasets[d].users = 0;
+			run->datasets[d].bytes = 0;
+			run->numDatasets++;
+		}
+		run->datasets[d].users++;
+		job->dataset = d;
+		run->numJobs++;
 	}
-
-	return hasConverged;
+	return run->numJobs;
 }
 
+/*Releases the jobs of a manifest*/
+void freeManifest(batchRun * run/*I\O*/) {
+	int j,a;
 
-/*returns the numbers of cells having similarly expressed genes as the exp one in the same cluster*/
-int numCellsAlike(int exp,int indexGene,int clust,classif * myClassif) {
-	int numCells=0,i;
-	for(i=0;i<myClassif->set.num;i++) {
-		if(exp == myClassif->set.obs[i].expVect[indexGene] && clust == myClassif->clust[i]){
-			numCells++;
+	for(j=0;j<run->numJobs;j++) {
+		for(a=0;a<run->jobs[j].argc;a++) {
+			free(run->jobs[j].argv[a]);
 		}
+		free(run->jobs[j].argv);
 	}
-	return numCells;
+	free(run->jobs);
+	free(run->datasets);
 }
 
-/*returns number of cells for one cluster*/
-int numCellsClust(int clust,classif * myClassif) {
-	int numCells=0,i;
-	for(i=0;i<myClassif->set.num;i++) {
-		if(clust == myClassif->clust[i]){
-			numCells++;
-		}
-	}
-	return numCells;
+/*Bytes held by a loaded serial dataset, its neighbours being shared*/
+static size_t datasetBytes(dataSet * myData/*I*/) {
+	return (size_t)myData->num*(sizeof(dataPoint)+sizeof(int)*(myData->length+2)+sizeof(unsigned long)*(myData->numWords+1))
+		+sizeof(int)*2*(size_t)(myData->numOwned+1);
 }
 
+/*Memory a dataset will hold once loaded, the length of its vectors being read on the first line of its file
+returns 0 if the file cannot be read*/
+static size_t estimateDatasetBytes(char * path/*I*/,int numPoints/*I*/) {
+	FILE * data;
+	char line[LG_LIG_MAX];
+	int * vect;
+	dataSet shape;
 
-/*Maximize thetas*/
-void maxThetas(classif * myClassif /*I/O*/) {
-	double numtheta;
-	double dentheta;	
-	int k,j;
+	data = fopen(path,"r");
+	if(data == NULL) {
+		return 0;
+	}
+	shape.length = 0;
+	if(fgets(line,sizeof(line),data) != NULL) {
+		vect = (int *)emMalloc(sizeof(int)*LG_GENES_MAX);
+		shape.length = parse_vect(line,vect);
+		free(vect);
+	}
+	fclose(data);
+	shape.num = numPoints;
+	shape.numOwned = numPoints;
+	shape.numWords = (shape.length-1+BITS_PER_WORD-1)/BITS_PER_WORD;
+	return datasetBytes(&shape);
+}
 
+/*Loads a cached dataset, its neighbours pointing in the shared graph
+returns 1 if it is usable*/
+static int loadCachedDataset(batchRun * run/*I*/,cachedDataset * entry/*I\O*/) {
+	FILE * data;
 
-	/*Iter on clusters*/
-	for(k=0;k<myClassif->numClust;k++) {
-		/*Iter on genes starting at 1 because first value is cell ID !!!*/
-		for(j=1;j<myClassif->set.length;j++){
-			numtheta =  (double)numCellsAlike(1,j,k+1,myClassif);
-			dentheta = (double)numCellsClust(k+1,myClassif);
+	data = fopen(entry->path,"r");
+	if(data == NULL) {
+		printf("Cannot open %s\n",entry->path);
+		return 0;
+	}
+	load_data(data,&(entry->set));
+	fclose(data);
+	if(entry->set.num != run->numPoints) {
+		printf("The data file %s has %d lines, the neighbouring graph %d points\n",entry->path,entry->set.num,run->numPoints);
+		freeDataset(&(entry->set),0);
+		return 0;
+	}
+	setNeighbours(&(entry->set),run->numPoints,run->graphStart,run->graphAdj,1);
+	entry->bytes = datasetBytes(&(entry->set));
+	return 1;
+}
 
-			myClassif->parameters.theta[k][j] = (numtheta/dentheta);
+/*Takes the next job of a worker, from its own queue or else from the end of the longest one
+*returns the job index, -1 once every queue is empty
+*/
+static int nextBatchJob(batchRun * run/*I\O*/,int worker/*I*/) {
+	int w,victim=-1,job=-1;
 
-		}		
-			
+#ifndef EM_NO_THREADS
+	pthread_mutex_lock(&(run->lock));
+#endif
+	if(run->queueHead[worker] < run->queueTail[worker]) {
+		job = run->queues[worker*run->numJobs+run->queueHead[worker]++];
+	}
+	else {
+		for(w=0;w<run->numWorkers;w++) {
+			if(run->queueTail[w]-run->queueHead[w] > 0 && (victim < 0 || run->queueTail[w]-run->queueHead[w] > run->queueTail[victim]-run->queueHead[victim])) {
+				victim = w;
+			}
+		}
+		if(victim >= 0) {
+			job = run->queues[victim*run->numJobs+--(run->queueTail[victim])];
+		}
 	}
+#ifndef EM_NO_THREADS
+	pthread_mutex_unlock(&(run->lock));
+#endif
+	return job;
 }
 
-/*M step of the algorithm*/
-void mStep(classif * myClassif,int type_beta) {
-	
-	/*Maximizing thetas*/
-	maxThetas(myClassif);
-	if(type_beta == 0){
-		/*Maximizing betas*/
-		gradientAscent(myClassif);
+/*Loads the dataset of a job if no other job did, waits for enough of the memory budget and fits the model, logging to folder/outputFileName.log*/
+static void runBatchJob(batchRun * run/*I\O*/,batchJob * job/*I\O*/) {
+	cachedDataset * entry = &(run->datasets[job->dataset]);
+	classif model;
+	threadPool pool;
+	FILE * log;
+	FILE * finit;
+	char * logFile;
+	unsigned seed;
+	int loaded,usable;
+	size_t estimate;
+	double start;
+
+#ifndef EM_NO_THREADS
+	pthread_mutex_lock(&(run->lock));
+	while(entry->state == 1) {
+		pthread_cond_wait(&(run->changed),&(run->lock));
+	}
+#endif
+	if(entry->state == 0) {
+		/*the dataset is counted in the budget before it is loaded, waiting like the jobs do*/
+		entry->state = 1;
+#ifndef EM_NO_THREADS
+		pthread_mutex_unlock(&(run->lock));
+#endif
+		estimate = estimateDatasetBytes(entry->path,run->numPoints);
+#ifndef EM_NO_THREADS
+		pthread_mutex_lock(&(run->lock));
+		while(run->budget > 0 && (run->running > 0 || run->loading > 0) && run->reserved+estimate > run->budget) {
+			pthread_cond_wait(&(run->changed),&(run->lock));
+		}
+#endif
+		run->reserved += estimate;
+		run->loading++;
+#ifndef EM_NO_THREADS
+		pthread_mutex_unlock(&(run->lock));
+#endif
+		loaded = loadCachedDataset(run,entry);
+#ifndef EM_NO_THREADS
+		pthread_mutex_lock(&(run->lock));
+#endif
+		entry->state = loaded ? 2 : -1;
+		run->reserved -= estimate;
+		run->loading--;
+		if(loaded) {
+			run->reserved += entry->bytes;
+		}
+#ifndef EM_NO_THREADS
+		pthread_cond_broadcast(&(run->changed));
+#endif
 	}
 
-	
-}
+	/*a model whose initialisation file is missing is not fitted*/
+	usable = entry->state == 2 && atoi(job->argv[5]) > 0;
+	if(usable && strncmp(job->argv[3],"warm=",5) == 0) {
+		finit = openRunFile(job->argv[3]+5,".theta",0);
+		if(finit == NULL) {
+			printf("Cannot open %s.theta\n",job->argv[3]+5);
+			usable = 0;
+		}
+		else {
+			fclose(finit);
+		}
+	}
+	else if(usable && strncmp(job->argv[3],"rand",100) != 0 && strncmp(job->argv[3],"kmeans",100) != 0 && strncmp(job->argv[3],"grow",100) != 0) {
+		finit = fopen(job->argv[3],"r");
+		if(finit == NULL) {
+			printf("Cannot open %s\n",job->argv[3]);
+			usable = 0;
+		}
+		else {
+			fclose(finit);
+		}
+	}
+	if(usable) {
+		/*the model is measured with the number of clusters given, a file initialisation may change it*/
+		model.set = entry->set;
+		model.numClust = atoi(job->argv[5]);
+		modelOptions(job->argc,job->argv,&model,0);
+		model.pool = NULL;
+		if(run->threadsPerJob > 1) {
+			createPool(&pool,run->threadsPerJob);
+			model.pool = &pool;
+		}
+		job->memory = workspaceSize(&model);
 
+		/*a job always runs alone, whatever its size*/
+#ifndef EM_NO_THREADS
+		while(run->budget > 0 && run->running > 0 && run->reserved+job->memory > run->budget) {
+			pthread_cond_wait(&(run->changed),&(run->lock));
+		}
+#endif
+		run->reserved += job->memory;
+		run->running++;
+#ifndef EM_NO_THREADS
+		pthread_mutex_unlock(&(run->lock));
+#endif
 
+		makeFolder(job->argv[6]);
+		logFile = emMalloc(snprintf(NULL, 0, "%s/%s.log", job->argv[6], job->argv[7]) + 1);
+		sprintf(logFile, "%s/%s.log", job->argv[6], job->argv[7]);
+		log = fopen(logFile,"w");
+		if(log == NULL) {
+			printf("Cannot write %s\n",logFile);
+			log = stdout;
+		}
+		seed = (unsigned)time(NULL);
+		if(optionValue(job->argc,job->argv,"seed") != NULL) {
+			seed = (unsigned)strtoul(optionValue(job->argc,job->argv,"seed"),NULL,10);
+		}
 
+		printf("Fitting %s/%s\n",job->argv[6],job->argv[7]);
+		start = wallClock();
+		job->iterations = runModel(job->argc,job->argv,entry->set,model.pool,seed,log,&(job->likelihood));
+		job->wallTime = wallClock()-start;
+		job->status = 0;
+		printf("Done %s/%s : %d iterations, likelihood %e, %.3f s\n",job->argv[6],job->argv[7],job->iterations,job->likelihood,job->wallTime);
 
-/**********************************END Defining nethods*****************************************/
-/*******************************************************************************************/
-/**********************************Result analysis functions*****************************************/
+		if(log != stdout) {
+			fclose(log);
+		}
+		free(logFile);
+		if(model.pool != NULL) {
+			destroyPool(model.pool);
+		}
 
-/*Outputs he clustering results*/
-void outputCSV(char * out, classif * myClassif) {
-	int i;
-	FILE * file;	
+#ifndef EM_NO_THREADS
+		pthread_mutex_lock(&(run->lock));
+#endif
+		run->reserved -= job->memory;
+		run->running--;
+	}
+	else {
+		printf("Job %s/%s failed\n",job->argv[6],job->argv[7]);
+	}
 
-	file = fopen(out,"w");
-	for(i = 0;i<myClassif->set.num;i++) {
-		fprintf(file,"%d\n",myClassif->clust[i]);
+	/*the last job of a dataset releases it*/
+	if(--(entry->users) == 0 && entry->state == 2) {
+		freeDataset(&(entry->set),0);
+		run->reserved -= entry->bytes;
+		entry->state = 0;
 	}
-	fclose(file);
+#ifndef EM_NO_THREADS
+	pthread_cond_broadcast(&(run->changed));
+	pthread_mutex_unlock(&(run->lock));
+#endif
 }
 
-/*Outputs the final values for the theta parameters*/
-void outputThetas(char * out,classif * myClassif) {
-	int i,k;
-	FILE * file;	
+/*Worker of a batch run, fitting jobs until none is left*/
+static void batchWorker(threadTask * task/*I*/) {
+	batchRun * run = (batchRun *)task->data;
+	int job;
 
-	file = fopen(out,"w");
-	for(k = 0;k<myClassif->numClust;k++) {
-		for(i = 1;i<myClassif->set.length;i++) {
-			fprintf(file,"%f\t",myClassif->parameters.theta[k][i]);
-		}
-		fprintf(file,"\n");
+	while((job = nextBatchJob(run,task->thread)) >= 0) {
+		runBatchJob(run,&(run->jobs[job]));
 	}
-	fclose(file);
 }
 
+/*Runs the jobs of a batch on numWorkers workers
+*
+*Jobs are dealt in manifest order over one queue per worker, a worker with an empty queue steals the last job of the longest one
+*A job waits while the loaded datasets and the running models would exceed the budget, unless no other job runs,
+*the loading of a dataset too, unless no other job runs and no other dataset is being loaded
+*/
+void runBatch(batchRun * run/*I\O*/,int numWorkers/*I*/,int threadsPerJob/*I*/,size_t budget/*I*/) {
+	int j,w;
 
-/*Outputs EM summary for further analysis*/
-void outputEMSummary(char * out,classif * myClassif,int numIter) {
-	double likely;
-	FILE * file;	
+#ifdef EM_NO_THREADS
+	numWorkers = 1;
+#endif
+#ifdef USE_MPI
+	/*the reductions of a fit are collective calls of the main thread*/
+	numWorkers = 1;
+#endif
+	if(numWorkers < 1) {
+		numWorkers = 1;
+	}
+	if(numWorkers > run->numJobs) {
+		numWorkers = run->numJobs > 0 ? run->numJobs : 1;
+	}
+	run->numWorkers = numWorkers;
+	run->threadsPerJob = threadsPerJob;
+	run->budget = budget;
+	run->reserved = 0;
+	run->running = 0;
+	run->loading = 0;
+	run->queues = (int *)emMalloc(sizeof(int)*(numWorkers*run->numJobs+1));
+	run->queueHead = (int *)emMalloc(sizeof(int)*numWorkers);
+	run->queueTail = (int *)emMalloc(sizeof(int)*numWorkers);
+	if (run->queues == NULL || run->queueHead == NULL || run->queueTail == NULL) {
+		printf("Out of memory batch\n");
+		exit(-1);
+	}
+	for(w=0;w<numWorkers;w++) {
+		run->queueHead[w] = 0;
+		run->queueTail[w] = 0;
+	}
+	for(j=0;j<run->numJobs;j++) {
+		w = j%numWorkers;
+		run->queues[w*run->numJobs+run->queueTail[w]++] = j;
+	}
+#ifndef EM_NO_THREADS
+	pthread_mutex_init(&(run->lock),NULL);
+	pthread_cond_init(&(run->changed),NULL);
+#endif
 
-	file = fopen(out,"w");
-	likely = computeFullExpectation(myClassif);
-	fprintf(file,"numClust\t%d\n",myClassif->numClust);
-	fprintf(file,"likelihood\t%e\n",likely);
-	fprintf(file,"Iterations\t%d\n",numIter);
-	fclose(file);
-} 
+	runThreads(numWorkers,batchWorker,run);
 
+#ifndef EM_NO_THREADS
+	pthread_mutex_destroy(&(run->lock));
+	pthread_cond_destroy(&(run->changed));
+#endif
+	free(run->queues);
+	free(run->queueHead);
+	free(run->queueTail);
+}
 
-/*Outputs EM summary for each cluster*/
-void outputClustSummary(char * out,classif * myClassif) {
+/*Writes the batch report, one tab separated line per job and the wall time of the whole batch*/
+void outputBatchReport(char * out/*I*/,batchRun * run/*I*/,double wallTime/*I*/) {
 	FILE * file;
-	int k;	
+	batchJob * job;
+	int j;
 
 	file = fopen(out,"w");
-	
-	/*Outputing header*/
-	fprintf(file,"\t");
-	for(k=0;k<myClassif->numClust;k++) {
-		fprintf(file,"cluster_%d\t",(k+1));
-	}
-	fprintf(file,"\n");
-	
-	/*Outputing betas*/
-	fprintf(file,"beta");
-	for(k=0;k<myClassif->numClust;k++) {
-		fprintf(file,"\t%f",myClassif->beta[k]);
+	if(file == NULL) {
+		printf("Cannot write %s\n",out);
+		return;
 	}
-	fprintf(file,"\n");
-	
-	/*Outputing num per clust*/
-	fprintf(file,"numCells");
-	for(k=1;k<=myClassif->numClust;k++) {
-		fprintf(file,"\t%d",numCellsClust(k,myClassif));
+	fprintf(file,"job\tdata\tK\tbeta\tinit\toutput\tstatus\titerations\tlikelihood\twallTime\tmemoryMB\n");
+	for(j=0;j<run->numJobs;j++) {
+		job = &(run->jobs[j]);
+		fprintf(file,"%d\t%s\t%s\t%s\t%s\t%s/%s\t%s\t%d\t%e\t%.3f\t%.1f\n",j+1,job->argv[1],job->argv[5],job->argv[4],job->argv[3],job->argv[6],job->argv[7],
+			job->status == 0 ? "done" : "failed",job->iterations,job->likelihood,job->wallTime,(double)job->memory/1048576.0);
 	}
-	fprintf(file,"\n");
-	
-	
+	fprintf(file,"total\t\t\t\t\t\t\t\t\t%.3f\t\n",wallTime);
 	fclose(file);
 }
 
+/**********************************END Model runs*****************************************/
 
-
-/**********************************END Result analysis functions*****************************************/
-/*******************************************************************************************/
 /**********************************START MAIN Function*****************************************/
 
+/*Returns the value of a "name=value" optional command line argument, NULL if absent*/
+char * optionValue(int argc, char * argv[], char * name) {
+	/*optional arguments come after the 8 mandatory ones*/
+	return optionFrom(argc,argv,9,name);
+}
+
+/*Value of a name=value optional argument placed from argv[first], NULL if absent*/
+char * optionFrom(int argc, char * argv[], int first, char * name) {
+	int i;
+	size_t length = strlen(name);
+
+	for(i=first;i<argc;i++) {
+		if(strncmp(argv[i],name,length) == 0 && argv[i][length] == '=') {
+			return argv[i]+length+1;
+		}
+	}
+	return NULL;
+}
+
+/*Returns 1 if the optional command line argument is present, 0 otherwise*/
+int hasOption(int argc, char * argv[], char * name) {
+	int i;
+	for(i=9;i<argc;i++) {
+		if(strncmp(argv[i],name,100) == 0) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
 /*Kill handling function*/
 void killHandle (int sig) {
 	printf("Program interrupted...exiting\n");
@@ -802,25 +5698,41 @@ int main(int argc, char* argv[]) {
 	/* File handles  and names*/
 	FILE *fbinarized;
 	FILE *fnei;
-	FILE *finit;
-	char * summaryFile;
-	char * clustFile;
-	char * csvFile;
-	char * thetaFile;
+	FILE *fmanifest;
 	
 	/*Dataset variable*/
 	dataSet fullData;
 	
-	/*Classification object*/
-	classif clusters;
-	
-	int j=1,k;
-	int hasConverged;
-	int convergeLimit;
-	int limitIter = 100;
-
-	mode_t process_mask;
-	int type_beta=0;
+	double likelihood;
+	/*Graph building and parallel loops*/
+	int numThreads,knn,numPoints;
+	double radius;
+	int * graphStart;
+	int * graphAdj;
+	threadPool pool;
+	threadPool * fitPool;
+	/*Batch runs*/
+	batchRun batch;
+	int numJobs,threadsPerJob,j;
+	double batchStart;
+
+	unsigned seed;
+	int status=1;
+	/*Regression checks*/
+	regressionLimits limits;
+	double loadStart;
+	FILE * profile;
+#ifdef USE_MPI
+	int numProcs;
+	FILE *fcoords = NULL;
+
+	MPI_Init(&argc,&argv);
+	MPI_Comm_size(MPI_COMM_WORLD,&numProcs);
+	/*only the main process prints*/
+	if(!isMainProcess()) {
+		freopen("/dev/null","w",stdout);
+	}
+#endif
 
 
 #ifdef linux
@@ -832,120 +5744,188 @@ int main(int argc, char* argv[]) {
 	
 	/* Start*/
 	/*checking command*/
-	if(argc < 7) {
-		printf("Wrong command, syntax is : [path to data_file] [path neighbouring file] ['rand' | path to initialisation file] [initial value for beta] [number of clusters K] [result folder] [outputFileName] [number of clusters changed from one iteration to the next to assume convergence] {'fixed' (if present, beta will be fixed to initial value instead of being estimated)}\n");
+	if(argc == 4 && strncmp(argv[1],"compare",100) == 0) {
+		/*validation report of a run against a reference one*/
+		compareRuns(argv[2],argv[3],stdout);
+		status = 0;
+	}
+	else if(argc >= 5 && strncmp(argv[1],"graph",100) == 0) {
+		/*neighbouring file built from a coordinates file*/
+		numThreads = optionFrom(argc,argv,4,"threads") != NULL ? atoi(optionFrom(argc,argv,4,"threads")) : defaultThreads();
+		radius = optionFrom(argc,argv,4,"radius") != NULL ? atof(optionFrom(argc,argv,4,"radius")) : 0;
+		knn = optionFrom(argc,argv,4,"knn") != NULL ? atoi(optionFrom(argc,argv,4,"knn")) : 0;
+		if(radius <= 0 && knn <= 0) {
+			printf("Wrong command, syntax is : graph [path to coordinates file] [path to neighbouring file to write] {radius=r | knn=k} {threads=n}\n");
+		}
+		else {
+			numPoints = load_graph_input(argv[2],radius,knn,numThreads,&graphStart,&graphAdj);
+			fnei = fopen(argv[3],"w");
+			outputGraph(fnei,numPoints,graphStart,graphAdj);
+			fclose(fnei);
+			free(graphStart);
+			free(graphAdj);
+			status = 0;
+		}
+	}
+	else if(argc == 7 && strncmp(argv[1],"synthetic",100) == 0) {
+		/*dataset of known regions for regression runs*/
+		writeSynthetic(argv[2],argv[3],atoi(argv[4]),atoi(argv[5]),strtoul(argv[6],NULL,10));
+		status = 0;
+	}
+	else if(argc >= 5 && strncmp(argv[1],"regress",100) == 0) {
+		/*runs of a profile checked against golden ones*/
+		limits.minAdjustedRand = optionFrom(argc,argv,5,"ari") != NULL ? atof(optionFrom(argc,argv,5,"ari")) : 0.999;
+		limits.maxLikelihood = optionFrom(argc,argv,5,"likelihood") != NULL ? atof(optionFrom(argc,argv,5,"likelihood")) : 1e-6;
+		limits.maxTheta = optionFrom(argc,argv,5,"theta") != NULL ? atof(optionFrom(argc,argv,5,"theta")) : 1e-4;
+		limits.maxSlowdown = optionFrom(argc,argv,5,"slowdown") != NULL ? atof(optionFrom(argc,argv,5,"slowdown")) : 1.5;
+		limits.timeSlack = optionFrom(argc,argv,5,"timeslack") != NULL ? atof(optionFrom(argc,argv,5,"timeslack")) : 0.25;
+		limits.maxMemory = optionFrom(argc,argv,5,"memory") != NULL ? atof(optionFrom(argc,argv,5,"memory")) : 1.2;
+		limits.memorySlack = optionFrom(argc,argv,5,"memoryslack") != NULL ? atof(optionFrom(argc,argv,5,"memoryslack")) : 8;
+		status = checkRegression(argv[2],argv[3],argv[4],&limits) > 0;
+	}
+	else if(argc >= 5 && strncmp(argv[1],"batch",100) == 0) {
+		/*fits of a manifest sharing the neighbouring graph*/
+		threadsPerJob = optionFrom(argc,argv,5,"threads") != NULL ? atoi(optionFrom(argc,argv,5,"threads")) : 1;
+		if(threadsPerJob < 1) {
+			threadsPerJob = 1;
+		}
+		numJobs = optionFrom(argc,argv,5,"jobs") != NULL ? atoi(optionFrom(argc,argv,5,"jobs")) : defaultThreads()/threadsPerJob;
+		radius = optionFrom(argc,argv,5,"radius") != NULL ? atof(optionFrom(argc,argv,5,"radius")) : 0;
+		knn = optionFrom(argc,argv,5,"knn") != NULL ? atoi(optionFrom(argc,argv,5,"knn")) : 0;
+		fmanifest = fopen(argv[3],"r");
+#ifdef USE_MPI
+		if(numProcs > 1) {
+			printf("Batch runs use a single process\n");
+		}
+		else
+#endif
+		if(fmanifest == NULL) {
+			printf("Cannot open %s\n",argv[3]);
+		}
+		else {
+			load_manifest(fmanifest,argv[0],argv[2],&batch);
+			batch.numPoints = load_graph_input(argv[2],radius,knn,defaultThreads(),&(batch.graphStart),&(batch.graphAdj));
+			batchStart = wallClock();
+			runBatch(&batch,numJobs,threadsPerJob,optionFrom(argc,argv,5,"memory") != NULL ? (size_t)(atof(optionFrom(argc,argv,5,"memory"))*1048576.0) : 0);
+			outputBatchReport(argv[4],&batch,wallClock()-batchStart);
+			printf("%d jobs run in %.3f s, report written to %s\n",batch.numJobs,wallClock()-batchStart,argv[4]);
+
+			/*failed jobs make the batch fail*/
+			status = 0;
+			for(j=0;j<batch.numJobs;j++) {
+				if(batch.jobs[j].status != 0) {
+					status = 1;
+				}
+			}
+			free(batch.graphStart);
+			free(batch.graphAdj);
+			freeManifest(&batch);
+		}
+		if(fmanifest != NULL) {
+			fclose(fmanifest);
+		}
+	}
+	else if(argc < 9) {
+		printf("Wrong command, syntax is : [path to data_file] [path neighbouring file] ['rand' | 'kmeans' | 'grow' (k-means++ seeds, grown over the graph) | path to initialisation file | warm=previous result folder/outputFileName] [initial value for beta] [number of clusters K] [result folder] [outputFileName] [number of clusters changed from one iteration to the next to assume convergence]\n");
+		printf("Model options : {'fixed' (if present, beta will be fixed to initial value instead of being estimated)} {seed=N (random initialisation seed)} {sparse=m (keep only the m largest posteriors of each cell)} {tolerance=x (also converge when the relative likelihood change is below x)} {estep=meanfield|icm|gibbs (E step engine, the hard engines keep one label per cell)}\n");
+		printf("Graph and parallel options : {radius=r | knn=k (the neighbouring file is a coordinates file, the graph is built from it)} {threads=n} {partition=path to coordinates file (spatial partition of MPI runs)}\n");
+		printf("Output options : {npy (also write labels, posteriors, thetas and betas as .npy files)} {snapshots=n (write them every n iterations)} {profile=file (append the wall time and peak memory of each phase)}\n");
+		printf("Beta path options : {betas=b1,b2,... | betas=start:end:step (fixed beta path, each fit starting from the previous one)} {segments=n (independent segments of the path run side by side)}\n");
+		printf("Neighbouring file from coordinates : graph [path to coordinates file] [path to neighbouring file to write] {radius=r | knn=k} {threads=n}\n");
+		printf("Batch of runs : batch [path neighbouring file] [path to manifest] [report file to write] {jobs=n (runs at the same time)} {threads=n (threads of each run)} {memory=MB (memory budget of the running jobs)} {radius=r | knn=k}\n");
+		printf("Synthetic dataset : synthetic [path to coordinates file | number of points] [output prefix] [number of genes] [number of regions] [seed]\n");
+		printf("Regression check : regress [golden folder] [result folder] [report file to write] {ari=x} {likelihood=x} {theta=x} {slowdown=x} {timeslack=s} {memory=x} {memoryslack=MB}\n");
 	}
 	else {
 	
+		/*Neighbouring graph built from coordinates instead of read*/
+		numThreads = optionValue(argc,argv,"threads") != NULL ? atoi(optionValue(argc,argv,"threads")) : defaultThreads();
+#ifdef USE_MPI
+		/*processes usually share the processors of a node*/
+		if(numProcs > 1 && optionValue(argc,argv,"threads") == NULL) {
+			numThreads = 1;
+		}
+#endif
+		radius = optionValue(argc,argv,"radius") != NULL ? atof(optionValue(argc,argv,"radius")) : 0;
+		knn = optionValue(argc,argv,"knn") != NULL ? atoi(optionValue(argc,argv,"knn")) : 0;
+
+		loadStart = wallClock();
+		/*Random initialisation seed, a distributed run uses the one of the main process*/
+		seed = (unsigned)time(NULL);
+		if(optionValue(argc,argv,"seed") != NULL) {
+			seed = (unsigned)strtoul(optionValue(argc,argv,"seed"),NULL,10);
+		}
 
-		/*Set required parameters*/
-		hasConverged=atoi(argv[8])+1;
-		convergeLimit=atoi(argv[8]);
-
+#ifdef USE_MPI
+		MPI_Bcast(&seed,1,MPI_UNSIGNED,0,MPI_COMM_WORLD);
+		if(numProcs > 1) {
+			/* partition the graph and load the owned points with their neighbours */
+			fbinarized = fopen(argv[1],"r");
+			numPoints = load_graph_input(argv[2],radius,knn,numThreads,&graphStart,&graphAdj);
+			if(optionValue(argc,argv,"partition") != NULL) {
+				fcoords = fopen(optionValue(argc,argv,"partition"),"r");
+			}
+			load_distributed(fbinarized,numPoints,graphStart,graphAdj,fcoords,&fullData);
+			fclose(fbinarized);
+			if(fcoords != NULL) {
+				fclose(fcoords);
+			}
+		}
+		else
+#endif
+		{
 		/* open and load data file */
 		fbinarized = fopen(argv[1],"r");
 		load_data(fbinarized,&fullData);
 		fclose(fbinarized);
 
 		/* open and load spatial info */
-		fnei = fopen(argv[2],"r");
-		load_nei(fnei,&fullData);
-		fclose(fnei);
-
-		/* Data is loaded and stored */
-
-		printf("Starting initialisation\n");
-		/* INITIALIZATION STEP */
-		if(strncmp(argv[3],"rand",100) == 0){
-			printf("Random Initialisation\n");
-			initClassifRand(fullData,atoi(argv[5]),&clusters,atof(argv[4]));
+		if(radius > 0 || knn > 0) {
+			numPoints = load_graph_input(argv[2],radius,knn,numThreads,&graphStart,&graphAdj);
+			setNeighbours(&fullData,numPoints,graphStart,graphAdj,0);
+			free(graphStart);
+			free(graphAdj);
 		}
-		else{
-			finit = fopen(argv[3],"r");
-			printf("Initialisation from file : %s\n",argv[3]);
-			initClassifFile(fullData,finit,&clusters,atof(argv[4]));
-			fclose(finit);
+		else {
+			fnei = fopen(argv[2],"r");
+			load_nei(fnei,&fullData);
+			fclose(fnei);
 		}
-
-		/*detecting beta type*/
-		if(argv[9] != NULL && strncmp(argv[9],"fixed",100) == 0){
-			type_beta = 1;
 		}
 
-		/*Initializing output*/
-		#if defined(linux) || defined(__APPLE__)
-		process_mask = umask(0);
-		mkdir(argv[6], S_IRWXU | S_IRWXG | S_IRWXO);
-		umask(process_mask);
-		#endif
-		#if defined(_WIN32)
-		_mkdir(argv[6]);
-		#endif
-		
-		
-
-		printf("Initialisation done.\n");
-		/* END INITIALIZATION */
-		printf("\n");
-		printf("\n");
-
-
-		/* WHILE not converged*/
-		printf("Starting EM process\n");
-		while(hasConverged > convergeLimit && limitIter-->=0){
-
-			/* E-Step */
-			printf("\tE Step, estimating\n");
-			hasConverged =eStep(&clusters);
-
-			/* Compute thetas based on random classification */
-			printf("\tM Step, maximazing parameters\n");
-			mStep(&clusters,type_beta);
-
-			printf("\tCurrent beta values :");
-			for(k=0;k<clusters.numClust;k++) {
-				printf(" %f",clusters.beta[k]);
-			}
-			printf("\n");
-
-			printf("\tClusters changed : %d\n\tCurrent Likelihood :%e\n",hasConverged,computeFullLogLikelihood(&clusters));
-
-
-			if(hasConverged <= convergeLimit) {
-				printf("Converges !");
+		/* Data is loaded and stored */
+		if(optionValue(argc,argv,"profile") != NULL) {
+			profile = openProfile(optionValue(argc,argv,"profile"));
+			recordPhase(profile,argv[7],"load",loadStart);
+			recordCalibration(profile,argv[7]);
+			if(profile != NULL) {
+				fclose(profile);
 			}
-			printf("\n\n");
-			j++;
 		}
-		printf("Creating output\n");
-
-
-
-		/*Outputing results*/
-
-		summaryFile = malloc(snprintf(NULL, 0, "%s/%s.summary", argv[6], argv[7]) + 9);
-		sprintf(summaryFile, "%s/%s.summary", argv[6], argv[7]);
-		outputEMSummary(summaryFile,&clusters,j);
 
+		/*Threads of the parallel loops*/
+		fitPool = NULL;
+		if(numThreads > 1) {
+			createPool(&pool,numThreads);
+			fitPool = &pool;
+		}
 
-		csvFile = malloc(snprintf(NULL, 0, "%s/%s.csv", argv[6], argv[7]) + 5);
-		sprintf(csvFile, "%s/%s.csv", argv[6], argv[7]);
-		outputCSV(csvFile,&clusters);
+		runModel(argc,argv,fullData,fitPool,seed,stdout,&likelihood);
 
-		thetaFile = malloc(snprintf(NULL, 0, "%s/%s.theta", argv[6], argv[7]) + 7);
-		sprintf(thetaFile, "%s/%s.theta", argv[6], argv[7]);
-		outputThetas(thetaFile,&clusters);
-		
-		
-		clustFile = malloc(snprintf(NULL, 0, "%s/%s.clust", argv[6], argv[7]) + 7);
-		sprintf(clustFile,"%s/%s.clust", argv[6], argv[7]);
-		outputClustSummary(clustFile,&clusters);
+		if(fitPool != NULL) {
+			destroyPool(fitPool);
+		}
 
+		/*mpirun reports any process that does not exit with 0*/
+		status = 0;
 	}
 
 
+#ifdef USE_MPI
+	MPI_Finalize();
+#endif
 
-	return 1;
+	return status;
 	
 }
 /**********************************END MAIN and END File*****************************************/
@@ -14,14 +14,45 @@
 #define LG_LIG_MAX 1000000
 #define LG_GENES_MAX 1000
 #define LG_NEI_MAX 200
+#define MAX_KERNEL_CLUST 32 /*largest number of clusters with specialised kernels*/
+#define MAX_KERNEL_WORDS 4 /*largest number of expression words with specialised kernels*/
+#define SPARSE_LOG_CUTOFF -30.0 /*sparse posteriors below exp(-30) times the largest one are not computed*/
+#define SPARSE_TAIL_TOLERANCE 1e-6 /*relative error allowed on the mass of the clusters left out of the sparse candidates, all the clusters are scored beyond*/
+#define ARENA_ALIGN 64 /*alignment in bytes of the blocks of a workspace arena*/
+#define BETA_BLOCK 1024 /*cells per block of the beta objective reductions*/
+#define BETA_TO_ZERO 2 /*move of a beta set to 0 by the gradient ascent*/
+#define E_STEP_MEAN_FIELD 0 /*E step engines: mean field posteriors then argmax*/
+#define E_STEP_ICM 1 /*most likely label given the neighbour labels*/
+#define E_STEP_GIBBS 2 /*label sampled given the neighbour labels*/
+#define HARD_SWEEPS 3 /*sweeps of an ICM or Gibbs E step, as many as the mean field one*/
 #include <stdio.h>
 #include <time.h>
 #include <math.h>
 #include <sys/stat.h>
 #include <string.h>
 #include <stdlib.h>
+#include <limits.h>
 #ifdef linux
 #include <sys/signal.h>
+#include <sys/resource.h>
+#endif
+#ifdef USE_MPI
+#include <mpi.h>
+#endif
+#ifndef EM_NO_THREADS
+#include <pthread.h>
+#include <unistd.h>
+#endif
+
+#define BITS_PER_WORD ((int)(sizeof(unsigned long)*CHAR_BIT))
+
+/*Storage type of the posteriors and cell densities
+*Compiled with -DEM_SINGLE (make single) they are stored in single precision, halving the memory traffic of the E step, while every sum is still accumulated in double precision
+*/
+#ifdef EM_SINGLE
+typedef float emReal;
+#else
+typedef double emReal;
 #endif
 
 /****************************START Defining structures***********************************/
@@ -33,16 +64,130 @@
 	/*Data point expression values and properties*/
 	typedef struct {
 		int * expVect; /* expression vector*/
+		unsigned long * bits; /* expression vector without the cell ID, packed in numWords words*/
 		int * nei; /*Indexes of neighbours in dataSet*/
 		int numNei; /*Number of neighbours*/
 	} dataPoint;
 
+	/*Communication plan of a distributed run
+	*Halo points (neighbours owned by another process) are stored after the owned points, grouped by owner
+	*/
+	typedef struct {
+		int numProcs; /*number of processes*/
+		int rank; /*rank of this process*/
+		int * globalToLocal; /*local index of each point of the full dataset, -1 if not stored here*/
+		int * sendCount; /*number of owned points sent to each process*/
+		int * sendDispl; /*offsets in sendIdx for each process*/
+		int * sendIdx; /*local indexes of the owned points to send*/
+		int * recvCount; /*number of halo points received from each process*/
+		int * recvDispl; /*offsets of the halo points of each process (from the first halo point)*/
+		int numSend; /*total number of points sent*/
+		int numRecv; /*total number of halo points*/
+		double * sendBuf; /*packing buffers, grown on demand*/
+		double * recvBuf;
+		int bufSize; /*number of values per point the buffers can hold*/
+#ifdef USE_MPI
+		MPI_Request * requests;
+#endif
+	} haloPlan;
+
 	typedef struct {
 		dataPoint * obs; /*observation x*/
-		int num; /*number of Points*/
+		int num; /*number of Points stored (owned and halo)*/
+		int numOwned; /*number of Points updated by this process, stored first*/
+		int numGlobal; /*number of Points in the full dataset*/
+		int * globalId; /*line of each Point in the dataset file, NULL if all Points are stored in order*/
+		haloPlan * halo; /*NULL if the dataset is not distributed*/
 		int length; /*length of expression vectors*/
+		int numWords; /*number of words of the packed expression vectors*/
+		int numProfiles; /*number of distinct expression vectors among the owned Points*/
+		int * profile; /*index of the expression profile of each Point*/
+		int * profileCell; /*first Point having each profile*/
+		int * profileCount; /*number of owned Points having each profile*/
+		int maxNei; /*largest number of neighbours of a Point*/
 	} dataSet;
 
+	/*One thread of runThreads or of a pool*/
+	typedef struct threadTask {
+		int thread; /*index of the thread, from 0*/
+		int numThreads;
+		void (*work)(struct threadTask *); /*function run by every thread*/
+		void * data; /*shared by all the threads*/
+		void * pool; /*pool of the thread, NULL for runThreads*/
+	} threadTask;
+
+	/*Threads kept waiting between parallel loops, so that running one does not allocate*/
+	typedef struct {
+		int numThreads; /*including the thread calling runPool*/
+		threadTask * tasks;
+		int generation; /*number of loops started*/
+		int remaining; /*workers still running the current loop*/
+		int stop;
+#ifndef EM_NO_THREADS
+		pthread_t * threads;
+		pthread_mutex_t lock;
+		pthread_cond_t start;
+		pthread_cond_t done;
+#endif
+	} threadPool;
+
+	/*Uniform grid of cells binning 3D points*/
+	typedef struct {
+		double * coords; /*x,y,z of each point*/
+		int num; /*number of points*/
+		double origin[3]; /*lowest corner*/
+		double cellSize; /*edge of the cubic cells*/
+		int dims[3]; /*number of cells along each axis*/
+		int numCells;
+		int * cellStart; /*offsets in cellPoints of each cell*/
+		int * cellPoints; /*points sorted by cell*/
+		int * pointCell; /*cell of each point*/
+		double * cellCoords; /*coordinates of the points sorted by cell*/
+	} neighbourGrid;
+
+	/*Copy of the model written as .npy files, points in the dataset order*/
+	typedef struct {
+		int iteration; /*-1 for the final outputs*/
+		int * labels; /*label of each point*/
+		emReal * posteriors; /*numPoints*numClust posteriors, one row per point*/
+		double * theta; /*numClust*numGenes thetas*/
+		double * beta; /*numClust betas*/
+	} modelSnapshot;
+
+	/*Writer of the binary outputs, snapshots are only stored on the main process*/
+	typedef struct {
+		char * prefix; /*result folder/outputFileName*/
+		char * path; /*name of the file being written*/
+		int numPoints;
+		int numClust;
+		int numGenes;
+		int background; /*1 if a thread writes the snapshots*/
+		modelSnapshot slots[2]; /*buffers, a second one only in the background*/
+		int numSlots;
+		int writing; /*slot being written, -1 if none*/
+		int pending; /*slot waiting to be written, -1 if none*/
+		int stop; /*1 once the thread must stop after the pending slot*/
+		int dropped; /*number of snapshots skipped because the previous one was still waiting*/
+		FILE * log; /*log of the model, where dropped snapshots are reported*/
+		double * gatherBuf; /*distributed runs: label and posteriors of each owned point*/
+		double * gatheredBuf; /*same for all the points on the main process, in gathering order*/
+		int * gatherCounts; /*values gathered from each process*/
+		int * gatherDispls;
+		int * gatherIds; /*dataset line of each gathered point*/
+#ifndef EM_NO_THREADS
+		pthread_t thread;
+		pthread_mutex_t lock;
+		pthread_cond_t ready; /*a slot is pending or the thread must stop*/
+		pthread_cond_t freed; /*a slot was written*/
+#endif
+	} snapshotWriter;
+
+	/*Block of memory from which the buffers of a model are carved*/
+	typedef struct {
+		char * base; /*NULL while only measuring*/
+		size_t size; /*bytes available*/
+		size_t used; /*bytes given out*/
+	} arena;
 
 	
 	/*Classification Z*/
@@ -51,13 +196,183 @@
 		params parameters;
 		dataSet set;
 		int numClust;
-		double ** tihm;
-		double ** cellDensities;
+		emReal ** tihm; /*k*n posteriors, NULL if sparse*/
+		int sparseM; /*number of posteriors kept per cell, 0 to keep all of them*/
+		int * topClust; /*n*sparseM clusters (from 0) of the kept posteriors in decreasing order, -1 if unused*/
+		emReal * topTihm; /*n*sparseM kept posteriors*/
+		emReal * residual; /*per cell mass of the clusters not kept*/
+		int sparsePruned; /*1 when the sparse sweeps only score candidate clusters, K being larger than the sparseM*(maxNei+1) clusters a cell can name*/
+		int * profileTopClust; /*numProfiles*sparseM clusters of the largest densities of each profile in decreasing order, -1 if unused*/
+		double * profileDensityMax; /*largest density of each profile*/
+		double * profileDensitySum; /*sum over the clusters of exp(density-largest) of each profile*/
+		double * profileDensityTotal; /*sum of the non null densities of each profile*/
+		int * candidates; /*clusters scored for one cell by the sparse sweeps*/
+		char * candidateMark; /*k flags of the candidates of one cell, kept at 0 between cells*/
+		double sparseBetaMin; /*smallest beta, given to the clusters left out of the candidates*/
+		double sparseBetaMax; /*largest beta, bounding the error made on the clusters left out*/
+		emReal ** cellDensities; /*k*numProfiles densities of each distinct expression profile*/
 		double likelihood;
 		double fullLikelihood;
 		double * beta; /*smoothness param */
+		double * expBetaTable; /*k*(maxNei+1) values of exp(beta_k*c)*/
+		double * expBetaTableBeta; /*beta each row of the table was built for*/
+		int * neiCount; /*per cluster count of the neighbours of one cell, kept at 0 between cells*/
+		int kernelK; /*number of clusters of the specialised kernels, 0 for the generic ones*/
+		int kernelWords; /*number of expression words of the specialised density kernel, 0 for the generic one*/
+		double * logThetaTable; /*log(1-theta) and log(theta) of each gene bit, 2*numWords*BITS_PER_WORD rows of numClust values*/
+		double * densityAcc; /*numClust accumulators of the generic density kernel*/
+		int * profileClust; /*k*numProfiles number of owned cells of each cluster having each profile*/
+		int thetaStatsValid; /*1 if profileClust was counted on the current labels by the last E step*/
+		double densityLogLike; /*density part of the log likelihood of the owned cells counted by the last E step*/
+		int densityLogLikeValid; /*1 while densityLogLike matches the current labels and densities*/
+		int * bestClust; /*labels of the best random init*/
+		double * thetaCounts; /*k*length expression counts of maxThetas*/
+		int * classCounts; /*k cell counts of noEmptyClass*/
+		double * sweepScratch; /*2*k per cell values of the E step sweeps*/
+		double * cellPotts; /*cached log Potts conditional probability of each owned cell*/
+		char * pottsStale; /*1 for the owned cells whose cellPotts must be recomputed*/
+		int * staleCells; /*list of the stale cells*/
+		int numStale;
+		int * boundaryCells; /*owned cells with a neighbour owned by another process, recomputed at every refresh*/
+		int numBoundary;
+		double * pottsBeta; /*betas cellPotts was computed with*/
+		int pottsValid; /*0 when every cellPotts must be recomputed*/
+		double pottsLogLike; /*sum of cellPotts*/
+		double expectation; /*last value of computeFullExpectation*/
+		int expectationValid; /*1 while expectation matches the posteriors, densities, labels and betas*/
+		threadPool * pool; /*threads of the parallel loops, NULL to run them on the calling thread*/
+		int numBetaBlocks; /*blocks of BETA_BLOCK owned cells*/
+		double * betaPartials; /*numBetaBlocks*(2k+1) partial sums of betaObjective*/
+		double * betaTotals; /*2k+1 totals of betaObjective*/
+		double * betaProbeTable; /*exp(step*c) then exp(-step*c), c in 0..maxNei*/
+		double betaStep; /*step of the probes, a beta not above it being probed down to 0*/
+		int * betaActive; /*k flags of the betas still moving*/
+		int * betaMove; /*k last moves: -1, 0, 1 or BETA_TO_ZERO*/
+		double * betaPrevious; /*k betas before the last moves*/
+		double * betaGain; /*k expected likelihood gains of the last moves*/
+		int * threadNeiCount; /*k per thread neighbour counts, kept at 0*/
+		int * threadPresent; /*maxNei+1 per thread clusters around a cell*/
+		int engine; /*E_STEP_MEAN_FIELD, E_STEP_ICM or E_STEP_GIBBS, the last two keeping one posterior per cell (the label)*/
+		unsigned long rngSeed; /*seed of the counter based generator of the Gibbs engine*/
+		unsigned long sweepCount; /*sweeps run by the hard engines, counter of the generator*/
+		int numColours; /*colours of the owned cells, no two neighbours sharing one (hard engines only)*/
+		int * colourStart; /*numColours+1 offsets in colourCells*/
+		int * colourCells; /*owned cells grouped by colour*/
+		int * cellColour; /*colour of each owned cell*/
+		int currentColour; /*colour being swept by the threads*/
+		double * threadScores; /*k per thread label scores of the hard engines*/
+		char * initName; /*initialisation of the fit (rand, kmeans, grow, file or warm)*/
+		double initTime; /*seconds taken by the initialisation*/
+		FILE * profile; /*wall time and peak memory of each phase of the fit (profile=file), NULL if not recorded*/
+		arena workspace; /*memory holding all the buffers above*/
+		FILE * log; /*progress messages of the fit, stdout for a single run*/
 	} classif;
 
+	/*Differences between the outputs of two runs*/
+	typedef struct {
+		int numPoints;
+		double sameLabels; /*fraction of identical labels*/
+		double adjustedRandIndex;
+		double likelihoodReference;
+		double likelihoodCompared;
+		double likelihoodDifference; /*relative to the reference*/
+		double thetaDifference; /*largest absolute difference*/
+	} runComparison;
+
+	/*Wall time and peak memory at the end of a phase of a run, one line of a profile file*/
+	typedef struct {
+		char * name; /*outputFileName of the run*/
+		char * phase; /*load, init, em or output*/
+		double wallTime; /*seconds*/
+		double peakMemory; /*MB*/
+	} phaseRecord;
+
+	/*Tolerances of a regression check against golden runs*/
+	typedef struct {
+		double minAdjustedRand;
+		double maxLikelihood; /*relative difference*/
+		double maxTheta; /*absolute difference*/
+		double maxSlowdown; /*wall time of a phase over the golden one*/
+		double timeSlack; /*seconds allowed on top, short phases being noisy*/
+		double maxMemory; /*peak memory over the golden one*/
+		double memorySlack; /*MB allowed on top*/
+	} regressionLimits;
+
+	/*Data driven initialisation shared by the threads of its parallel loops*/
+	typedef struct {
+		classif * model;
+		unsigned long * centres; /*numClust*numWords packed expression vectors of the seeds*/
+		int numCentres; /*seeds drawn so far*/
+		int * minDist; /*Hamming distance of each profile to its nearest seed*/
+		int * nearest; /*nearest seed of each profile, from 0*/
+		int * seedLabel; /*label of each cell given by its nearest seed*/
+		int * next; /*labels of the owned cells after a growing round*/
+		int * threadChanged; /*cells labelled by each thread in a growing round*/
+		int * clustCount; /*cells of each cluster once grown*/
+	} seeding;
+
+	/*Fits of a fixed beta path, shared by the workers running its segments*/
+	typedef struct {
+		int argc;
+		char ** argv; /*arguments of the run*/
+		dataSet set;
+		threadPool * pool; /*threads of a path run as a single segment at a time*/
+		unsigned seed;
+		FILE * log;
+		double * betas; /*schedule*/
+		int numBetas;
+		int numSegments; /*contiguous parts of the schedule, each one started from the initialisation of the run*/
+		int * segment; /*segment of each beta, from 1*/
+		int * iterations; /*iterations of the fit of each beta*/
+		double * likelihoods; /*expected likelihood of each fit*/
+		double * wallTimes; /*seconds taken by each fit*/
+	} betaPath;
+
+	/*One fit of a batch run*/
+	typedef struct {
+		int argc;
+		char ** argv; /*arguments of the fit as on the command line, argv[2] being the neighbouring file*/
+		int dataset; /*entry of the dataset cache*/
+		size_t memory; /*bytes of the model reserved while the fit runs*/
+		int status; /*0 once fitted, 1 if it failed*/
+		int iterations;
+		double likelihood;
+		double wallTime; /*seconds taken by the fit*/
+	} batchJob;
+
+	/*Dataset shared by the jobs reading the same file, loaded by the first one to run and released after the last one*/
+	typedef struct {
+		char * path;
+		dataSet set;
+		int state; /*0 not loaded, 1 loading, 2 loaded, -1 unusable*/
+		int users; /*jobs not done with it*/
+		size_t bytes; /*memory held while loaded*/
+	} cachedDataset;
+
+	/*Jobs of a batch run, dealt over one queue per worker, idle workers stealing from the end of the longest queue*/
+	typedef struct {
+		batchJob * jobs;
+		int numJobs;
+		cachedDataset * datasets;
+		int numDatasets;
+		int numPoints; /*points of the shared neighbouring graph*/
+		int * graphStart;
+		int * graphAdj;
+		int numWorkers; /*jobs running at the same time*/
+		int threadsPerJob;
+		int * queues; /*numWorkers rows of numJobs job indexes*/
+		int * queueHead; /*next job of each queue, taken by its worker*/
+		int * queueTail; /*end of each queue, taken by the other workers*/
+		size_t budget; /*bytes the loaded datasets and running models may hold, 0 for no limit*/
+		size_t reserved; /*bytes held by the loaded datasets and running models*/
+		int running; /*jobs fitting*/
+		int loading; /*datasets being loaded*/
+#ifndef EM_NO_THREADS
+		pthread_mutex_t lock;
+		pthread_cond_t changed; /*a dataset was loaded or a job finished*/
+#endif
+	} batchRun;
+
 	
 
 /****************************END Defining structures***********************************/
@@ -71,9 +386,25 @@ int parse_vect(char * line, int * res);
 returns : void
 */
 void load_data(FILE * data /*I*/,dataSet * myData/*I\O*/);
+/*Releases a serial dataset, its neighbours only if ownNeighbours is set*/
+void freeDataset(dataSet * myData/*I\O*/,int ownNeighbours/*I*/);
+
+/*Packs the expression vectors in words of bits*/
+void packExpression(dataSet * myData/*I\O*/);
+
+/*Hash of a packed expression vector*/
+unsigned long hashProfile(unsigned long * bits/*I*/,int numWords/*I*/);
 
-/*Parses neighbouring files, first number is number of neighbours then indexes*/
-int parse_nei(char * line, int * res);
+/*Groups the owned points by distinct expression profile*/
+void dedupProfiles(dataSet * myData/*I\O*/);
+
+/*Reads a whole line, line (NULL at first) growing as needed
+returns its length, -1 at the end of the file*/
+int readLine(FILE * data/*I*/,char ** line/*I\O*/,int * size/*I\O*/);
+
+/*Parses a line of a neighbouring file, number of neighbours then indexes, storing at most maxNei of them
+returns the number of indexes on the line*/
+int parse_nei(char * line/*I*/,int * res/*O*/,int maxNei/*I*/);
 
 
 /*Reading and storing spatial information
@@ -81,14 +412,38 @@ returns : void
 */
 void load_nei(FILE * data /*I*/,dataSet * myData/*I\O*/);
 
+/*Counted heap allocation functions, make debug reports their number*/
+void * emMalloc(size_t size);
+void * emCalloc(size_t num, size_t size);
+void * emRealloc(void * ptr, size_t size);
+
+/*Returns an aligned block of the arena, NULL if it only measures*/
+void * arenaAlloc(arena * myArena/*I\O*/,size_t size/*I*/);
+/*Allocates all the buffers of a model in one arena*/
+void createWorkspace(classif * myClassif/*I\O*/,double beta/*I*/);
+/*Releases all the buffers of a model*/
+void freeWorkspace(classif * myClassif/*I\O*/);
+/*Bytes createWorkspace would allocate for a model once numClust, sparseM, pool and the dataset are set*/
+size_t workspaceSize(classif * myClassif/*I*/);
+
 /*Initialize classification randomly
 returns void*/
-void initClassifRand(dataSet set/*I*/,int numClust/*I*/, classif* myClassif/*I\O*/,double beta);
+void initClassifRand(dataSet set/*I*/,int numClust/*I*/, classif* myClassif/*I\O*/,double beta,unsigned seed/*I*/);
 
 /*Initialize classification from file
 returns void*/
 void initClassifFile(dataSet set/*I*/,FILE * data, classif* myClassif/*I\O*/,double beta);
 
+/*Initialize classification from k-means++ seeds drawn on the expression profiles, grown over the neighbour graph if grow is set
+returns void*/
+void initClassifSeeded(dataSet set/*I*/,int numClust/*I*/, classif* myClassif/*I\O*/,double beta/*I*/,unsigned seed/*I*/,int grow/*I*/);
+/*Number of differing bits of two packed expression vectors*/
+int hammingDistance(unsigned long * a/*I*/,unsigned long * b/*I*/,int numWords/*I*/);
+
+/*Initialize classification from the thetas, betas, labels and posteriors written by a previous run
+returns void*/
+void initClassifWarm(dataSet set/*I*/,char * prefix/*I*/, classif* myClassif/*I\O*/,double beta/*I*/,int fixed/*I*/);
+
 
 /*function to check if all elements of the count vector > 0
 * returns 1 if vector contains 0s 0 otherwise
@@ -104,27 +459,70 @@ void noEmptyClass(classif * myClassif);
 double computeFullLogLikelihood(classif * myClassif/*I*/);
 /*Computes the beta part of the expected likelihood*/
 double computeBetaExpectation(classif * myClassif/*I*/);
+/*Beta part of the expected likelihood and its changes when each active beta moves by +-step, in betaTotals*/
+void betaObjective(classif * myClassif/*I/O*/,double step/*I*/);
 /*Computes expectation*/
 double computeFullExpectation(classif * myClassif/*I*/);
 
+/*Rebuilds the exp(beta_k*c) tables of the clusters whose beta changed*/
+void updateExpBetaTables(classif * myClassif/*I/O*/);
+/*Returns the log of the Potts conditional probability of the label of one cell given its neighbours, the tables must be up to date*/
+double cellPottsLogProb(classif * myClassif/*I*/,int cell/*I*/);
+
 double computePseudoLogLikelihood(classif * myClassif/*I*/);
+/*Likelihood cache: drops all the cached values, marks the terms depending on the label of one cell, brings the cache up to date*/
+void invalidateLikelihood(classif * myClassif/*I/O*/);
+void markLabelChanged(classif * myClassif/*I/O*/,int cell/*I*/);
+void refreshPottsCache(classif * myClassif/*I/O*/);
 /*Set model pseudo-logLikelihood*/
 void computeCellDensities(classif * myClassif/*I/O*/);
+/*Best clusters and density sums of each profile, used by the sparse sweeps*/
+void rankProfileDensities(classif * myClassif/*I/O*/);
 double cellDensity(classif * myClassif/*i*/,int clust/*I*/,int cell/*I*/);
 double logCellDensity(classif * myClassif/*i*/,int clust/*I*/,int cell/*I*/);
 
 
-double computeNeiCoef(classif * myClassif/*i\O*/,double ** currentT/*I*/,int clust/*I*/,int cell/*I*/);
+double computeNeiCoef(classif * myClassif/*i\O*/,emReal ** currentT/*I*/,int clust/*I*/,int cell/*I*/);
 
 
 /*Computes current thims*/
 void computeThims(classif * myClassif /*I/O*/, int numIterFixed /*I*/);
 
+/*Updates the posteriors of one cell, dense (neiCoef: numClust scratch) and sparse (neiSum, score: numClust scratch) versions*/
+void updateCellPosteriors(classif * myClassif /*I/O*/, int i /*I*/, double * neiCoef);
+void updateSparseCellPosteriors(classif * myClassif /*I/O*/, int i /*I*/, double * neiSum, double * score);
+
+/*One sweep of the mean field fixed point, fused with the cluster assignment and the M step counts if requested
+returns the number of cells whose cluster changed*/
+int meanFieldSweep(classif * myClassif /*I/O*/, int fused /*I*/);
+
+/*Chooses the kernels specialised for the number of clusters and of expression words*/
+void selectKernels(classif * myClassif /*I/O*/);
+
+/*Sets the posteriors of all cells (dense or sparse) to 0*/
+void clearPosteriors(classif * myClassif /*I/O*/);
+
+/*Sparse posteriors accessors, posterior, posteriorMass and maxPosteriorClust also work on the dense storage*/
+int numTopClust(classif * myClassif/*I*/,int cell/*I*/);
+double residualShare(classif * myClassif/*I*/,int cell/*I*/);
+double posterior(classif * myClassif/*I*/,int clust/*I*/,int cell/*I*/);
+double posteriorMass(classif * myClassif/*I*/,int cell/*I*/);
+int maxPosteriorClust(classif * myClassif/*I*/,int cell/*I*/);
+double sparseCellExpectation(classif * myClassif/*I*/,int cell/*I*/);
+
 /*Gradient descent algorithm to maximize an unique beta*/
 void gradientAscent(classif * myClassif /*I\O*/);
 
-/*E Step of the EM algorithm*/
+/*E Step of the EM algorithm, run by the engine of the model*/
 int eStep(classif * myClassif /*I\O*/);
+/*Mean field E step: posteriors by fixed point, then argmax*/
+int meanFieldEStep(classif * myClassif /*I\O*/);
+/*ICM or Gibbs E step: chromatic sweeps over the labels, the posteriors being set to the labels*/
+int hardEStep(classif * myClassif /*I\O*/);
+/*Greedy colouring of the owned cells, grouped by colour*/
+void colourGraph(classif * myClassif /*I\O*/);
+/*Uniform number in ]0,1[ drawn from a seed and two counters, the same whatever the thread*/
+double counterUniform(unsigned long seed/*I*/,unsigned long counter/*I*/,unsigned long cell/*I*/);
 
 int numCellsAlike(int exp,int indexGene,int clust,classif * myClassif);
 
@@ -134,6 +532,166 @@ void maxThetas(classif * myClassif /*I/O*/);
 /*M Step of the algorithm*/
 void mStep(classif * myClassif,int type_beta);
 
+/*Reads a clustering results file (one label per line), returns the number of points*/
+int load_labels(FILE * data/*I*/,int ** labels/*O*/);
+
+/*Returns the adjusted Rand index between two labellings (labels from 1)*/
+double adjustedRandIndex(int * labelsA/*I*/,int * labelsB/*I*/,int num/*I*/);
+
+/*Opens the output file of a run with the given extension, NULL if it is missing and not required*/
+FILE * openRunFile(char * prefix/*I*/,char * extension/*I*/,int required/*I*/);
+
+/*Compares the outputs of two runs (given as result folder/outputFileName)*/
+void compareRunFiles(char * prefixA/*I*/,char * prefixB/*I*/,runComparison * comparison/*O*/);
+/*Compares the outputs of two runs (given as result folder/outputFileName) and writes a validation report*/
+void compareRuns(char * prefixA/*I*/,char * prefixB/*I*/,FILE * report/*I*/);
+
+/*Writes a synthetic dataset of numGenes genes in prefix.tab, the points being read from a coordinates file or, given as a number, drawn in a cube and written in prefix.csv*/
+void writeSynthetic(char * points/*I*/,char * prefix/*I*/,int numGenes/*I*/,int numClust/*I*/,unsigned long seed/*I*/);
+/*Reads the lines of a profile file
+returns the number of records*/
+int load_profile(FILE * data/*I*/,phaseRecord ** records/*O*/);
+/*Frees the records of a profile file*/
+void freeProfile(phaseRecord * records/*I\O*/,int num/*I*/);
+/*Checks the runs of the profile of an output folder against the golden runs and profile of a reference folder, writing one line per check in report
+returns the number of failed checks*/
+int checkRegression(char * golden/*I*/,char * output/*I*/,char * report/*I*/,regressionLimits * limits/*I*/);
+
+/*Writes a rows x cols array (a vector if cols is 0) of items of kind 'i' or 'f' and the given size as a .npy file*/
+void writeNpy(char * out/*I*/,char kind/*I*/,size_t size/*I*/,int rows/*I*/,int cols/*I*/,void * data/*I*/);
+/*Reads the kind, item size and shape of a .npy file in the byte order of the machine (cols is 0 for a vector)
+returns 1 if the header is valid*/
+int readNpyHeader(FILE * file/*I*/,char * kind/*O*/,size_t * size/*O*/,int * rows/*O*/,int * cols/*O*/);
+/*Writes the labels, posteriors, thetas and betas of a snapshot as prefix[.iterN].name.npy files*/
+void writeSnapshot(snapshotWriter * writer/*I\O*/,modelSnapshot * snapshot/*I*/);
+/*Binary outputs written as prefix.*.npy, by a background thread if background is set*/
+void createSnapshotWriter(snapshotWriter * writer/*O*/,classif * myClassif/*I*/,char * prefix/*I*/,int background/*I*/);
+/*Copies the model and hands it to the writer (iteration -1 for the final outputs), dropped while the previous one still waits unless wait is set*/
+void queueSnapshot(snapshotWriter * writer/*I\O*/,classif * myClassif/*I*/,int iteration/*I*/,int wait/*I*/);
+/*Waits for the pending snapshots and releases the writer*/
+void closeSnapshotWriter(snapshotWriter * writer/*I\O*/);
+
+/*Creates a result folder*/
+void makeFolder(char * path/*I*/);
+/*Sets the posterior storage (sparse=m) and the E step engine (estep=meanfield|icm|gibbs) of a model from the arguments of a run*/
+void modelOptions(int argc/*I*/,char * argv[]/*I*/,classif * myClassif/*O*/,unsigned seed/*I*/);
+/*Initialises a model from the initialisation argument of a run ('rand', labels file or warm=previous run)*/
+void initModel(int argc/*I*/,char * argv[]/*I*/,dataSet set/*I*/,classif * myClassif/*I\O*/,double beta/*I*/,unsigned seed/*I*/);
+/*Runs EM on an initialised model until convergence and writes the outputs as result folder/name
+returns the number of iterations*/
+int fitModel(int argc/*I*/,char * argv[]/*I*/,classif * myClassif/*I\O*/,char * name/*I*/,int type_beta/*I*/);
+/*Reads a beta schedule, a list (0,0.5,1) or a range (start:end:step)*/
+double * parseBetaSchedule(char * schedule/*I*/,int * numBetas/*O*/);
+/*Fits every beta of the schedule with fixed betas, each fit of a segment starting from the previous one, and writes the likelihood versus beta table
+returns the total number of iterations, the likelihood of the last beta in likelihood*/
+int runBetaPath(int argc/*I*/,char * argv[]/*I*/,dataSet set/*I*/,threadPool * pool/*I*/,unsigned seed/*I*/,FILE * log/*I*/,double * likelihood/*O*/);
+/*Fits the model on a loaded dataset with the arguments of a run (argv[2] is not read), progress going to log
+returns the number of iterations, the final expected likelihood in likelihood*/
+int runModel(int argc/*I*/,char * argv[]/*I*/,dataSet set/*I*/,threadPool * pool/*I*/,unsigned seed/*I*/,FILE * log/*I*/,double * likelihood/*O*/);
+/*Seconds elapsed since an arbitrary origin*/
+double wallClock(void);
+/*Peak resident memory of the process in MB, 0 where it is not available*/
+double peakMemory(void);
+/*Appends the wall time since start and the peak memory of a phase of a run to its profile, if any*/
+void recordPhase(FILE * profile/*I*/,char * name/*I*/,char * phase/*I*/,double start/*I*/);
+/*Seconds taken by a fixed loop on this machine, the reference of the phase times of a profile*/
+double calibrationTime(void);
+/*Appends the calibration time of this machine to a profile, if any*/
+void recordCalibration(FILE * profile/*I*/,char * name/*I*/);
+/*Opens a profile file to append to, writing its header if it is new*/
+FILE * openProfile(char * path/*I*/);
+/*Reads a batch manifest, one run per line without the neighbouring file, the datasets being loaded once for all their jobs
+returns the number of jobs*/
+int load_manifest(FILE * manifest/*I*/,char * program/*I*/,char * graph/*I*/,batchRun * run/*O*/);
+void freeManifest(batchRun * run/*I\O*/);
+/*Runs the jobs of a batch on numWorkers workers sharing the neighbouring graph, within a memory budget (bytes, 0 for none)*/
+void runBatch(batchRun * run/*I\O*/,int numWorkers/*I*/,int threadsPerJob/*I*/,size_t budget/*I*/);
+/*Writes the status, iterations, likelihood and wall time of each job of a batch*/
+void outputBatchReport(char * out/*I*/,batchRun * run/*I*/,double wallTime/*I*/);
+
+/*Returns the value of a "name=value" optional command line argument, NULL if absent*/
+char * optionValue(int argc, char * argv[], char * name);
+/*Same for optional arguments starting at argv[first]*/
+char * optionFrom(int argc, char * argv[], int first, char * name);
+
+/*Returns 1 if the optional command line argument is present, 0 otherwise*/
+int hasOption(int argc, char * argv[], char * name);
+
+/*Distributed runs helpers, without MPI (or with a single process) they work on the whole dataset*/
+/*Returns 1 on the process in charge of printing and writing the output files*/
+int isMainProcess(void);
+
+/*Returns the local index of a point of the full dataset, -1 if it is not stored by this process*/
+int localIndex(dataSet * set/*I*/,int globalIndex/*I*/);
+
+/*Sums a vector over all processes*/
+void reduceSumVector(double * vect/*I\O*/,int length/*I*/);
+void reduceSumIntVector(int * vect/*I\O*/,int length/*I*/);
+double reduceSum(double value/*I*/);
+int reduceSumInt(int value/*I*/);
+
+/*Copies the posteriors of the owned points to the processes holding them as halo points*/
+void exchangeHaloPosteriors(classif * myClassif/*I\O*/);
+
+/*Copies the labels of the owned points to the processes holding them as halo points*/
+void exchangeHaloLabels(classif * myClassif/*I\O*/);
+
+/*Collects the labels of all points in the dataset order
+returns a newly allocated vector on the main process, NULL on the others*/
+int * gatherLabels(classif * myClassif/*I*/);
+
+/*Reads the neighbouring file into a compressed graph (start offsets of size num+1 and 0 based neighbours indexes)
+returns the number of points*/
+int load_graph(FILE * data/*I*/,int ** start/*O*/,int ** adj/*O*/);
+
+/*Reads the num first lines of a x,y,z coordinates file*/
+void load_coordinates(FILE * data/*I*/,int num/*I*/,double * coords/*O*/);
+
+/*Recursive coordinate bisection of the points ids[0..num-1] into numParts spatial blocks*/
+void bisectCoordinates(double * coords/*I*/,int * ids/*I\O*/,int num/*I*/,int firstPart/*I*/,int numParts/*I*/,int * owner/*O*/);
+
+/*Graph partitioning by breadth first growth of numParts connected blocks of equal size*/
+void growPartitions(int num/*I*/,int * start/*I*/,int * adj/*I*/,int numParts/*I*/,int * owner/*O*/);
+
+#ifdef USE_MPI
+/*Partitions the dataset over the processes and loads the owned points and their neighbours from the compressed graph, which is freed
+*The partition is a spatial bisection if a coordinates file is given, a graph partition otherwise
+*/
+void load_distributed(FILE * data/*I*/,int numGlobal/*I*/,int * start/*I*/,int * adj/*I*/,FILE * coords/*I*/,dataSet * myData/*O*/);
+#endif
+
+/*Number of processors, the default number of threads*/
+int defaultThreads(void);
+/*Runs work with numThreads threads, each one getting its index in the task*/
+void runThreads(int numThreads/*I*/,void (*work)(threadTask *)/*I*/,void * data/*I*/);
+/*Pool of threads running parallel loops without allocating*/
+void createPool(threadPool * pool/*O*/,int numThreads/*I*/);
+void runPool(threadPool * pool/*I\O*/,void (*work)(threadTask *)/*I*/,void * data/*I*/);
+void destroyPool(threadPool * pool/*I\O*/);
+/*Contiguous block of num items handled by one thread*/
+void threadRange(threadTask * task/*I*/,int num/*I*/,int * first/*O*/,int * last/*O*/);
+
+int compareInts(const void * a, const void * b);
+/*Bins the points in a uniform grid of cells of at least cellSize*/
+void buildGrid(neighbourGrid * grid/*O*/,double * coords/*I*/,int num/*I*/,double cellSize/*I*/);
+void freeGrid(neighbourGrid * grid/*I\O*/);
+/*Neighbours of one point within a radius, counted only if nei is NULL, and its k nearest neighbours
+returns the number of neighbours*/
+int radiusNeighbours(neighbourGrid * grid/*I*/,int i/*I*/,double radius/*I*/,int * nei/*O*/);
+int nearestNeighbours(neighbourGrid * grid/*I*/,int i/*I*/,int k/*I*/,int * nei/*O*/,double * dist/*O*/);
+/*Builds the compressed neighbouring graph of 3D points, within radius or (knn > 0) from the knn nearest points made symmetric
+returns the number of points*/
+int buildNeighbourGraph(double * coords/*I*/,int num/*I*/,double radius/*I*/,int knn/*I*/,int numThreads/*I*/,int ** start/*O*/,int ** adj/*O*/);
+/*Writes a compressed graph as a neighbouring file*/
+void outputGraph(FILE * out/*I*/,int num/*I*/,int * start/*I*/,int * adj/*I*/);
+/*Number of lines of a file, rewound afterwards*/
+int count_lines(FILE * data/*I*/);
+/*Reads the neighbouring file, or builds the graph from the coordinates file if radius or knn is positive
+returns the number of points*/
+int load_graph_input(char * path/*I*/,double radius/*I*/,int knn/*I*/,int numThreads/*I*/,int ** start/*O*/,int ** adj/*O*/);
+/*Stores the neighbours of a compressed graph in the points of a serial dataset, pointing in adj instead of copying them if share is set*/
+void setNeighbours(dataSet * myData/*I\O*/,int num/*I*/,int * start/*I*/,int * adj/*I*/,int share/*I*/);
+
 
 
 /****************************END function prototypes***********************************/